@@ -1,13 +1,21 @@
 const { src, dest, task, series } = require('gulp');
+const crypto = require('crypto');
+const fs = require('fs');
+const path = require('path');
+const zlib = require('zlib');
 const clean = require('gulp-clean');
-const gzip = require('gulp-gzip');
 const inlineSource = require('gulp-inline-source');
 const rename = require('gulp-rename');
 const through2 = require('through2');
 
-const genHeader = (size, buf, len) => {
+const genArray = (name, buf) => {
+    const len = buf.length;
+    if (len === 0) {
+        return `unsigned char ${name}[1] = {0};\nunsigned int ${name}_len = 0;\n`;
+    }
+
     let idx = 0;
-    let data = 'unsigned char index_html[] = {\n  ';
+    let data = `unsigned char ${name}[] = {\n  `;
 
     for (const value of buf) {
         idx++;
@@ -26,11 +34,132 @@ const genHeader = (size, buf, len) => {
     }
 
     data += '};\n';
-    data += `unsigned int index_html_len = ${len};\n`;
-    data += `unsigned int index_html_size = ${size};\n`;
+    data += `unsigned int ${name}_len = ${len};\n`;
+    return data;
+};
+
+const hashOf = buf => crypto.createHash('sha256').update(buf).digest('hex').substring(0, 16);
+
+// zstd is only available in newer node versions (>= 22.15), the variant is left empty otherwise
+const compress = buf => {
+    const { constants } = zlib;
+    return {
+        gz: zlib.gzipSync(buf, { level: constants.Z_BEST_COMPRESSION }),
+        br: zlib.brotliCompressSync(buf, {
+            params: {
+                [constants.BROTLI_PARAM_MODE]: constants.BROTLI_MODE_TEXT,
+                [constants.BROTLI_PARAM_QUALITY]: constants.BROTLI_MAX_QUALITY,
+                [constants.BROTLI_PARAM_SIZE_HINT]: buf.length,
+            },
+        }),
+        zst: zlib.zstdCompressSync
+            ? zlib.zstdCompressSync(buf, { params: { [constants.ZSTD_c_compressionLevel]: 19 } })
+            : Buffer.alloc(0),
+    };
+};
+
+// the index is split before </body>, each encoding of the head is left open so ttyd can append its config
+// and the rest of the page at startup without compressing the page again (see index_builtin in http.c):
+// gzip without the trailer after a sync flush, brotli without the last meta-block after a flush, and
+// zstd without the last block after a flush and no checksum
+const compressHead = buf => {
+    const { constants } = zlib;
+    return {
+        gz: zlib.gzipSync(buf, { level: constants.Z_BEST_COMPRESSION, finishFlush: constants.Z_SYNC_FLUSH }),
+        br: zlib.brotliCompressSync(buf, {
+            finishFlush: constants.BROTLI_OPERATION_FLUSH,
+            params: {
+                [constants.BROTLI_PARAM_MODE]: constants.BROTLI_MODE_TEXT,
+                [constants.BROTLI_PARAM_QUALITY]: constants.BROTLI_MAX_QUALITY,
+                [constants.BROTLI_PARAM_SIZE_HINT]: buf.length,
+            },
+        }),
+        zst: zlib.zstdCompressSync
+            ? zlib.zstdCompressSync(buf, {
+                  finishFlush: constants.ZSTD_e_flush,
+                  params: {
+                      [constants.ZSTD_c_compressionLevel]: 19,
+                      [constants.ZSTD_c_checksumFlag]: 0,
+                  },
+              })
+            : Buffer.alloc(0),
+    };
+};
+
+const mimeTypes = {
+    '.js': 'application/javascript',
+    '.css': 'text/css',
+};
+
+// the scripts and styles left next to index.html in asset mode, served by their hashed names
+const readAssets = () => {
+    return fs
+        .readdirSync('dist')
+        .filter(name => mimeTypes[path.extname(name)] !== undefined)
+        .sort()
+        .map(name => ({ name, contents: fs.readFileSync(path.join('dist', name)) }));
+};
+
+const genAssets = assets => {
+    let data = 'struct html_asset {\n';
+    data += '  const char *path;\n';
+    data += '  const char *type;\n';
+    data += '  const char *hash;\n';
+    data += '  unsigned int size;\n';
+    data += '  const unsigned char *gz, *br, *zst;\n';
+    data += '  unsigned int gz_len, br_len, zst_len;\n';
+    data += '};\n';
+
+    const entries = assets.map((asset, i) => {
+        const { gz, br, zst } = compress(asset.contents);
+        const name = `html_asset_${i}`;
+        data += genArray(`${name}_gz`, gz);
+        data += genArray(`${name}_br`, br);
+        data += genArray(`${name}_zst`, zst);
+        const type = mimeTypes[path.extname(asset.name)];
+        const hash = hashOf(asset.contents);
+        return (
+            `  {"${asset.name}", "${type}", "${hash}", ${asset.contents.length}, ` +
+            `${name}_gz, ${name}_br, ${name}_zst, ${gz.length}, ${br.length}, ${zst.length}},\n`
+        );
+    });
+
+    if (entries.length === 0) {
+        data += 'const struct html_asset html_assets[1] = {{0}};\n';
+    } else {
+        data += `const struct html_asset html_assets[] = {\n${entries.join('')}};\n`;
+    }
+    data += `unsigned int html_assets_count = ${entries.length};\n`;
     return data;
 };
-let fileSize = 0;
+
+const genHeader = (contents, assets) => {
+    const pos = contents.lastIndexOf('</body>');
+    if (pos < 0) throw new Error('no </body> in index.html');
+    const head = contents.subarray(0, pos);
+    const { gz, br, zst } = compressHead(head);
+    let data = genArray('index_html', gz);
+    data += `unsigned int index_html_size = ${head.length};\n`;
+    // used with the injected config as the ETag of the embedded index
+    data += `const char index_html_hash[] = "${hashOf(contents)}";\n`;
+    data += genArray('index_html_br', br);
+    data += genArray('index_html_zst', zst);
+    data += genArray('index_html_tail', contents.subarray(pos));
+    data += genAssets(assets);
+    return data;
+};
+
+const buildHeader = withAssets => {
+    return src('dist/inline.html')
+        .pipe(
+            through2.obj((file, enc, cb) => {
+                file.contents = Buffer.from(genHeader(file.contents, withAssets ? readAssets() : []));
+                return cb(null, file);
+            })
+        )
+        .pipe(rename('html.h'))
+        .pipe(dest('../src/'));
+};
 
 task('clean', () => {
     return src('dist', { read: false, allowEmpty: true }).pipe(clean());
@@ -44,25 +173,6 @@ task('inline', () => {
     return src('dist/index.html').pipe(inlineSource(options)).pipe(rename('inline.html')).pipe(dest('dist/'));
 });
 
-task(
-    'default',
-    series('inline', () => {
-        return src('dist/inline.html')
-            .pipe(
-                through2.obj((file, enc, cb) => {
-                    fileSize = file.contents.length;
-                    return cb(null, file);
-                })
-            )
-            .pipe(gzip())
-            .pipe(
-                through2.obj((file, enc, cb) => {
-                    const buf = file.contents;
-                    file.contents = Buffer.from(genHeader(fileSize, buf, buf.length));
-                    return cb(null, file);
-                })
-            )
-            .pipe(rename('html.h'))
-            .pipe(dest('../src/'));
-    })
-);
+task('default', series('inline', () => buildHeader(false)));
+
+task('assets', series('inline', () => buildHeader(true)));
@@ -7,6 +7,7 @@ export class OverlayAddon implements ITerminalAddon {
     private terminal: Terminal;
     private overlayNode: HTMLElement;
     private overlayTimeout?: number;
+    private statusNode?: HTMLElement;
 
     constructor() {
         this.overlayNode = document.createElement('div');
@@ -34,7 +35,35 @@ position: absolute;
         this.terminal = terminal;
     }
 
-    dispose(): void {}
+    dispose(): void {
+        this.statusNode?.remove();
+    }
+
+    // a small persistent label in the top right corner
+    @bind
+    showStatus(msg: string): void {
+        const { terminal } = this;
+        if (!terminal.element) return;
+
+        if (!this.statusNode) {
+            this.statusNode = document.createElement('div');
+            this.statusNode.style.cssText = `border-radius: 4px;
+color: #101010;
+background-color: #f0f0f0;
+font-size: small;
+opacity: 0.6;
+padding: 0.1em 0.4em;
+position: absolute;
+top: 4px;
+right: 4px;
+z-index: 10;
+pointer-events: none;
+-webkit-user-select: none;
+-moz-user-select: none;`;
+        }
+        this.statusNode.textContent = msg;
+        if (!this.statusNode.parentNode) terminal.element.appendChild(this.statusNode);
+    }
 
     @bind
     showOverlay(msg: string, timeout?: number): void {
@@ -3,13 +3,12 @@ import type { IDisposable, ITerminalOptions } from '@xterm/xterm';
 import { Terminal } from '@xterm/xterm';
 import { CanvasAddon } from '@xterm/addon-canvas';
 import { ClipboardAddon } from '@xterm/addon-clipboard';
-import { WebglAddon } from '@xterm/addon-webgl';
+import type { WebglAddon } from '@xterm/addon-webgl';
 import { FitAddon } from '@xterm/addon-fit';
 import { WebLinksAddon } from '@xterm/addon-web-links';
-import { ImageAddon } from '@xterm/addon-image';
 import { Unicode11Addon } from '@xterm/addon-unicode11';
 import { OverlayAddon } from './addons/overlay';
-import { ZmodemAddon } from './addons/zmodem';
+import type { ZmodemAddon } from './addons/zmodem';
 
 import '@xterm/xterm/css/xterm.css';
 
@@ -20,6 +19,8 @@ interface TtydTerminal extends Terminal {
 declare global {
     interface Window {
         term: TtydTerminal;
+        // injected into the page by ttyd, saves the token fetch and the SET_PREFERENCES round trip
+        ttydConfig?: { token: string; prefs: Preferences };
     }
 }
 
@@ -28,12 +29,14 @@ enum Command {
     OUTPUT = '0',
     SET_WINDOW_TITLE = '1',
     SET_PREFERENCES = '2',
+    LATENCY = '3',
 
     // client side
     INPUT = '0',
     RESIZE_TERMINAL = '1',
     PAUSE = '2',
     RESUME = '3',
+    LATENCY_PROBE = '4',
 }
 type Preferences = ITerminalOptions & ClientOptions;
 
@@ -51,6 +54,12 @@ export interface ClientOptions {
     trzszDragInitTimeout: number;
     unicodeVersion: string;
     closeOnDisconnect: boolean;
+    latencyProbe: boolean;
+}
+
+interface LatencyProbe {
+    id: number;
+    sent: number;
 }
 
 export interface FlowControl {
@@ -95,12 +104,17 @@ export class Xterm {
     private socket?: WebSocket;
     private token: string;
     private opened = false;
+    private prefsApplied = false;
     private title?: string;
     private titleFixed?: string;
     private resizeOverlay = true;
     private reconnect = true;
     private doReconnect = true;
     private closeOnDisconnect = false;
+    private latencyProbe = false;
+    private probe?: LatencyProbe;
+    private probeId = 0;
+    private probeAt = 0;
 
     private writeFunc = (data: ArrayBuffer) => this.writeData(new Uint8Array(data));
 
@@ -129,6 +143,11 @@ export class Xterm {
 
     @bind
     public async refreshToken() {
+        const config = window.ttydConfig;
+        if (!this.opened && config) {
+            this.token = config.token;
+            return;
+        }
         try {
             const resp = await fetch(this.options.tokenUrl);
             if (resp.ok) {
@@ -167,6 +186,16 @@ export class Xterm {
 
         terminal.open(parent);
         fitAddon.fit();
+
+        const config = window.ttydConfig;
+        if (config) {
+            this.applyPreferences({
+                ...this.options.clientOptions,
+                ...config.prefs,
+                ...this.parseOptsFromUrlQuery(window.location.search),
+            } as Preferences);
+            this.prefsApplied = true;
+        }
     }
 
     @bind
@@ -179,7 +208,12 @@ export class Xterm {
                 }
             })
         );
-        register(terminal.onData(data => sendData(data)));
+        register(
+            terminal.onData(data => {
+                this.sendProbe();
+                sendData(data);
+            })
+        );
         register(terminal.onBinary(data => sendData(Uint8Array.from(data, v => v.charCodeAt(0)))));
         register(
             terminal.onResize(({ cols, rows }) => {
@@ -226,6 +260,35 @@ export class Xterm {
         }
     }
 
+    // at most one probe per second is in flight, the server answers once the echo of the input that
+    // follows it is sent, a probe that didn't get an answer (eg: no echo) is given up after 5 seconds
+    @bind
+    private sendProbe() {
+        const { socket, textEncoder } = this;
+        if (!this.latencyProbe || socket?.readyState !== WebSocket.OPEN) return;
+        const now = performance.now();
+        if (now - this.probeAt < (this.probe ? 5000 : 1000)) return;
+
+        this.probeAt = now;
+        this.probe = { id: ++this.probeId, sent: now };
+        socket.send(textEncoder.encode(Command.LATENCY_PROBE + JSON.stringify({ id: this.probe.id })));
+    }
+
+    @bind
+    private onLatency(data: { id: number; pty: number; queue: number; server: number }) {
+        const { probe, socket, textEncoder } = this;
+        if (!probe || probe.id !== data.id) return;
+
+        const rtt = performance.now() - probe.sent;
+        socket?.send(textEncoder.encode(Command.LATENCY_PROBE + JSON.stringify({ id: data.id, rtt: rtt })));
+        this.probe = undefined;
+
+        const network = Math.max(rtt - data.server, 0);
+        this.overlayAddon.showStatus(
+            `${rtt.toFixed(0)} ms (net ${network.toFixed(1)}, pty ${data.pty.toFixed(1)}, queue ${data.queue.toFixed(1)})`
+        );
+    }
+
     @bind
     public sendData(data: string | Uint8Array) {
         const { socket, textEncoder } = this;
@@ -261,7 +324,12 @@ export class Xterm {
         console.log('[ttyd] websocket connection opened');
 
         const { textEncoder, terminal, overlayAddon } = this;
-        const msg = JSON.stringify({ AuthToken: this.token, columns: terminal.cols, rows: terminal.rows });
+        const msg = JSON.stringify({
+            AuthToken: this.token,
+            columns: terminal.cols,
+            rows: terminal.rows,
+            skipPreferences: this.prefsApplied,
+        });
         this.socket?.send(textEncoder.encode(msg));
 
         if (this.opened) {
@@ -354,7 +422,11 @@ export class Xterm {
                 this.title = textDecoder.decode(data);
                 document.title = this.title;
                 break;
+            case Command.LATENCY:
+                this.onLatency(JSON.parse(textDecoder.decode(data)));
+                break;
             case Command.SET_PREFERENCES:
+                if (this.prefsApplied) break;
                 this.applyPreferences({
                     ...this.options.clientOptions,
                     ...JSON.parse(textDecoder.decode(data)),
@@ -371,17 +443,23 @@ export class Xterm {
     private applyPreferences(prefs: Preferences) {
         const { terminal, fitAddon, register } = this;
         if (prefs.enableZmodem || prefs.enableTrzsz) {
-            this.zmodemAddon = new ZmodemAddon({
-                zmodem: prefs.enableZmodem,
-                trzsz: prefs.enableTrzsz,
-                windows: prefs.isWindows,
-                trzszDragInitTimeout: prefs.trzszDragInitTimeout,
-                onSend: this.sendCb,
-                sender: this.sendData,
-                writer: this.writeData,
+            // the addon is loaded on demand, hold the output back until it can inspect it
+            const pending: ArrayBuffer[] = [];
+            this.writeFunc = data => pending.push(data);
+            import(/* webpackChunkName: "zmodem" */ './addons/zmodem').then(({ ZmodemAddon }) => {
+                this.zmodemAddon = new ZmodemAddon({
+                    zmodem: prefs.enableZmodem,
+                    trzsz: prefs.enableTrzsz,
+                    windows: prefs.isWindows,
+                    trzszDragInitTimeout: prefs.trzszDragInitTimeout,
+                    onSend: this.sendCb,
+                    sender: this.sendData,
+                    writer: this.writeData,
+                });
+                this.writeFunc = data => this.zmodemAddon?.consume(data);
+                terminal.loadAddon(register(this.zmodemAddon));
+                for (const data of pending) this.writeFunc(data);
             });
-            this.writeFunc = data => this.zmodemAddon?.consume(data);
-            terminal.loadAddon(register(this.zmodemAddon));
         }
 
         for (const [key, value] of Object.entries(prefs)) {
@@ -419,8 +497,10 @@ export class Xterm {
                     break;
                 case 'enableSixel':
                     if (value) {
-                        terminal.loadAddon(register(new ImageAddon()));
-                        console.log('[ttyd] Sixel enabled');
+                        import(/* webpackChunkName: "image" */ '@xterm/addon-image').then(({ ImageAddon }) => {
+                            terminal.loadAddon(register(new ImageAddon()));
+                            console.log('[ttyd] Sixel enabled');
+                        });
                     }
                     break;
                 case 'closeOnDisconnect':
@@ -431,6 +511,12 @@ export class Xterm {
                         this.doReconnect = false;
                     }
                     break;
+                case 'latencyProbe':
+                    if (value) {
+                        console.log('[ttyd] latency probe enabled');
+                        this.latencyProbe = true;
+                    }
+                    break;
                 case 'titleFixed':
                     if (!value || value === '') return;
                     console.log(`[ttyd] setting fixed title: ${value}`);
@@ -499,7 +585,9 @@ export class Xterm {
                 disposeCanvasRenderer();
             }
         };
-        const enableWebglRenderer = () => {
+        const enableWebglRenderer = async () => {
+            if (this.webglAddon) return;
+            const { WebglAddon } = await import(/* webpackChunkName: "webgl" */ '@xterm/addon-webgl');
             if (this.webglAddon) return;
             this.webglAddon = new WebglAddon();
             disposeCanvasRenderer();
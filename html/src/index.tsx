@@ -6,4 +6,10 @@ import { h, render } from 'preact';
 import { App } from './components/app';
 import './style/index.scss';
 
-render(<App />, document.body);
+// ttyd appends window.ttydConfig after this script, it's there once the document is parsed
+const start = () => render(<App />, document.body);
+if (document.readyState === 'loading') {
+    document.addEventListener('DOMContentLoaded', start);
+} else {
+    start();
+}
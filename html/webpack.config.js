@@ -1,4 +1,5 @@
 const path = require('path');
+const { optimize } = require('webpack');
 const { merge } = require('webpack-merge');
 const ESLintPlugin = require('eslint-webpack-plugin');
 const CopyWebpackPlugin = require('copy-webpack-plugin');
@@ -8,6 +9,9 @@ const CssMinimizerPlugin = require('css-minimizer-webpack-plugin');
 const TerserPlugin = require('terser-webpack-plugin');
 
 const devMode = process.env.NODE_ENV !== 'production';
+// asset mode keeps the scripts and styles as separate content-hashed files (see `gulp assets`),
+// otherwise everything is inlined into index.html and the on-demand chunks are folded back in
+const assetMode = process.env.TTYD_ASSETS === '1';
 
 const baseConfig = {
     context: path.resolve(__dirname, 'src'),
@@ -17,6 +21,7 @@ const baseConfig = {
     output: {
         path: path.resolve(__dirname, 'dist'),
         filename: devMode ? '[name].js' : '[name].[contenthash].js',
+        chunkFilename: devMode ? '[name].js' : '[name].[contenthash].js',
     },
     module: {
         rules: [
@@ -54,8 +59,9 @@ const baseConfig = {
             },
             title: 'ttyd - Terminal',
             template: './template.html',
+            inline: !assetMode,
         }),
-    ],
+    ].concat(devMode || assetMode ? [] : [new optimize.LimitChunkCountPlugin({ maxChunks: 1 })]),
     performance: {
         hints: false,
     },
@@ -0,0 +1,702 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "pty.h"
+#include "utils.h"
+
+#if defined(__APPLE__)
+#include <crt_externs.h>
+#define environ (*_NSGetEnviron())
+#elif !defined(_WIN32)
+extern char **environ;
+#endif
+
+#define CHUNK_SIZE 65536
+
+// pipe: a larger pipe buffer and reads, a log tail streams with a few big reads instead of many small ones
+#define PIPE_SIZE (1024 * 1024)
+#define PIPE_READ_SIZE (256 * 1024)
+
+static bool no_resize(pty_process *process) { return false; }
+
+static int discard_input(pty_process *process, pty_buf_t *buf) {
+  pty_buf_free(buf);
+  return 0;
+}
+
+#ifndef _WIN32
+// pipe: the command runs without a terminal, stdout and stderr share one pipe.
+// the session ends once the process exited and its output is read up to EOF, output still in the pipe
+// when the process exits is delivered first.
+
+typedef struct {
+  bool exited;  // the exit status is recorded
+  bool eof;     // the output is read up to EOF
+  bool killed;  // the session is closing, the output left in the pipe isn't needed
+  bool done;    // pty_exited was called
+} pipe_state_t;
+
+static void process_close_cb(uv_handle_t *handle) { free(handle); }
+
+static void pipe_finish(pty_process *process) {
+  pipe_state_t *p = (pipe_state_t *) process->data;
+  if (p->done) return;
+  p->done = true;
+  uv_read_stop((uv_stream_t *) process->out);
+  pty_exited(process);
+}
+
+static void pipe_exit_cb(uv_process_t *handle, int64_t exit_status, int term_signal) {
+  pty_process *process = (pty_process *) handle->data;
+  uv_close((uv_handle_t *) handle, process_close_cb);
+  if (process == NULL) return;
+  process->exit_code = (int) exit_status;
+  if (term_signal > 0) {
+    process->exit_code = 128 + term_signal;
+    process->exit_signal = term_signal;
+  }
+  pipe_state_t *p = (pipe_state_t *) process->data;
+  p->exited = true;
+  if (p->eof || p->killed) pipe_finish(process);
+}
+
+static void pipe_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  buf->base = xmalloc(PIPE_READ_SIZE);
+  buf->len = PIPE_READ_SIZE;
+}
+
+static void pipe_read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
+  pty_process *process = (pty_process *) stream->data;
+  if (n == UV_ENOBUFS || n == 0) {
+    if (buf->base != NULL) free(buf->base);
+    return;
+  }
+  uv_read_stop(stream);
+  if (n < 0) {
+    free(buf->base);
+    if (n != UV_EOF) fprintf(stderr, "pipe: read failed: %s\n", uv_strerror((int) n));
+    pipe_state_t *p = (pipe_state_t *) process->data;
+    p->eof = true;
+    if (p->exited) pipe_finish(process);
+    return;
+  }
+  pty_buf_t *data = xmalloc(sizeof(pty_buf_t));
+  data->base = buf->base;
+  data->len = (size_t) n;
+  pty_deliver(process, data);
+}
+
+// the inherited environment with process->envp on top
+static char **pipe_env(pty_process *process) {
+  int n = 0, m = 0;
+  while (environ[n] != NULL) n++;
+  while (process->envp != NULL && process->envp[m] != NULL) m++;
+  char **env = xmalloc((n + m + 1) * sizeof(char *));
+  int k = 0;
+  for (int i = 0; i < n; i++) {
+    bool replaced = false;
+    for (int j = 0; j < m && !replaced; j++) {
+      const char *eq = strchr(process->envp[j], '=');
+      size_t len = eq != NULL ? (size_t) (eq - process->envp[j]) + 1 : strlen(process->envp[j]);
+      replaced = strncmp(environ[i], process->envp[j], len) == 0;
+    }
+    if (!replaced) env[k++] = environ[i];
+  }
+  for (int j = 0; j < m; j++) env[k++] = process->envp[j];
+  env[k] = NULL;
+  return env;
+}
+
+static int pipe_spawn(pty_process *process) {
+  int fds[2];
+  if (pipe(fds) != 0) return -errno;
+  // the child gets the write end as a dup, other children must not hold it open
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#ifdef F_SETPIPE_SZ
+  // best effort, capped by /proc/sys/fs/pipe-max-size for unprivileged users
+  fcntl(fds[0], F_SETPIPE_SZ, PIPE_SIZE);
+#endif
+
+  process->in = xmalloc(sizeof(uv_pipe_t));
+  process->out = xmalloc(sizeof(uv_pipe_t));
+  uv_pipe_init(process->loop, process->in, 0);
+  uv_pipe_init(process->loop, process->out, 0);
+
+  uv_stdio_container_t stdio[3];
+  stdio[0].flags = UV_CREATE_PIPE | UV_READABLE_PIPE;
+  stdio[0].data.stream = (uv_stream_t *) process->in;
+  stdio[1].flags = UV_INHERIT_FD;
+  stdio[1].data.fd = fds[1];
+  stdio[2].flags = UV_INHERIT_FD;
+  stdio[2].data.fd = fds[1];
+
+  uv_process_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.file = process->argv[0];
+  options.args = process->argv;
+  options.env = pipe_env(process);
+  options.cwd = process->cwd;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+  options.exit_cb = pipe_exit_cb;
+  options.flags = UV_PROCESS_DETACHED;  // a new session, so kill reaches the process group
+
+  uv_process_t *handle = xmalloc(sizeof(uv_process_t));
+  handle->data = process;
+  int status = uv_spawn(process->loop, handle, &options);
+  free(options.env);
+  close(fds[1]);
+  if (status != 0) {
+    close(fds[0]);
+    uv_close((uv_handle_t *) handle, process_close_cb);
+    return status;
+  }
+
+  status = uv_pipe_open(process->out, fds[0]);
+  if (status != 0) {
+    close(fds[0]);
+    handle->data = NULL;
+    uv_process_kill(handle, SIGKILL);
+    return status;
+  }
+  process->pid = handle->pid;
+  process->data = xmalloc(sizeof(pipe_state_t));
+  memset(process->data, 0, sizeof(pipe_state_t));
+  return 0;
+}
+
+static bool pipe_resume(pty_process *process) {
+  pipe_state_t *p = (pipe_state_t *) process->data;
+  if (p->eof) return false;
+  process->out->data = process;
+  return uv_read_start((uv_stream_t *) process->out, pipe_alloc_cb, pipe_read_cb) == 0;
+}
+
+static bool pipe_kill(pty_process *process, int sig) {
+  pipe_state_t *p = (pipe_state_t *) process->data;
+  bool ok = uv_kill(-process->pid, sig) == 0;
+  p->killed = true;
+  if (p->exited) pipe_finish(process);
+  return ok;
+}
+
+static bool pipe_running(pty_process *process) {
+  pipe_state_t *p = (pipe_state_t *) process->data;
+  return p != NULL && !p->done;
+}
+
+static void pipe_free(pty_process *process) {
+  free(process->data);
+  process->data = NULL;
+}
+
+const pty_backend pty_backend_pipe = {"pipe",    pipe_spawn, pty_stream_pause, pipe_resume,  pty_stream_write,
+                                      no_resize, pipe_kill,  pipe_running,     pipe_free, NULL};
+#endif
+
+// socket: each session connects to an existing socket, argv[0] is unix:PATH (or just an absolute path)
+// or tcp:HOST:PORT. bytes are pumped both ways with the same flow control as a pty, there is no resize.
+
+typedef struct {
+  union {
+    uv_handle_t handle;
+    uv_stream_t stream;
+    uv_pipe_t pipe;
+    uv_tcp_t tcp;
+  } h;                     // first member, the close callback frees the state through it
+  pty_process *process;    // NULL once the session is freed
+  uv_connect_t connect;
+  uv_getaddrinfo_t resolve;
+  bool resolving;
+  bool connected;
+  bool done;
+  char *pending;           // input written before the connection was up
+  size_t pending_len;
+} socket_t;
+
+static void socket_close_cb(uv_handle_t *handle) {
+  socket_t *c = (socket_t *) handle;
+  if (c->pending != NULL) free(c->pending);
+  free(c);
+}
+
+static void socket_finish(pty_process *process, int code, int sig) {
+  socket_t *c = (socket_t *) process->data;
+  if (c->done) return;
+  c->done = true;
+  if (c->connected) uv_read_stop(&c->h.stream);
+  process->exit_code = code;
+  process->exit_signal = sig;
+  pty_exited(process);
+}
+
+static void socket_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  buf->base = xmalloc(suggested_size);
+  buf->len = suggested_size;
+}
+
+static void socket_read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
+  socket_t *c = (socket_t *) stream;
+  if (n == UV_ENOBUFS || n == 0) {
+    if (buf->base != NULL) free(buf->base);
+    return;
+  }
+  uv_read_stop(stream);
+  if (n < 0) {
+    free(buf->base);
+    if (n != UV_EOF) fprintf(stderr, "socket: read failed: %s\n", uv_strerror((int) n));
+    socket_finish(c->process, n == UV_EOF ? 0 : 1, 0);
+    return;
+  }
+  pty_buf_t *data = xmalloc(sizeof(pty_buf_t));
+  data->base = buf->base;
+  data->len = (size_t) n;
+  pty_deliver(c->process, data);
+}
+
+static void socket_write_cb(uv_write_t *req, int status) {
+  pty_buf_free((pty_buf_t *) req->data);
+  free(req);
+}
+
+static int socket_send(socket_t *c, pty_buf_t *buf) {
+  uv_buf_t b = uv_buf_init(buf->base, buf->len);
+  uv_write_t *req = xmalloc(sizeof(uv_write_t));
+  req->data = buf;
+  int status = uv_write(req, &c->h.stream, &b, 1, socket_write_cb);
+  if (status != 0) {
+    pty_buf_free(buf);
+    free(req);
+  }
+  return status;
+}
+
+static void socket_connect_cb(uv_connect_t *req, int status) {
+  socket_t *c = (socket_t *) req->data;
+  if (c->process == NULL) return;
+  if (status != 0) {
+    fprintf(stderr, "socket: connect to %s failed: %s\n", c->process->argv[0], uv_strerror(status));
+    socket_finish(c->process, 1, 0);
+    return;
+  }
+  c->connected = true;
+  if (c->pending != NULL) {
+    socket_send(c, pty_buf_init(c->pending, c->pending_len));
+    free(c->pending);
+    c->pending = NULL;
+    c->pending_len = 0;
+  }
+  if (!c->process->paused && !c->done) uv_read_start(&c->h.stream, socket_alloc_cb, socket_read_cb);
+}
+
+static void socket_resolve_cb(uv_getaddrinfo_t *req, int status, struct addrinfo *res) {
+  socket_t *c = (socket_t *) req->data;
+  c->resolving = false;
+  if (c->process == NULL) {
+    if (res != NULL) uv_freeaddrinfo(res);
+    uv_close(&c->h.handle, socket_close_cb);
+    return;
+  }
+  if (status == 0 && !c->done) status = uv_tcp_connect(&c->connect, &c->h.tcp, res->ai_addr, socket_connect_cb);
+  if (res != NULL) uv_freeaddrinfo(res);
+  if (status != 0) socket_connect_cb(&c->connect, status);
+}
+
+static int socket_spawn(pty_process *process) {
+  const char *target = process->argv != NULL ? process->argv[0] : NULL;
+  if (target == NULL) return UV_EINVAL;
+
+  socket_t *c = xmalloc(sizeof(socket_t));
+  memset(c, 0, sizeof(socket_t));
+  c->process = process;
+  c->connect.data = c;
+  c->resolve.data = c;
+
+  if (strncmp(target, "tcp:", 4) == 0) {
+    char host[256];
+    const char *port = strrchr(target + 4, ':');
+    const char *start = target + 4;
+    size_t len = port != NULL ? (size_t) (port - start) : 0;
+    // [::1]:port
+    if (len >= 2 && start[0] == '[' && start[len - 1] == ']') {
+      start++;
+      len -= 2;
+    }
+    if (port == NULL || len == 0 || len >= sizeof(host) || port[1] == '\0') {
+      free(c);
+      return UV_EINVAL;
+    }
+    memcpy(host, start, len);
+    host[len] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    uv_tcp_init(process->loop, &c->h.tcp);
+    uv_tcp_nodelay(&c->h.tcp, 1);
+    int status = uv_getaddrinfo(process->loop, &c->resolve, socket_resolve_cb, host, port + 1, &hints);
+    if (status != 0) {
+      uv_close(&c->h.handle, socket_close_cb);
+      return status;
+    }
+    c->resolving = true;
+  } else {
+    const char *path = strncmp(target, "unix:", 5) == 0 ? target + 5 : target;
+    if (path[0] == '\0') {
+      free(c);
+      return UV_EINVAL;
+    }
+    uv_pipe_init(process->loop, &c->h.pipe, 0);
+    uv_pipe_connect(&c->connect, &c->h.pipe, path, socket_connect_cb);
+  }
+
+  process->data = c;
+  return 0;
+}
+
+static void socket_pause(pty_process *process) {
+  socket_t *c = (socket_t *) process->data;
+  if (c->connected) uv_read_stop(&c->h.stream);
+}
+
+static bool socket_resume(pty_process *process) {
+  socket_t *c = (socket_t *) process->data;
+  if (c->done) return false;
+  // not connected yet: reading starts once it is
+  if (!c->connected) return true;
+  return uv_read_start(&c->h.stream, socket_alloc_cb, socket_read_cb) == 0;
+}
+
+static int socket_write(pty_process *process, pty_buf_t *buf) {
+  socket_t *c = (socket_t *) process->data;
+  if (c->done) {
+    pty_buf_free(buf);
+    return 0;
+  }
+  if (c->connected) return socket_send(c, buf);
+  c->pending = xrealloc(c->pending, c->pending_len + buf->len);
+  memcpy(c->pending + c->pending_len, buf->base, buf->len);
+  c->pending_len += buf->len;
+  pty_buf_free(buf);
+  return 0;
+}
+
+static bool socket_kill(pty_process *process, int sig) {
+  socket_finish(process, 128 + sig, sig);
+  return true;
+}
+
+static bool socket_running(pty_process *process) {
+  socket_t *c = (socket_t *) process->data;
+  return c != NULL && !c->done;
+}
+
+static void socket_free(pty_process *process) {
+  socket_t *c = (socket_t *) process->data;
+  if (c == NULL) return;
+  c->process = NULL;
+  process->data = NULL;
+  // the resolve callback closes the handle, the request lives in the state
+  if (!c->resolving) uv_close(&c->h.handle, socket_close_cb);
+}
+
+const pty_backend pty_backend_socket = {"socket",  socket_spawn, socket_pause,   socket_resume, socket_write,
+                                        no_resize, socket_kill,  socket_running, socket_free, NULL};
+
+// replay: the file argv[0] is the output, as fast as the client takes it. input is ignored.
+
+typedef struct {
+  pty_process *process;  // NULL once the session is freed
+  uv_file fd;
+  int64_t offset;
+  uv_fs_t req;
+  uv_timer_t timer;
+  bool reading;          // a read is in flight
+  bool closed;           // the timer is closed
+  bool done;
+  size_t pending;        // bytes read and not delivered yet
+  char buf[CHUNK_SIZE];
+} replay_t;
+
+static void replay_state_free(replay_t *r) {
+  if (r->fd >= 0) {
+    uv_fs_t req;
+    uv_fs_close(NULL, &req, r->fd, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  free(r);
+}
+
+static void replay_finish(pty_process *process, int code, int sig) {
+  replay_t *r = (replay_t *) process->data;
+  if (r->done) return;
+  r->done = true;
+  process->exit_code = code;
+  process->exit_signal = sig;
+  pty_exited(process);
+}
+
+static void replay_deliver(pty_process *process) {
+  replay_t *r = (replay_t *) process->data;
+  size_t len = r->pending;
+  r->pending = 0;
+  pty_emit(process, r->buf, len);
+}
+
+static void replay_read_cb(uv_fs_t *req) {
+  replay_t *r = (replay_t *) req->data;
+  ssize_t n = req->result;
+  uv_fs_req_cleanup(req);
+  r->reading = false;
+  if (r->process == NULL) {
+    if (r->closed) replay_state_free(r);
+    return;
+  }
+  if (n <= 0) {
+    if (n < 0) fprintf(stderr, "replay: read failed: %s\n", uv_strerror((int) n));
+    replay_finish(r->process, n < 0 ? 1 : 0, 0);
+    return;
+  }
+  r->offset += n;
+  r->pending = (size_t) n;
+  if (!r->process->paused) replay_deliver(r->process);
+}
+
+static void replay_timer_cb(uv_timer_t *timer) {
+  replay_t *r = (replay_t *) timer->data;
+  if (r->pending > 0 && !r->process->paused) replay_deliver(r->process);
+}
+
+static int replay_spawn(pty_process *process) {
+  if (process->argv == NULL || process->argv[0] == NULL) return UV_EINVAL;
+  uv_fs_t req;
+  int fd = uv_fs_open(NULL, &req, process->argv[0], O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) return fd;
+
+  replay_t *r = xmalloc(sizeof(replay_t));
+  memset(r, 0, sizeof(replay_t));
+  r->process = process;
+  r->fd = fd;
+  r->req.data = r;
+  r->timer.data = r;
+  uv_timer_init(process->loop, &r->timer);
+  process->data = r;
+  return 0;
+}
+
+static void replay_pause(pty_process *process) {
+  replay_t *r = (replay_t *) process->data;
+  uv_timer_stop(&r->timer);
+}
+
+static bool replay_resume(pty_process *process) {
+  replay_t *r = (replay_t *) process->data;
+  if (r->done) return false;
+  if (r->reading) return true;
+  // deliver on the next loop iteration, never from inside the caller
+  if (r->pending > 0) return uv_timer_start(&r->timer, replay_timer_cb, 0, 0) == 0;
+  uv_buf_t b = uv_buf_init(r->buf, sizeof(r->buf));
+  if (uv_fs_read(process->loop, &r->req, r->fd, &b, 1, r->offset, replay_read_cb) != 0) return false;
+  r->reading = true;
+  return true;
+}
+
+static bool replay_kill(pty_process *process, int sig) {
+  replay_finish(process, 128 + sig, sig);
+  return true;
+}
+
+static bool replay_running(pty_process *process) {
+  replay_t *r = (replay_t *) process->data;
+  return r != NULL && !r->done;
+}
+
+static void replay_close_cb(uv_handle_t *handle) {
+  replay_t *r = (replay_t *) handle->data;
+  r->closed = true;
+  if (!r->reading) replay_state_free(r);
+}
+
+static void replay_free(pty_process *process) {
+  replay_t *r = (replay_t *) process->data;
+  if (r == NULL) return;
+  r->process = NULL;
+  process->data = NULL;
+  uv_close((uv_handle_t *) &r->timer, replay_close_cb);
+}
+
+const pty_backend pty_backend_replay = {"replay",  replay_spawn, replay_pause,   replay_resume, discard_input,
+                                        no_resize, replay_kill,  replay_running, replay_free, NULL};
+
+// synthetic: generated lines of output at argv[0] bytes/s (0: none, "max": as fast as the client takes
+// them) until argv[1] bytes were generated (default: no end), and input is echoed back. deterministic
+// load for benchmarks and tests.
+
+#define SYNTHETIC_TICK 10  // ms
+
+typedef struct {
+  uv_timer_t timer;
+  uint64_t rate;       // bytes/s, UINT64_MAX means no limit
+  uint64_t total;      // bytes to generate, 0 means no end
+  uint64_t generated;
+  uint64_t line;
+  char cur[128];       // the line being generated
+  size_t cur_len;
+  size_t cur_off;      // bytes of cur already generated
+  uint64_t started;    // uv_now when generating started
+  char *echo;          // input waiting to be echoed
+  size_t echo_len;
+  bool done;
+  char buf[CHUNK_SIZE];
+} synthetic_t;
+
+static void synthetic_finish(pty_process *process, int code, int sig) {
+  synthetic_t *s = (synthetic_t *) process->data;
+  if (s->done) return;
+  s->done = true;
+  uv_timer_stop(&s->timer);
+  process->exit_code = code;
+  process->exit_signal = sig;
+  pty_exited(process);
+}
+
+// bytes due now, what the rate allows since start minus what was generated
+static size_t synthetic_due(pty_process *process) {
+  synthetic_t *s = (synthetic_t *) process->data;
+  uint64_t due = CHUNK_SIZE;
+  if (s->rate != UINT64_MAX) {
+    uint64_t allowed = s->rate * (uv_now(process->loop) - s->started) / 1000;
+    due = allowed > s->generated ? allowed - s->generated : 0;
+  }
+  if (s->total > 0 && due > s->total - s->generated) due = s->total - s->generated;
+  return due < CHUNK_SIZE ? (size_t) due : CHUNK_SIZE;
+}
+
+static size_t synthetic_fill(synthetic_t *s, size_t want) {
+  size_t len = 0;
+  while (len < want) {
+    if (s->cur_off == s->cur_len) {
+      int n = snprintf(s->cur, sizeof(s->cur), "\x1b[32m%08llu\x1b[0m the quick brown fox jumps over the lazy dog\r\n",
+                       (unsigned long long) s->line++);
+      s->cur_len = (size_t) n;
+      s->cur_off = 0;
+    }
+    size_t m = s->cur_len - s->cur_off;
+    if (m > want - len) m = want - len;
+    memcpy(s->buf + len, s->cur + s->cur_off, m);
+    s->cur_off += m;
+    len += m;
+  }
+  return len;
+}
+
+static void synthetic_timer_cb(uv_timer_t *timer) {
+  pty_process *process = (pty_process *) timer->data;
+  synthetic_t *s = (synthetic_t *) process->data;
+  if (process->paused || s->done) return;
+
+  if (s->echo_len > 0) {
+    char *echo = s->echo;
+    size_t len = s->echo_len;
+    s->echo = NULL;
+    s->echo_len = 0;
+    pty_emit(process, echo, len);
+    free(echo);
+    return;
+  }
+
+  if (s->rate == 0) return;
+  if (s->total > 0 && s->generated >= s->total) {
+    synthetic_finish(process, 0, 0);
+    return;
+  }
+  size_t due = synthetic_due(process);
+  if (due == 0) {
+    uv_timer_start(&s->timer, synthetic_timer_cb, SYNTHETIC_TICK, 0);
+    return;
+  }
+  size_t len = synthetic_fill(s, due);
+  s->generated += len;
+  pty_emit(process, s->buf, len);
+}
+
+static uint64_t synthetic_arg(const char *arg) {
+  if (strcmp(arg, "max") == 0) return UINT64_MAX;
+  return strtoull(arg, NULL, 10);
+}
+
+static int synthetic_spawn(pty_process *process) {
+  synthetic_t *s = xmalloc(sizeof(synthetic_t));
+  memset(s, 0, sizeof(synthetic_t));
+  if (process->argv != NULL && process->argv[0] != NULL) {
+    s->rate = synthetic_arg(process->argv[0]);
+    if (process->argv[1] != NULL) s->total = synthetic_arg(process->argv[1]);
+    if (s->total == UINT64_MAX) s->total = 0;
+  }
+  s->started = uv_now(process->loop);
+  s->timer.data = process;
+  uv_timer_init(process->loop, &s->timer);
+  process->data = s;
+  return 0;
+}
+
+static void synthetic_pause(pty_process *process) {
+  synthetic_t *s = (synthetic_t *) process->data;
+  uv_timer_stop(&s->timer);
+}
+
+static bool synthetic_resume(pty_process *process) {
+  synthetic_t *s = (synthetic_t *) process->data;
+  if (s->done) return false;
+  return uv_timer_start(&s->timer, synthetic_timer_cb, 0, 0) == 0;
+}
+
+static int synthetic_write(pty_process *process, pty_buf_t *buf) {
+  synthetic_t *s = (synthetic_t *) process->data;
+  if (!s->done) {
+    s->echo = xrealloc(s->echo, s->echo_len + buf->len);
+    memcpy(s->echo + s->echo_len, buf->base, buf->len);
+    s->echo_len += buf->len;
+    if (!process->paused) uv_timer_start(&s->timer, synthetic_timer_cb, 0, 0);
+  }
+  pty_buf_free(buf);
+  return 0;
+}
+
+static bool synthetic_kill(pty_process *process, int sig) {
+  synthetic_finish(process, 128 + sig, sig);
+  return true;
+}
+
+static bool synthetic_running(pty_process *process) {
+  synthetic_t *s = (synthetic_t *) process->data;
+  return s != NULL && !s->done;
+}
+
+// the timer is the first member, handle->data (the process) may be gone by now
+static void synthetic_close_cb(uv_handle_t *handle) {
+  synthetic_t *s = (synthetic_t *) handle;
+  if (s->echo != NULL) free(s->echo);
+  free(s);
+}
+
+static void synthetic_free(pty_process *process) {
+  synthetic_t *s = (synthetic_t *) process->data;
+  if (s == NULL) return;
+  process->data = NULL;
+  uv_close((uv_handle_t *) &s->timer, synthetic_close_cb);
+}
+
+const pty_backend pty_backend_synthetic = {"synthetic", synthetic_spawn, synthetic_pause,   synthetic_resume,
+                                           synthetic_write, no_resize,   synthetic_kill,    synthetic_running,
+                                           synthetic_free,  NULL};
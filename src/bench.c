@@ -0,0 +1,536 @@
+#include <errno.h>
+#include <getopt.h>
+#include <libwebsockets.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "server.h"
+#include "utils.h"
+
+// ttyd-bench: opens sessions of the tty protocol against a running ttyd, drives input workloads and
+// reports the throughput and the echo latency, eg:
+//   ttyd -W -p 7681 cat & ttyd-bench -c 50 -k 20 -P $! ws://127.0.0.1:7681/ws
+
+#define PASTE_MAX 65536
+
+typedef struct {
+  struct lws *wsi;
+  bool connected;
+  bool done;             // closed or failed
+  bool handshake;        // JSON_DATA not sent yet
+  bool send_pending;     // --send not sent yet
+  bool key_pending;      // a keystroke is due
+  bool paste_pending;    // a paste burst is due
+  uint64_t key_sent;     // when the awaited keystroke was sent (ns), 0 if none
+  unsigned int key;
+  uint64_t rx_bytes;     // OUTPUT payload bytes
+  uint64_t rx_frames;
+  uint64_t tx_bytes;
+  uint64_t tx_frames;
+} session_t;
+
+static struct {
+  char url[256];
+  const char *address;
+  int port;
+  char path[256];
+  bool ssl;
+  char *credential;      // base64 of user:password
+  int clients;
+  int duration;          // seconds
+  int keys;              // keystrokes per second per session
+  size_t paste_size;     // bytes per paste burst
+  int paste_interval;    // ms
+  char *send;            // input sent once after the handshake
+  size_t send_len;
+  int pid;               // server pid, for its cpu and memory usage
+  bool json;
+} opts;
+
+struct lws_context *context;
+static uv_loop_t *loop;
+static session_t *sessions;
+static int done_count = 0;
+static int connected_count = 0;
+static int failed_count = 0;
+static bool stopping = false;
+static uint64_t start_at = 0;
+static uint64_t end_at = 0;
+
+static uint32_t *samples = NULL;  // echo latency (us)
+static size_t samples_len = 0;
+static size_t samples_cap = 0;
+
+static uv_timer_t key_timer;
+static uv_timer_t paste_timer;
+static uv_timer_t end_timer;
+static uv_timer_t grace_timer;
+static uv_signal_t sigint;
+
+typedef struct {
+  bool ok;
+  double cpu;        // seconds of user + system time
+  long rss;          // KB
+  long rss_peak;     // KB
+} proc_stat_t;
+
+static const struct option options[] = {{"clients", required_argument, NULL, 'c'},
+                                        {"duration", required_argument, NULL, 'd'},
+                                        {"keys", required_argument, NULL, 'k'},
+                                        {"paste", required_argument, NULL, 'p'},
+                                        {"paste-interval", required_argument, NULL, 'i'},
+                                        {"send", required_argument, NULL, 's'},
+                                        {"credential", required_argument, NULL, 'C'},
+                                        {"pid", required_argument, NULL, 'P'},
+                                        {"json", no_argument, NULL, 'j'},
+                                        {"debug", required_argument, NULL, 'D'},
+                                        {"help", no_argument, NULL, 'h'},
+                                        {NULL, 0, 0, 0}};
+static const char *opt_string = "c:d:k:p:i:s:C:P:jD:h";
+
+static void print_help() {
+  // clang-format off
+  fprintf(stderr, "ttyd-bench is a load generator for ttyd\n\n"
+          "USAGE:\n"
+          "    ttyd-bench [options] <url> (eg: ws://127.0.0.1:7681/ws)\n\n"
+          "OPTIONS:\n"
+          "    -c, --clients           Concurrent sessions (default: 1)\n"
+          "    -d, --duration          Seconds to run (default: 10)\n"
+          "    -k, --keys              Keystrokes per second per session, the echo latency is measured against the next output (default: 10, 0 to disable)\n"
+          "    -p, --paste             Bytes per paste burst, sent as lines of 64 bytes (default: 0, disabled)\n"
+          "    -i, --paste-interval    Milliseconds between paste bursts (default: 1000)\n"
+          "    -s, --send              Input to send once after connecting, \\n, \\r and \\t are unescaped (eg: 'yes\\r' to a shell)\n"
+          "    -C, --credential        Credential for basic authentication (format: username:password)\n"
+          "    -P, --pid               Pid of the ttyd server, to report its cpu and memory usage (linux only)\n"
+          "    -j, --json              Print the report as JSON\n"
+          "    -D, --debug             Set log level (default: 3)\n"
+          "    -h, --help              Print this text and exit\n"
+  );
+  // clang-format on
+}
+
+static char *unescape(const char *s, size_t *len) {
+  char *out = xmalloc(strlen(s) + 1);
+  char *p = out;
+  for (; *s; s++) {
+    if (*s != '\\' || s[1] == '\0') {
+      *p++ = *s;
+      continue;
+    }
+    switch (*++s) {
+      case 'n':
+        *p++ = '\n';
+        break;
+      case 'r':
+        *p++ = '\r';
+        break;
+      case 't':
+        *p++ = '\t';
+        break;
+      default:
+        *p++ = *s;
+        break;
+    }
+  }
+  *len = p - out;
+  return out;
+}
+
+static void sample_add(uint64_t ns) {
+  if (samples_len == samples_cap) {
+    samples_cap = samples_cap > 0 ? samples_cap * 2 : 4096;
+    samples = xrealloc(samples, samples_cap * sizeof(uint32_t));
+  }
+  uint64_t us = ns / 1000;
+  samples[samples_len++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+  if (samples_len == 0) return 0;
+  size_t i = (size_t)(p * (samples_len - 1) + 0.5);
+  return samples[i] / 1000.0;
+}
+
+static proc_stat_t proc_stat(int pid) {
+  proc_stat_t st = {false, 0, 0, 0};
+#ifdef __linux__
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return st;
+  size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[n] = '\0';
+
+  // utime and stime are the 14th and 15th fields, the 2nd (comm) may contain spaces
+  char *p = strrchr(buf, ')');
+  unsigned long utime, stime;
+  if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return st;
+  st.cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  fp = fopen(path, "r");
+  if (fp == NULL) return st;
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    if (strncmp(buf, "VmRSS:", 6) == 0) st.rss = strtol(buf + 6, NULL, 10);
+    if (strncmp(buf, "VmHWM:", 6) == 0) st.rss_peak = strtol(buf + 6, NULL, 10);
+  }
+  fclose(fp);
+  st.ok = true;
+#endif
+  return st;
+}
+
+static void session_done(session_t *s) {
+  if (s->done) return;
+  s->done = true;
+  s->wsi = NULL;
+  if (++done_count == opts.clients) {
+    if (end_at == 0) end_at = uv_hrtime();
+    uv_stop(loop);
+  }
+}
+
+static int session_write(struct lws *wsi, session_t *s) {
+  static unsigned char buf[LWS_PRE + PASTE_MAX + 1];
+  unsigned char *p = buf + LWS_PRE;
+  size_t n = 0;
+
+  if (stopping) {
+    lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+    return -1;
+  }
+
+  if (s->handshake) {
+    n = snprintf((char *)p, PASTE_MAX, "{\"AuthToken\":\"%s\",\"columns\":80,\"rows\":24}",
+                 opts.credential != NULL ? opts.credential : "");
+    s->handshake = false;
+  } else if (s->send_pending) {
+    p[n++] = INPUT;
+    memcpy(p + n, opts.send, opts.send_len);
+    n += opts.send_len;
+    s->send_pending = false;
+  } else if (s->key_pending) {
+    p[n++] = INPUT;
+    p[n++] = (unsigned char)('a' + s->key++ % 26);
+    s->key_pending = false;
+    s->key_sent = uv_hrtime();
+  } else if (s->paste_pending) {
+    p[n++] = INPUT;
+    for (size_t i = 0; i < opts.paste_size; i++) p[n++] = (i + 1) % 64 == 0 ? '\r' : (unsigned char)('a' + i % 26);
+    s->paste_pending = false;
+  } else {
+    return 0;
+  }
+
+  if (lws_write(wsi, p, n, LWS_WRITE_BINARY) < (int)n) return -1;
+  s->tx_frames++;
+  s->tx_bytes += n;
+  if (s->send_pending || s->key_pending || s->paste_pending) lws_callback_on_writable(wsi);
+  return 0;
+}
+
+static int callback_bench(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  session_t *s = (session_t *)user;
+
+  switch (reason) {
+    case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER:
+      if (opts.credential != NULL) {
+        unsigned char **p = (unsigned char **)in;
+        char value[256];
+        int n = snprintf(value, sizeof(value), "Basic %s", opts.credential);
+        if (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_AUTHORIZATION, (unsigned char *)value, n, p, *p + len))
+          return -1;
+      }
+      break;
+
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      s->connected = true;
+      s->handshake = true;
+      s->send_pending = opts.send != NULL;
+      connected_count++;
+      lws_callback_on_writable(wsi);
+      break;
+
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+      lwsl_err("connection error: %s\n", in != NULL ? (char *)in : "unknown");
+      failed_count++;
+      session_done(s);
+      break;
+
+    case LWS_CALLBACK_CLIENT_RECEIVE:
+      s->rx_frames++;
+      if (lws_is_first_fragment(wsi)) {
+        if (len == 0 || ((char *)in)[0] != OUTPUT) break;
+        s->rx_bytes += len - 1;
+        if (s->key_sent > 0) {
+          sample_add(uv_hrtime() - s->key_sent);
+          s->key_sent = 0;
+        }
+      } else {
+        s->rx_bytes += len;
+      }
+      break;
+
+    case LWS_CALLBACK_CLIENT_WRITEABLE:
+      return session_write(wsi, s);
+
+    case LWS_CALLBACK_CLIENT_CLOSED:
+      if (!stopping) lwsl_warn("session closed by the server\n");
+      session_done(s);
+      break;
+
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+static const struct lws_protocols protocols[] = {{"tty", callback_bench, 0, 0}, {NULL, NULL, 0, 0}};
+
+static void key_cb(uv_timer_t *timer) {
+  for (int i = 0; i < opts.clients; i++) {
+    session_t *s = &sessions[i];
+    // one keystroke in flight, a key without echo yet is not repeated
+    if (!s->connected || s->done || s->key_sent > 0) continue;
+    s->key_pending = true;
+    lws_callback_on_writable(s->wsi);
+  }
+}
+
+static void paste_cb(uv_timer_t *timer) {
+  for (int i = 0; i < opts.clients; i++) {
+    session_t *s = &sessions[i];
+    if (!s->connected || s->done) continue;
+    s->paste_pending = true;
+    lws_callback_on_writable(s->wsi);
+  }
+}
+
+static void grace_cb(uv_timer_t *timer) { uv_stop(loop); }
+
+static void stop() {
+  if (stopping) return;
+  stopping = true;
+  end_at = uv_hrtime();
+  uv_timer_stop(&key_timer);
+  uv_timer_stop(&paste_timer);
+  for (int i = 0; i < opts.clients; i++) {
+    if (sessions[i].wsi != NULL && !sessions[i].done) lws_callback_on_writable(sessions[i].wsi);
+  }
+  // don't wait for long on sessions that don't close
+  uv_timer_start(&grace_timer, grace_cb, 2000, 0);
+}
+
+static void end_cb(uv_timer_t *timer) { stop(); }
+
+static void signal_cb(uv_signal_t *watcher, int signum) { stop(); }
+
+static void report(proc_stat_t *before, proc_stat_t *after) {
+  double secs = (double)(end_at - start_at) / 1e9;
+  uint64_t rx_bytes = 0, rx_frames = 0, tx_bytes = 0, tx_frames = 0;
+  for (int i = 0; i < opts.clients; i++) {
+    rx_bytes += sessions[i].rx_bytes;
+    rx_frames += sessions[i].rx_frames;
+    tx_bytes += sessions[i].tx_bytes;
+    tx_frames += sessions[i].tx_frames;
+  }
+  qsort(samples, samples_len, sizeof(uint32_t), cmp_u32);
+  bool server = opts.pid > 0 && before->ok && after->ok;
+  double cpu = server && secs > 0 ? (after->cpu - before->cpu) / secs * 100 : 0;
+
+  if (opts.json) {
+    printf("{\"url\":\"%s\",\"clients\":%d,\"connected\":%d,\"failed\":%d,\"duration\":%.3f,", opts.url, opts.clients,
+           connected_count, failed_count, secs);
+    printf("\"rx_bytes\":%llu,\"rx_frames\":%llu,\"tx_bytes\":%llu,\"tx_frames\":%llu,", (unsigned long long)rx_bytes,
+           (unsigned long long)rx_frames, (unsigned long long)tx_bytes, (unsigned long long)tx_frames);
+    printf("\"echo\":{\"samples\":%zu,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}", samples_len,
+           percentile(0.5), percentile(0.9), percentile(0.99), percentile(1));
+    if (server) printf(",\"server\":{\"cpu\":%.1f,\"rss\":%ld,\"rss_peak\":%ld}", cpu, after->rss, after->rss_peak);
+    printf("}\n");
+    return;
+  }
+
+  printf("url:      %s\n", opts.url);
+  printf("sessions: %d connected, %d failed\n", connected_count, failed_count);
+  printf("duration: %.2f s\n", secs);
+  printf("received: %.2f MB in %llu frames (%.2f MB/s, %.0f frames/s)\n", rx_bytes / 1e6,
+         (unsigned long long)rx_frames, secs > 0 ? rx_bytes / 1e6 / secs : 0, secs > 0 ? rx_frames / secs : 0);
+  printf("sent:     %.2f MB in %llu frames (%.2f MB/s, %.0f frames/s)\n", tx_bytes / 1e6,
+         (unsigned long long)tx_frames, secs > 0 ? tx_bytes / 1e6 / secs : 0, secs > 0 ? tx_frames / secs : 0);
+  if (samples_len > 0)
+    printf("echo:     %zu samples, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", samples_len, percentile(0.5),
+           percentile(0.9), percentile(0.99), percentile(1));
+  if (server) printf("server:   cpu %.1f%%, rss %ld KB (peak %ld KB)\n", cpu, after->rss, after->rss_peak);
+}
+
+static int parse_positive(const char *name, const char *str) {
+  char *end;
+  errno = 0;
+  long v = strtol(str, &end, 10);
+  if (errno != 0 || *end != '\0' || v < 0 || v > INT32_MAX) {
+    fprintf(stderr, "ttyd-bench: invalid %s: %s\n", name, str);
+    exit(EXIT_FAILURE);
+  }
+  return (int)v;
+}
+
+int main(int argc, char **argv) {
+  int debug_level = LLL_ERR | LLL_WARN;
+  opts.clients = 1;
+  opts.duration = 10;
+  opts.keys = 10;
+  opts.paste_interval = 1000;
+
+  int c;
+  while ((c = getopt_long(argc, argv, opt_string, options, NULL)) != -1) {
+    switch (c) {
+      case 'c':
+        opts.clients = parse_positive("clients", optarg);
+        break;
+      case 'd':
+        opts.duration = parse_positive("duration", optarg);
+        break;
+      case 'k':
+        opts.keys = parse_positive("keys", optarg);
+        break;
+      case 'p':
+        opts.paste_size = (size_t)parse_positive("paste", optarg);
+        if (opts.paste_size > PASTE_MAX) opts.paste_size = PASTE_MAX;
+        break;
+      case 'i':
+        opts.paste_interval = parse_positive("paste interval", optarg);
+        break;
+      case 's':
+        opts.send = unescape(optarg, &opts.send_len);
+        break;
+      case 'C': {
+        char b64[256];
+        int n = lws_b64_encode_string(optarg, (int)strlen(optarg), b64, sizeof(b64));
+        if (n <= 0) {
+          fprintf(stderr, "ttyd-bench: credential is too long\n");
+          return EXIT_FAILURE;
+        }
+        opts.credential = strdup(b64);
+      } break;
+      case 'P':
+        opts.pid = parse_positive("pid", optarg);
+        break;
+      case 'j':
+        opts.json = true;
+        break;
+      case 'D':
+        debug_level = parse_positive("debug", optarg);
+        break;
+      case 'h':
+        print_help();
+        return EXIT_SUCCESS;
+      default:
+        print_help();
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1 || opts.clients == 0 || opts.duration == 0) {
+    print_help();
+    return EXIT_FAILURE;
+  }
+
+  char uri[256];
+  const char *prot, *path;
+  snprintf(opts.url, sizeof(opts.url), "%s", argv[optind]);
+  snprintf(uri, sizeof(uri), "%s", argv[optind]);
+  if (lws_parse_uri(uri, &prot, &opts.address, &opts.port, &path)) {
+    fprintf(stderr, "ttyd-bench: invalid url: %s\n", opts.url);
+    return EXIT_FAILURE;
+  }
+  opts.ssl = strcmp(prot, "wss") == 0 || strcmp(prot, "https") == 0;
+  snprintf(opts.path, sizeof(opts.path), "/%s", strlen(path) > 0 ? path : "ws");
+
+  lws_set_log_level(debug_level, NULL);
+
+  loop = xmalloc(sizeof *loop);
+  uv_loop_init(loop);
+
+  struct lws_context_creation_info info;
+  memset(&info, 0, sizeof(info));
+  void *foreign_loops[1] = {loop};
+  info.port = CONTEXT_PORT_NO_LISTEN;
+  info.protocols = protocols;
+  info.gid = -1;
+  info.uid = -1;
+  info.foreign_loops = foreign_loops;
+  info.options = LWS_SERVER_OPTION_LIBUV;
+  if (opts.ssl) info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+  context = lws_create_context(&info);
+  if (context == NULL) {
+    lwsl_err("libwebsockets context creation failed\n");
+    return EXIT_FAILURE;
+  }
+
+  sessions = xmalloc(sizeof(session_t) * opts.clients);
+  memset(sessions, 0, sizeof(session_t) * opts.clients);
+  for (int i = 0; i < opts.clients; i++) {
+    struct lws_client_connect_info ci;
+    memset(&ci, 0, sizeof(ci));
+    ci.context = context;
+    ci.address = opts.address;
+    ci.port = opts.port;
+    ci.path = opts.path;
+    ci.host = opts.address;
+    ci.origin = opts.address;
+    ci.protocol = "tty";
+    ci.userdata = &sessions[i];
+    ci.pwsi = &sessions[i].wsi;
+    if (opts.ssl) ci.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
+    if (lws_client_connect_via_info(&ci) == NULL) {
+      failed_count++;
+      session_done(&sessions[i]);
+    }
+  }
+
+  proc_stat_t before = proc_stat(opts.pid), after;
+  start_at = uv_hrtime();
+  uv_timer_init(loop, &key_timer);
+  uv_timer_init(loop, &paste_timer);
+  uv_timer_init(loop, &end_timer);
+  uv_timer_init(loop, &grace_timer);
+  uv_signal_init(loop, &sigint);
+  if (opts.keys > 0) {
+    uint64_t interval = 1000 / opts.keys;
+    uv_timer_start(&key_timer, key_cb, interval > 0 ? interval : 1, interval > 0 ? interval : 1);
+  }
+  if (opts.paste_size > 0 && opts.paste_interval > 0)
+    uv_timer_start(&paste_timer, paste_cb, opts.paste_interval, opts.paste_interval);
+  uv_timer_start(&end_timer, end_cb, (uint64_t)opts.duration * 1000, 0);
+  uv_signal_start(&sigint, signal_cb, SIGINT);
+
+  if (done_count < opts.clients) lws_service(context, 0);
+
+  if (end_at == 0) end_at = uv_hrtime();
+  after = proc_stat(opts.pid);
+  uv_timer_stop(&key_timer);
+  uv_timer_stop(&paste_timer);
+  uv_timer_stop(&end_timer);
+  uv_timer_stop(&grace_timer);
+  uv_signal_stop(&sigint);
+  lws_context_destroy(context);
+
+  report(&before, &after);
+
+  free(samples);
+  free(sessions);
+  free(opts.send);
+  free(opts.credential);
+  return connected_count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,705 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "pty.h"
+#include "utils.h"
+
+// cast: plays asciicast v2 recordings (--record) with their timing. argv[0] is a recording, or a directory
+// and argv[1] a recording in it (without one, the recordings are listed). the optional speed and where to
+// start (seconds) follow the recording. input controls the playback: space pauses, + and - change the speed,
+// the arrows seek 5s (left/right) or 60s (up/down), 0-9 jump to 0%-90%. the position is shown in the title.
+//
+// the first open of a recording maps it and builds its seek index on the thread pool: a point every second
+// or CAST_POINT_BYTES of events, a keyframe where the output clears the screen. a seek resets the terminal
+// and replays the output from the keyframe before the target at once, or from at most CAST_SEEK_MAX bytes
+// before it if the keyframe is further back (the screen is then right once the program redraws it).
+
+#define CAST_POINT_US 1000000
+#define CAST_POINT_BYTES (256 * 1024)
+#define CAST_SEEK_MAX (4 * 1024 * 1024)
+#define CAST_BURST (256 * 1024)  // output per delivery
+
+typedef struct {
+  uint64_t t;     // us
+  size_t offset;  // of the event
+  bool key;       // the output of the event clears the screen
+} cast_point_t;
+
+struct cast_;
+
+typedef struct cast_file_ {
+  uv_work_t work;
+  struct cast_file_ *next;
+  char *path;
+  int64_t size;               // of the file when it was indexed
+  int64_t mtime;
+  int refs;                   // players using it
+  bool stale;                 // the file changed, freed when the last player is done
+  bool ready;
+  int err;
+  char *data;                 // mapped, or read whole if compressed
+  size_t len;
+  bool mapped;
+  size_t events;              // offset of the first event, after the header
+  uint64_t duration;          // us, time of the last event
+  cast_point_t *points;
+  size_t points_len;
+  size_t points_cap;
+  struct cast_ *waiting;      // players waiting for the index
+} cast_file_t;
+
+typedef struct cast_ {
+  uv_timer_t timer;           // first member, the close callback frees the player through it
+  pty_process *process;       // NULL once the session is freed
+  struct cast_ *next_waiting;
+  cast_file_t *file;
+  const char *name;           // for the title
+  size_t pos;                 // offset of the next event
+  uint64_t base;              // us, playback position at base_wall
+  uint64_t base_wall;         // ms, uv_now
+  uint64_t until;             // us, output up to here is sent at once (after a seek)
+  uint64_t start;             // us, where to start once the index is ready
+  double speed;
+  bool playing;
+  bool done;
+  char *buf;                  // output not delivered yet
+  size_t len;
+  size_t cap;
+} cast_t;
+
+static cast_file_t *files = NULL;
+
+static bool contains(const char *s, size_t len, const char *needle) {
+  size_t n = strlen(needle);
+  for (size_t i = 0; i + n <= len; i++) {
+    const char *p = memchr(s + i, needle[0], len - n + 1 - i);
+    if (p == NULL) return false;
+    i = (size_t)(p - s);
+    if (memcmp(p, needle, n) == 0) return true;
+  }
+  return false;
+}
+
+typedef struct {
+  uint64_t t;       // us
+  char type;
+  const char *str;  // the JSON string data, still escaped
+  size_t str_len;
+} cast_event_t;
+
+// the event at pos of data, returns the offset of the next one or 0 if there is no complete event
+static size_t parse_event(const char *data, size_t len, size_t pos, cast_event_t *ev) {
+  const char *p = data + pos, *end = memchr(p, '\n', len - pos);
+  if (end == NULL) return 0;
+  size_t next = (size_t)(end - data) + 1;
+  while (p < end && (*p == '[' || *p == ' ')) p++;
+
+  uint64_t sec = 0, us = 0, scale = 100000;
+  while (p < end && *p >= '0' && *p <= '9') sec = sec * 10 + (uint64_t)(*p++ - '0');
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      us += (uint64_t)(*p - '0') * scale;
+      scale /= 10;
+    }
+  }
+  ev->t = sec * 1000000 + us;
+
+  // , "o", "...
+  while (p < end && (*p == ',' || *p == ' ')) p++;
+  if (end - p < 5 || p[0] != '"' || p[2] != '"') {
+    ev->type = 0;
+    return next;
+  }
+  ev->type = p[1];
+  for (p += 3; p < end && *p != '"'; p++)
+    ;
+  const char *q = end;
+  while (q > p && *q != '"') q--;
+  ev->str = p + 1;
+  ev->str_len = q > p ? (size_t)(q - p - 1) : 0;
+  return next;
+}
+
+static int hex_value(const char *s) {
+  int v = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = s[i];
+    v <<= 4;
+    if (c >= '0' && c <= '9')
+      v |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      v |= c - 'A' + 10;
+    else
+      return -1;
+  }
+  return v;
+}
+
+static void append(cast_t *c, const char *data, size_t len) {
+  if (c->len + len > c->cap) {
+    c->cap = c->len + len > c->cap * 2 ? c->len + len : c->cap * 2;
+    c->buf = xrealloc(c->buf, c->cap);
+  }
+  memcpy(c->buf + c->len, data, len);
+  c->len += len;
+}
+
+// append the JSON string s decoded, the result is never longer
+static void append_json(cast_t *c, const char *s, size_t len) {
+  if (c->len + len > c->cap) {
+    c->cap = c->len + len > c->cap * 2 ? c->len + len : c->cap * 2;
+    c->buf = xrealloc(c->buf, c->cap);
+  }
+  char *out = c->buf + c->len;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] != '\\' || i + 1 == len) {
+      *out++ = s[i];
+      continue;
+    }
+    char e = s[++i];
+    switch (e) {
+      case 'n':
+        *out++ = '\n';
+        break;
+      case 'r':
+        *out++ = '\r';
+        break;
+      case 't':
+        *out++ = '\t';
+        break;
+      case 'b':
+        *out++ = '\b';
+        break;
+      case 'f':
+        *out++ = '\f';
+        break;
+      case 'u': {
+        int cp = i + 4 < len ? hex_value(s + i + 1) : -1;
+        if (cp < 0) break;
+        i += 4;
+        if (cp >= 0xd800 && cp <= 0xdbff && i + 6 < len && s[i + 1] == '\\' && s[i + 2] == 'u') {
+          int lo = hex_value(s + i + 3);
+          if (lo >= 0xdc00 && lo <= 0xdfff) {
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            i += 6;
+          }
+        }
+        if (cp < 0x80) {
+          *out++ = (char)cp;
+        } else if (cp < 0x800) {
+          *out++ = (char)(0xc0 | (cp >> 6));
+          *out++ = (char)(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+          *out++ = (char)(0xe0 | (cp >> 12));
+          *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+          *out++ = (char)(0x80 | (cp & 0x3f));
+        } else {
+          *out++ = (char)(0xf0 | (cp >> 18));
+          *out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+          *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+          *out++ = (char)(0x80 | (cp & 0x3f));
+        }
+      } break;
+      default:  // " \ /
+        *out++ = e;
+        break;
+    }
+  }
+  c->len = (size_t)(out - c->buf);
+}
+
+static bool ends_with(const char *s, const char *suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static int file_load(cast_file_t *f) {
+  if (ends_with(f->path, ".gz")) {
+    gzFile gz = gzopen(f->path, "rb");
+    if (gz == NULL) return UV_ENOENT;
+    size_t cap = 1024 * 1024;
+    f->data = xmalloc(cap);
+    int n;
+    while ((n = gzread(gz, f->data + f->len, (unsigned int)(cap - f->len))) > 0) {
+      f->len += (size_t)n;
+      if (f->len == cap) f->data = xrealloc(f->data, cap *= 2);
+    }
+    gzclose(gz);
+    return n < 0 ? UV_EIO : 0;
+  }
+
+  uv_fs_t req;
+  int fd = uv_fs_open(NULL, &req, f->path, O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) return fd;
+  f->len = (size_t)f->size;
+  int err = 0;
+#ifndef _WIN32
+  if (f->len > 0) {
+    f->data = mmap(NULL, f->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (f->data == MAP_FAILED) {
+      f->data = NULL;
+      err = UV_ENOMEM;
+    } else {
+      f->mapped = true;
+    }
+  }
+#else
+  f->data = xmalloc(f->len > 0 ? f->len : 1);
+  for (size_t off = 0; off < f->len;) {
+    uv_buf_t b = uv_buf_init(f->data + off, (unsigned int)(f->len - off));
+    int n = uv_fs_read(NULL, &req, fd, &b, 1, (int64_t)off, NULL);
+    uv_fs_req_cleanup(&req);
+    if (n <= 0) {
+      f->len = off;
+      break;
+    }
+    off += (size_t)n;
+  }
+#endif
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  return err;
+}
+
+static void add_point(cast_file_t *f, uint64_t t, size_t offset, bool key) {
+  if (f->points_len == f->points_cap) {
+    f->points_cap = f->points_cap > 0 ? f->points_cap * 2 : 1024;
+    f->points = xrealloc(f->points, f->points_cap * sizeof(cast_point_t));
+  }
+  f->points[f->points_len].t = t;
+  f->points[f->points_len].offset = offset;
+  f->points[f->points_len].key = key;
+  f->points_len++;
+}
+
+// runs on the thread pool
+static void index_work_cb(uv_work_t *work) {
+  cast_file_t *f = (cast_file_t *)work;
+  f->err = file_load(f);
+  if (f->err != 0) return;
+  const char *eol = f->data != NULL ? memchr(f->data, '\n', f->len) : NULL;
+  if (eol == NULL || f->data[0] != '{' || !contains(f->data, (size_t)(eol - f->data), "\"version\": 2")) {
+    f->err = UV_EINVAL;
+    return;
+  }
+  f->events = (size_t)(eol - f->data) + 1;
+
+  // the screen is empty at the start
+  add_point(f, 0, f->events, true);
+  uint64_t last_t = 0;
+  size_t last_offset = f->events;
+  cast_event_t ev;
+  for (size_t pos = f->events, next; (next = parse_event(f->data, f->len, pos, &ev)) > 0; pos = next) {
+    if (ev.type != 'o') continue;
+    f->duration = ev.t;
+    bool key = contains(ev.str, ev.str_len, "\\u001b[2J") || contains(ev.str, ev.str_len, "\\u001bc") ||
+               contains(ev.str, ev.str_len, "\\u001b[?1049h") || contains(ev.str, ev.str_len, "\\u001b[?1049l");
+    if (key || ev.t - last_t >= CAST_POINT_US || pos - last_offset >= CAST_POINT_BYTES) {
+      add_point(f, ev.t, pos, key);
+      last_t = ev.t;
+      last_offset = pos;
+    }
+  }
+}
+
+static void file_free(cast_file_t *f) {
+#ifndef _WIN32
+  if (f->mapped)
+    munmap(f->data, f->len);
+  else
+#endif
+    free(f->data);
+  free(f->points);
+  free(f->path);
+  free(f);
+}
+
+static void file_unlink(cast_file_t *f) {
+  for (cast_file_t **pp = &files; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == f) {
+      *pp = f->next;
+      break;
+    }
+  }
+}
+
+// a stale file is freed by the last player, or by the indexing if it ends up unused
+static void file_put(cast_file_t *f) {
+  if (--f->refs == 0 && f->stale && f->ready) file_free(f);
+}
+
+static void cast_finish(pty_process *process, int code) {
+  cast_t *c = (cast_t *)process->data;
+  if (c->done) return;
+  c->done = true;
+  uv_timer_stop(&c->timer);
+  process->exit_code = code;
+  pty_exited(process);
+}
+
+static uint64_t cast_now(cast_t *c) {
+  if (!c->playing) return c->base;
+  uint64_t t = c->base + (uint64_t)((double)(uv_now(c->process->loop) - c->base_wall) * 1000 * c->speed);
+  return t < c->file->duration ? t : c->file->duration;
+}
+
+static void cast_rebase(cast_t *c, uint64_t t) {
+  c->base = t;
+  c->base_wall = uv_now(c->process->loop);
+}
+
+static void format_time(char *buf, size_t size, uint64_t us) {
+  uint64_t s = us / 1000000;
+  if (s >= 3600)
+    snprintf(buf, size, "%u:%02u:%02u", (unsigned int)(s / 3600), (unsigned int)(s / 60 % 60), (unsigned int)(s % 60));
+  else
+    snprintf(buf, size, "%u:%02u", (unsigned int)(s / 60), (unsigned int)(s % 60));
+}
+
+// the position in the window title
+static void cast_status(cast_t *c) {
+  char now[16], total[16], title[256];
+  format_time(now, sizeof(now), cast_now(c));
+  format_time(total, sizeof(total), c->file->duration);
+  int n = snprintf(title, sizeof(title), "\x1b]2;%s %s%s / %s x%g\x07", c->name, c->playing ? "" : "[paused] ", now,
+                   total, c->speed);
+  if (n > 0 && (size_t)n < sizeof(title)) append(c, title, (size_t)n);
+}
+
+static void cast_seek(cast_t *c, uint64_t t) {
+  cast_file_t *f = c->file;
+  if (t > f->duration) t = f->duration;
+  size_t lo = 0, hi = f->points_len - 1;
+  while (lo < hi) {
+    size_t mid = (lo + hi + 1) / 2;
+    if (f->points[mid].t <= t)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  size_t i = lo;
+  while (i > 0 && !f->points[i].key && f->points[lo].offset - f->points[i - 1].offset <= CAST_SEEK_MAX) i--;
+  c->pos = f->points[i].offset;
+  c->until = t;
+  c->len = 0;
+  append(c, "\x1b" "c", 2);
+  cast_rebase(c, t);
+}
+
+static void cast_step(uv_timer_t *timer) {
+  cast_t *c = (cast_t *)timer;
+  cast_file_t *f = c->file;
+  if (c->done || c->process->paused) return;
+
+  uint64_t now = 0;
+  cast_event_t ev;
+  size_t next = 0;
+  if (f != NULL) {
+    now = cast_now(c);
+    uint64_t target = now > c->until ? now : c->until;
+    while (c->len < CAST_BURST && (next = parse_event(f->data, f->len, c->pos, &ev)) > 0) {
+      if (ev.type == 'o' && ev.t > target) break;
+      if (ev.type == 'o') append_json(c, ev.str, ev.str_len);
+      c->pos = next;
+    }
+  }
+  if (c->len > 0) {
+    // the buffer is handed over as is, resume comes back here
+    pty_buf_t *buf = xmalloc(sizeof(pty_buf_t));
+    buf->base = c->buf;
+    buf->len = c->len;
+    c->buf = NULL;
+    c->len = c->cap = 0;
+    pty_deliver(c->process, buf);
+    return;
+  }
+  if (f == NULL) return;
+  if (next == 0) {
+    // the end, it stays there to be seeked back
+    if (c->playing) {
+      cast_rebase(c, f->duration);
+      c->playing = false;
+      cast_status(c);
+      uv_timer_start(&c->timer, cast_step, 0, 0);
+    }
+    return;
+  }
+  if (c->playing) {
+    double delay = (double)(ev.t - now) / 1000 / c->speed;
+    uv_timer_start(&c->timer, cast_step, delay < 1 ? 1 : (uint64_t)delay, 0);
+  }
+}
+
+static void cast_play(cast_t *c) {
+  c->pos = c->file->events;
+  c->playing = true;
+  cast_rebase(c, 0);
+  if (c->start > 0) cast_seek(c, c->start);
+  cast_status(c);
+  uv_timer_start(&c->timer, cast_step, 0, 0);
+}
+
+static void index_after_work_cb(uv_work_t *work, int status) {
+  cast_file_t *f = (cast_file_t *)work;
+  f->ready = true;
+  if (f->err != 0) fprintf(stderr, "cast: can not load %s: %s\n", f->path, uv_strerror(f->err));
+  cast_t *c = f->waiting;
+  f->waiting = NULL;
+  while (c != NULL) {
+    cast_t *next = c->next_waiting;
+    if (f->err != 0) {
+      char msg[256];
+      int n = snprintf(msg, sizeof(msg), "can not play %s: %s\r\n", c->name, uv_strerror(f->err));
+      if (n > 0 && (size_t)n < sizeof(msg)) pty_emit(c->process, msg, (size_t)n);
+      cast_finish(c->process, 1);
+    } else {
+      cast_play(c);
+    }
+    c = next;
+  }
+  // a file that can't be played is loaded again next time
+  if (f->err != 0 && !f->stale) {
+    file_unlink(f);
+    f->stale = true;
+  }
+  if (f->refs == 0 && f->stale) file_free(f);
+}
+
+// the index of path, built if the file is new or has changed
+static cast_file_t *file_get(uv_loop_t *loop, const char *path, int *err) {
+  uv_fs_t req;
+  *err = uv_fs_stat(NULL, &req, path, NULL);
+  int64_t size = (int64_t)req.statbuf.st_size;
+  int64_t mtime = (int64_t)req.statbuf.st_mtim.tv_sec * 1000000000 + req.statbuf.st_mtim.tv_nsec;
+  uv_fs_req_cleanup(&req);
+  if (*err != 0) return NULL;
+
+  for (cast_file_t **pp = &files; *pp != NULL;) {
+    cast_file_t *f = *pp;
+    if (strcmp(f->path, path) == 0 && !f->stale) {
+      if (f->size == size && f->mtime == mtime) {
+        f->refs++;
+        return f;
+      }
+      f->stale = true;
+    }
+    if (f->stale) {
+      *pp = f->next;
+      if (f->refs == 0 && f->ready) file_free(f);
+    } else {
+      pp = &f->next;
+    }
+  }
+
+  cast_file_t *f = xmalloc(sizeof(cast_file_t));
+  memset(f, 0, sizeof(cast_file_t));
+  f->path = strdup(path);
+  f->size = size;
+  f->mtime = mtime;
+  f->refs = 1;
+  *err = uv_queue_work(loop, &f->work, index_work_cb, index_after_work_cb);
+  if (*err != 0) {
+    file_free(f);
+    return NULL;
+  }
+  f->next = files;
+  files = f;
+  return f;
+}
+
+static int compare_names(const void *a, const void *b) { return strcmp(*(char *const *)a, *(char *const *)b); }
+
+static void cast_list(cast_t *c, const char *dir) {
+  uv_fs_t req;
+  uv_dirent_t ent;
+  char **names = NULL;
+  size_t n = 0;
+  if (uv_fs_scandir(NULL, &req, dir, 0, NULL) >= 0) {
+    while (uv_fs_scandir_next(&req, &ent) != UV_EOF) {
+      if (!ends_with(ent.name, ".cast") && !ends_with(ent.name, ".cast.gz")) continue;
+      names = xrealloc(names, (n + 1) * sizeof(char *));
+      names[n++] = strdup(ent.name);
+    }
+  }
+  uv_fs_req_cleanup(&req);
+  qsort(names, n, sizeof(char *), compare_names);
+
+  char line[512];
+  int len = snprintf(line, sizeof(line), "%zu recordings in %s, open one with ?arg=NAME\r\n\r\n", n, dir);
+  append(c, line, (size_t)len);
+  for (size_t i = 0; i < n; i++) {
+    len = snprintf(line, sizeof(line), "  %s\r\n", names[i]);
+    if (len > 0 && (size_t)len < sizeof(line)) append(c, line, (size_t)len);
+    free(names[i]);
+  }
+  free(names);
+}
+
+static int cast_spawn(pty_process *process) {
+  char **argv = process->argv;
+  if (argv == NULL || argv[0] == NULL) return UV_EINVAL;
+
+  uv_fs_t req;
+  int err = uv_fs_stat(NULL, &req, argv[0], NULL);
+  bool dir = err == 0 && (req.statbuf.st_mode & S_IFMT) == S_IFDIR;
+  uv_fs_req_cleanup(&req);
+  if (err != 0) return err;
+
+  cast_t *c = xmalloc(sizeof(cast_t));
+  memset(c, 0, sizeof(cast_t));
+  c->process = process;
+  c->speed = 1;
+  c->name = argv[0];
+  uv_timer_init(process->loop, &c->timer);
+  process->data = c;
+
+  if (dir && argv[1] == NULL) {
+    cast_list(c, argv[0]);
+    uv_timer_start(&c->timer, cast_step, 0, 0);
+    return 0;
+  }
+  char *path = argv[0];
+  if (dir) {
+    // only the recordings in the directory
+    c->name = argv[1];
+    bool valid = argv[1][0] != '.' && strchr(argv[1], '/') == NULL && strchr(argv[1], '\\') == NULL;
+    for (const char *p = argv[1]; *p; p++) valid = valid && (unsigned char)*p >= 0x20;
+    if (!valid) {
+      process->data = NULL;
+      uv_close((uv_handle_t *)&c->timer, (uv_close_cb)free);
+      return UV_EINVAL;
+    }
+    size_t size = strlen(argv[0]) + strlen(argv[1]) + 2;
+    path = xmalloc(size);
+    snprintf(path, size, "%s/%s", argv[0], argv[1]);
+  }
+  char **opts = dir ? argv + 2 : argv + 1;
+  if (opts[0] != NULL) {
+    double speed = atof(opts[0]);
+    if (speed > 0) c->speed = speed;
+    if (opts[1] != NULL && atof(opts[1]) > 0) c->start = (uint64_t)(atof(opts[1]) * 1000000);
+  }
+
+  c->file = file_get(process->loop, path, &err);
+  if (path != argv[0]) free(path);
+  if (c->file == NULL) {
+    process->data = NULL;
+    uv_close((uv_handle_t *)&c->timer, (uv_close_cb)free);
+    return err;
+  }
+  if (c->file->ready) {
+    cast_play(c);
+  } else {
+    c->next_waiting = c->file->waiting;
+    c->file->waiting = c;
+  }
+  return 0;
+}
+
+static void cast_pause(pty_process *process) {
+  cast_t *c = (cast_t *)process->data;
+  uv_timer_stop(&c->timer);
+}
+
+static bool cast_resume(pty_process *process) {
+  cast_t *c = (cast_t *)process->data;
+  if (c->done && c->len == 0) return false;
+  // step on the next loop iteration, never from inside the caller
+  return uv_timer_start(&c->timer, cast_step, 0, 0) == 0;
+}
+
+// input controls the playback
+static int cast_write(pty_process *process, pty_buf_t *buf) {
+  cast_t *c = (cast_t *)process->data;
+  if (c->file == NULL || !c->file->ready || c->done) {
+    pty_buf_free(buf);
+    return 0;
+  }
+  uint64_t now = cast_now(c), duration = c->file->duration;
+  for (size_t i = 0; i < buf->len; i++) {
+    char ch = buf->base[i];
+    int64_t seek = 0;
+    if ((ch == '\x1b') && i + 2 < buf->len && (buf->base[i + 1] == '[' || buf->base[i + 1] == 'O')) {
+      ch = buf->base[i + 2];
+      i += 2;
+      if (ch == 'C') seek = 5;
+      if (ch == 'D') seek = -5;
+      if (ch == 'A') seek = 60;
+      if (ch == 'B') seek = -60;
+      if (seek == 0) continue;
+      seek *= 1000000;
+      cast_seek(c, (int64_t)now + seek > 0 ? (uint64_t)((int64_t)now + seek) : 0);
+    } else if (ch == ' ') {
+      // play again from the start at the end
+      if (!c->playing && now >= duration)
+        cast_seek(c, 0);
+      else
+        cast_rebase(c, now);
+      c->playing = !c->playing;
+    } else if (ch == '+' || ch == '=') {
+      cast_rebase(c, now);
+      if (c->speed < 16) c->speed *= 2;
+    } else if (ch == '-') {
+      cast_rebase(c, now);
+      if (c->speed > 0.0625) c->speed /= 2;
+    } else if (ch >= '0' && ch <= '9') {
+      cast_seek(c, duration / 10 * (uint64_t)(ch - '0'));
+    } else {
+      continue;
+    }
+    now = cast_now(c);
+    cast_status(c);
+  }
+  pty_buf_free(buf);
+  if (!process->paused) uv_timer_start(&c->timer, cast_step, 0, 0);
+  return 0;
+}
+
+static bool cast_resize(pty_process *process) { return true; }
+
+static bool cast_kill(pty_process *process, int sig) {
+  cast_finish(process, 0);
+  return true;
+}
+
+static bool cast_running(pty_process *process) {
+  cast_t *c = (cast_t *)process->data;
+  return c != NULL && !c->done;
+}
+
+static void cast_close_cb(uv_handle_t *handle) {
+  cast_t *c = (cast_t *)handle;
+  free(c->buf);
+  free(c);
+}
+
+static void cast_free(pty_process *process) {
+  cast_t *c = (cast_t *)process->data;
+  if (c == NULL) return;
+  if (c->file != NULL) {
+    for (cast_t **pp = &c->file->waiting; *pp != NULL; pp = &(*pp)->next_waiting) {
+      if (*pp == c) {
+        *pp = c->next_waiting;
+        break;
+      }
+    }
+    file_put(c->file);
+  }
+  c->process = NULL;
+  process->data = NULL;
+  uv_close((uv_handle_t *)&c->timer, cast_close_cb);
+}
+
+const pty_backend pty_backend_cast = {"cast",      cast_spawn, cast_pause,   cast_resume, cast_write,
+                                      cast_resize, cast_kill,  cast_running, cast_free, NULL};
@@ -1,15 +1,73 @@
+#include <json.h>
 #include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
 
+#ifdef TTYD_WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "compat.h"
 #include "html.h"
+#include "metrics.h"
+#include "probes.h"
 #include "server.h"
 #include "utils.h"
 
 enum { AUTH_OK, AUTH_FAIL, AUTH_ERROR };
 
-static char *html_cache = NULL;
-static size_t html_cache_len = 0;
+// the frontend is served from responses prepared at startup: the index (built-in or --index), plus its
+// content-hashed scripts and styles when the frontend is built in asset mode (`yarn run build:assets`).
+// each has one variant per content encoding, the body has LWS_PRE headroom so it can be written without
+// copying. the header values are ready too, the headers still go through the lws helpers so lws knows the
+// content length and can keep the connection alive.
+typedef struct {
+  const char *encoding;  // content encoding, NULL for identity
+  const char *content_type;
+  const char *cache_control;
+  char etag[48];         // strong validator, differs per encoding
+  unsigned char *buf;    // LWS_PRE + body
+  size_t len;            // body length
+} http_variant_t;
+
+enum { VARIANT_IDENTITY, VARIANT_GZIP, VARIANT_BR, VARIANT_ZSTD, VARIANT_COUNT };
+
+typedef struct http_resource {
+  const char *path;  // below the base path, "" for the index
+  char hash[20];     // content hash of a custom index
+  int refs;          // responses in flight writing from the bodies
+  bool retired;      // replaced by a reloaded custom index, freed once refs drops to 0
+  http_variant_t variants[VARIANT_COUNT];
+} http_resource_t;
+
+static http_resource_t *index_resource = NULL;
+static http_resource_t *asset_resources = NULL;  // html_assets_count entries
+
+// reloading the custom index when it changes on disk
+static uv_fs_event_t index_watcher;
+static uv_timer_t index_reload_timer;
+static bool index_watching = false;
+
+// <script> with window.ttydConfig (token and preferences) injected into the index, so the page
+// doesn't need to fetch the token before it can connect
+static char *index_config = NULL;
+
+typedef struct {
+  uv_work_t work;
+  char *file;            // copy of --index, the work must not touch server state
+  http_resource_t *res;  // the reloaded index, NULL on failure
+} index_reload_t;
+
+static index_reload_t *index_reloading = NULL;  // the reload on the thread pool, if any
+
+// the custom index is compressed at startup and on reload, brotli's max quality would take seconds for a big page
+#define INDEX_GZIP_LEVEL Z_BEST_COMPRESSION
+#define INDEX_BROTLI_QUALITY 9
+
+// assets are named by their content hash, they never change
+#define ASSET_CACHE_CONTROL "public, max-age=31536000, immutable"
 
 static int send_unauthorized(struct lws *wsi, unsigned int code, enum lws_token_indexes header) {
   unsigned char buffer[1024 + LWS_PRE], *p, *end;
@@ -43,44 +101,553 @@ static int check_auth(struct lws *wsi, struct pss_http *pss) {
   return AUTH_OK;
 }
 
-static bool accept_gzip(struct lws *wsi) {
-  char buf[256];
-  int len = lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_ACCEPT_ENCODING);
-  return len > 0 && strstr(buf, "gzip") != NULL;
-}
-
-static bool uncompress_html(char **output, size_t *output_len) {
-  if (html_cache == NULL || html_cache_len == 0) {
-    z_stream stream;
-    memset(&stream, 0, sizeof(stream));
-    if (inflateInit2(&stream, 16 + 15) != Z_OK) return false;
-
-    html_cache_len = index_html_size;
-    html_cache = xmalloc(html_cache_len);
-
-    stream.avail_in = index_html_len;
-    stream.avail_out = html_cache_len;
-    stream.next_in = (void *)index_html;
-    stream.next_out = (void *)html_cache;
-
-    int ret = inflate(&stream, Z_SYNC_FLUSH);
-    inflateEnd(&stream);
-    if (ret != Z_STREAM_END) {
-      free(html_cache);
-      html_cache = NULL;
-      html_cache_len = 0;
-      return false;
+// q-value (x1000) of a content coding in Accept-Encoding, 0 if it's not acceptable
+static int accept_qvalue(const char *header, const char *coding) {
+  int q = -1, any = 0;
+  const char *p = header;
+  while (*p != '\0') {
+    p += strspn(p, " \t,");
+    size_t name_len = strcspn(p, " \t;,");
+    if (name_len == 0) break;
+
+    int value = 1000;
+    const char *params = p + name_len;
+    const char *next = params + strcspn(params, ",");
+    const char *qp = strstr(params, "q=");
+    if (qp != NULL && qp < next) value = (int)(strtod(qp + 2, NULL) * 1000);
+
+    if (strlen(coding) == name_len && strncasecmp(p, coding, name_len) == 0)
+      q = value;
+    else if (name_len == 1 && *p == '*')
+      any = value;
+    p = next;
+  }
+  return q >= 0 ? q : any;
+}
+
+static void variant_init(http_variant_t *v, const char *encoding, size_t len, const struct html_asset *asset,
+                         const char *cache_control) {
+  v->encoding = encoding;
+  v->content_type = asset->type;
+  v->cache_control = cache_control;
+  snprintf(v->etag, sizeof(v->etag), "\"%s%s%s\"", asset->hash, encoding != NULL ? "-" : "",
+           encoding != NULL ? encoding : "");
+  v->buf = xmalloc(LWS_PRE + len);
+  v->len = len;
+}
+
+static void variant_free(http_variant_t *v) {
+  if (v->buf != NULL) free(v->buf);
+  memset(v, 0, sizeof(http_variant_t));
+}
+
+static bool uncompress_html(http_variant_t *v, const unsigned char *data, size_t len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 16 + 15) != Z_OK) return false;
+
+  stream.avail_in = len;
+  stream.avail_out = v->len;
+  stream.next_in = (void *)data;
+  stream.next_out = v->buf + LWS_PRE;
+
+  int ret = inflate(&stream, Z_SYNC_FLUSH);
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END;
+}
+
+// identity body is `raw` if given, otherwise inflated from the gzip body
+static bool resource_init(http_resource_t *res, const struct html_asset *asset, const unsigned char *raw,
+                          const char *cache_control) {
+  res->path = asset->path;
+  http_variant_t *v = &res->variants[VARIANT_IDENTITY];
+  variant_init(v, NULL, asset->size, asset, cache_control);
+  if (raw != NULL)
+    memcpy(v->buf + LWS_PRE, raw, asset->size);
+  else if (!uncompress_html(v, asset->gz, asset->gz_len))
+    return false;
+#ifndef LWS_WITH_HTTP_STREAM_COMPRESSION
+  // with stream compression lws compresses the identity body itself
+  const struct {
+    int index;
+    const char *encoding;
+    const unsigned char *data;
+    unsigned int len;
+  } encoded[] = {
+      {VARIANT_GZIP, "gzip", asset->gz, asset->gz_len},
+      {VARIANT_BR, "br", asset->br, asset->br_len},
+      {VARIANT_ZSTD, "zstd", asset->zst, asset->zst_len},
+  };
+  for (size_t i = 0; i < sizeof(encoded) / sizeof(encoded[0]); i++) {
+    if (encoded[i].len == 0) continue;  // not embedded by the frontend build
+    v = &res->variants[encoded[i].index];
+    variant_init(v, encoded[i].encoding, encoded[i].len, asset, cache_control);
+    memcpy(v->buf + LWS_PRE, encoded[i].data, encoded[i].len);
+  }
+#endif
+  return true;
+}
+
+static void resource_clear(http_resource_t *res) {
+  for (int i = 0; i < VARIANT_COUNT; i++) variant_free(&res->variants[i]);
+}
+
+static void resource_put(http_resource_t *res) {
+  if (--res->refs > 0 || !res->retired) return;
+  resource_clear(res);
+  free(res);
+}
+
+static unsigned char *gzip_compress(const unsigned char *data, size_t len, size_t *out_len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, INDEX_GZIP_LEVEL, Z_DEFLATED, 16 + 15, 9, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+  size_t bound = deflateBound(&stream, len);
+  unsigned char *out = xmalloc(bound);
+  stream.avail_in = len;
+  stream.next_in = (void *)data;
+  stream.avail_out = bound;
+  stream.next_out = out;
+
+  int ret = deflate(&stream, Z_FINISH);
+  *out_len = stream.total_out;
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+#ifdef TTYD_WITH_BROTLI
+static unsigned char *brotli_compress(const unsigned char *data, size_t len, size_t *out_len) {
+  size_t n = BrotliEncoderMaxCompressedSize(len);
+  if (n == 0) return NULL;
+  unsigned char *out = xmalloc(n);
+  if (!BrotliEncoderCompress(INDEX_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len, data, &n, out)) {
+    free(out);
+    return NULL;
+  }
+  *out_len = n;
+  return out;
+}
+#endif
+
+// FNV-1a, only used to tell versions of the index apart
+static uint64_t content_hash(const unsigned char *data, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static char *build_config() {
+  json_object *config = json_object_new_object();
+  json_object_object_add(config, "token", json_object_new_string(server->credential != NULL ? server->credential : ""));
+  json_object_object_add(config, "prefs", json_tokener_parse(server->prefs_json));
+  const char *json = json_object_to_json_string_ext(config, JSON_C_TO_STRING_PLAIN);
+
+  // '<' is escaped so nothing in the config can close the script element
+  size_t n = strlen(json);
+  for (const char *c = json; *c; c++)
+    if (*c == '<') n += 5;
+  char *script = xmalloc(n + 64);
+  char *p = script + sprintf(script, "<script>window.ttydConfig=");
+  for (const char *c = json; *c; c++) {
+    if (*c == '<')
+      p += sprintf(p, "\\u003c");
+    else
+      *p++ = *c;
+  }
+  sprintf(p, ";</script>");
+
+  json_object_put(config);
+  return script;
+}
+
+// the page carries the credential in its config, no cache may keep it then
+static const char *index_cache_control() {
+  return server->credential != NULL ? "no-store, private" : server->cache_control;
+}
+
+// the custom index with the config injected before </head>, as is if there's no </head>
+static unsigned char *inject_config(const unsigned char *page, size_t len, size_t *out_len) {
+  size_t pos = len;
+  for (size_t i = 0; i + 7 <= len; i++) {
+    if (page[i] == '<' && strncasecmp((const char *)page + i, "</head>", 7) == 0) {
+      pos = i;
+      break;
     }
   }
+  size_t n = pos < len ? strlen(index_config) : 0;
+
+  unsigned char *out = xmalloc(len + n);
+  memcpy(out, page, pos);
+  memcpy(out + pos, index_config, n);
+  memcpy(out + pos + n, page + pos, len - pos);
+  *out_len = len + n;
+  return out;
+}
+
+// load the custom index into memory and compress it, runs on the thread pool when reloading
+static http_resource_t *index_load(const char *file) {
+  FILE *fp = fopen(file, "rb");
+  if (fp == NULL) return NULL;
+
+  size_t cap = 64 * 1024, page_len = 0, n;
+  unsigned char *page = xmalloc(cap);
+  while ((n = fread(page + page_len, 1, cap - page_len, fp)) > 0) {
+    page_len += n;
+    if (page_len == cap) page = xrealloc(page, cap *= 2);
+  }
+  bool failed = ferror(fp) != 0;
+  fclose(fp);
+
+  size_t len = 0, gz_len = 0, br_len = 0;
+  unsigned char *raw = failed ? NULL : inject_config(page, page_len, &len);
+  unsigned char *gz = failed ? NULL : gzip_compress(raw, len, &gz_len);
+  unsigned char *br = NULL;
+#ifdef TTYD_WITH_BROTLI
+  if (gz != NULL) br = brotli_compress(raw, len, &br_len);
+#endif
+
+  http_resource_t *res = NULL;
+  if (gz != NULL) {
+    res = xmalloc(sizeof(http_resource_t));
+    memset(res, 0, sizeof(http_resource_t));
+    snprintf(res->hash, sizeof(res->hash), "%016llx", (unsigned long long)content_hash(raw, len));
+    const struct html_asset index = {"", "text/html", res->hash, (unsigned int)len, gz, br, NULL,
+                                     (unsigned int)gz_len, (unsigned int)br_len, 0};
+    resource_init(res, &index, raw, index_cache_control());
+  }
+
+  free(page);
+  free(raw);
+  free(gz);
+  free(br);
+  return res;
+}
+
+// the gzip head from html.h ends with a sync flush, the data goes in a final deflate stream after it
+static unsigned char *gzip_append(const unsigned char *data, size_t len, uLong head_crc, size_t *out_len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, INDEX_GZIP_LEVEL, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+  size_t bound = index_html_len + deflateBound(&stream, len) + 8;
+  unsigned char *out = xmalloc(bound);
+  memcpy(out, index_html, index_html_len);
+  stream.avail_in = len;
+  stream.next_in = (void *)data;
+  stream.avail_out = bound - index_html_len - 8;
+  stream.next_out = out + index_html_len;
+
+  int ret = deflate(&stream, Z_FINISH);
+  size_t n = index_html_len + stream.total_out;
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    free(out);
+    return NULL;
+  }
+
+  // trailer: crc32 and size of the whole page, little endian
+  uLong crc = crc32_combine(head_crc, crc32(0L, data, len), len);
+  uLong size = index_html_size + len;
+  for (int i = 0; i < 4; i++) out[n + i] = (crc >> (8 * i)) & 0xff;
+  for (int i = 0; i < 4; i++) out[n + 4 + i] = (size >> (8 * i)) & 0xff;
+  *out_len = n + 8;
+  return out;
+}
+
+// the brotli head from html.h ends byte aligned after a flush, the data follows as uncompressed
+// meta-blocks (up to 64k each), then the empty last meta-block
+static unsigned char *brotli_append(const unsigned char *data, size_t len, size_t *out_len) {
+  unsigned char *out = xmalloc(index_html_br_len + len + (len / 65536 + 1) * 3 + 1);
+  memcpy(out, index_html_br, index_html_br_len);
+  size_t n = index_html_br_len;
+  for (size_t off = 0; off < len; off += 65536) {
+    size_t chunk = len - off < 65536 ? len - off : 65536;
+    // ISLAST 0, MNIBBLES 4, MLEN - 1, ISUNCOMPRESSED 1, padded to the byte
+    uint32_t header = (uint32_t)(chunk - 1) << 3 | 1 << 19;
+    out[n++] = header & 0xff;
+    out[n++] = (header >> 8) & 0xff;
+    out[n++] = (header >> 16) & 0xff;
+    memcpy(out + n, data + off, chunk);
+    n += chunk;
+  }
+  out[n++] = 0x03;  // ISLAST 1, ISLASTEMPTY 1
+  *out_len = n;
+  return out;
+}
+
+// the zstd head from html.h is a frame without its last block and checksum, the data follows as
+// raw blocks (up to 128k each), the last one closes the frame
+static unsigned char *zstd_append(const unsigned char *data, size_t len, size_t *out_len) {
+  unsigned char *out = xmalloc(index_html_zst_len + len + (len / 131072 + 1) * 3);
+  memcpy(out, index_html_zst, index_html_zst_len);
+  size_t n = index_html_zst_len, off = 0;
+  do {
+    size_t chunk = len - off < 131072 ? len - off : 131072;
+    // Last_Block, Block_Type 0 (raw), Block_Size
+    uint32_t header = (off + chunk == len ? 1 : 0) | (uint32_t)chunk << 3;
+    out[n++] = header & 0xff;
+    out[n++] = (header >> 8) & 0xff;
+    out[n++] = (header >> 16) & 0xff;
+    memcpy(out + n, data + off, chunk);
+    n += chunk;
+    off += chunk;
+  } while (off < len);
+  *out_len = n;
+  return out;
+}
+
+// the embedded index: html.h has every encoding of the page up to </body> left open, the config and the
+// rest of the page are appended to each, so the page isn't compressed again at startup
+static http_resource_t *index_builtin() {
+  size_t config_len = strlen(index_config);
+  size_t len = config_len + index_html_tail_len;
+  unsigned char *raw = xmalloc(index_html_size + len);
+  unsigned char *suffix = raw + index_html_size;
+  memcpy(suffix, index_config, config_len);
+  memcpy(suffix + config_len, index_html_tail, index_html_tail_len);
+
+  // the head of the identity body
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 16 + 15) != Z_OK) {
+    free(raw);
+    return NULL;
+  }
+  stream.avail_in = index_html_len;
+  stream.avail_out = index_html_size;
+  stream.next_in = (void *)index_html;
+  stream.next_out = raw;
+  int ret = inflate(&stream, Z_SYNC_FLUSH);
+  inflateEnd(&stream);
+  if ((ret != Z_OK && ret != Z_BUF_ERROR) || stream.avail_in != 0 || stream.avail_out != 0) {
+    free(raw);
+    return NULL;
+  }
+
+  size_t gz_len = 0, br_len = 0, zst_len = 0;
+  unsigned char *gz = gzip_append(suffix, len, crc32(0L, raw, index_html_size), &gz_len);
+  unsigned char *br = index_html_br_len > 0 ? brotli_append(suffix, len, &br_len) : NULL;
+  unsigned char *zst = index_html_zst_len > 0 ? zstd_append(suffix, len, &zst_len) : NULL;
+
+  http_resource_t *res = NULL;
+  if (gz != NULL) {
+    res = xmalloc(sizeof(http_resource_t));
+    memset(res, 0, sizeof(http_resource_t));
+    // the build hash tells frontend versions apart, the config hash token and preference changes
+    snprintf(res->hash, sizeof(res->hash), "%.8s%08x", index_html_hash,
+             (unsigned int)content_hash((const unsigned char *)index_config, config_len));
+    const struct html_asset index = {"",
+                                     "text/html",
+                                     res->hash,
+                                     (unsigned int)(index_html_size + len),
+                                     gz,
+                                     br,
+                                     zst,
+                                     (unsigned int)gz_len,
+                                     (unsigned int)br_len,
+                                     (unsigned int)zst_len};
+    resource_init(res, &index, raw, index_cache_control());
+  }
+
+  free(raw);
+  free(gz);
+  free(br);
+  free(zst);
+  return res;
+}
+
+static void index_swap(http_resource_t *res) {
+  http_resource_t *old = index_resource;
+  index_resource = res;
+  if (old == NULL) return;
+  old->retired = true;
+  old->refs++;
+  resource_put(old);
+}
+
+static void index_reload_work(uv_work_t *work) {
+  index_reload_t *reload = (index_reload_t *)work;
+  reload->res = index_load(reload->file);
+}
+
+static void index_reload_done(uv_work_t *work, int status) {
+  index_reload_t *reload = (index_reload_t *)work;
+  index_reloading = NULL;
+  if (reload->res != NULL && index_resource == NULL) {
+    resource_clear(reload->res);
+    free(reload->res);
+  } else if (reload->res != NULL) {
+    index_swap(reload->res);
+    lwsl_notice("reloaded custom index.html: %s (%zu bytes)\n", reload->file,
+                index_resource->variants[VARIANT_IDENTITY].len);
+  } else if (status == 0) {
+    lwsl_warn("failed to reload custom index.html: %s, keep serving the old one\n", reload->file);
+  }
+  free(reload->file);
+  free(reload);
+}
+
+static void index_reload_cb(uv_timer_t *timer) {
+  // a reload is running, check again when it's done
+  if (index_reloading != NULL) {
+    uv_timer_start(&index_reload_timer, index_reload_cb, 100, 0);
+    return;
+  }
+  index_reload_t *reload = xmalloc(sizeof(index_reload_t));
+  memset(reload, 0, sizeof(index_reload_t));
+  reload->file = strdup(server->index);
+  index_reloading = reload;
+  uv_queue_work(server->loop, &reload->work, index_reload_work, index_reload_done);
+}
+
+static char *last_path_sep(const char *path) {
+  char *sep = strrchr(path, '/');
+#ifdef _WIN32
+  char *bsep = strrchr(path, '\\');
+  if (bsep != NULL && (sep == NULL || bsep > sep)) sep = bsep;
+#endif
+  return sep;
+}
+
+// the directory is watched rather than the file, editors tend to replace the file on save
+static void index_watch_cb(uv_fs_event_t *handle, const char *filename, int events, int status) {
+  if (status != 0 || filename == NULL) return;
+  const char *name = last_path_sep(server->index);
+  name = name != NULL ? name + 1 : server->index;
+  if (strcmp(filename, name) != 0) return;
+  // a save usually shows up as several events, reload once things settle down
+  uv_timer_start(&index_reload_timer, index_reload_cb, 100, 0);
+}
+
+static void index_watch_start() {
+  char dir[1024];
+  snprintf(dir, sizeof(dir), "%s", server->index);
+  char *slash = last_path_sep(dir);
+  if (slash == NULL)
+    snprintf(dir, sizeof(dir), ".");
+  else if (slash == dir)
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+
+  uv_fs_event_init(server->loop, &index_watcher);
+  uv_timer_init(server->loop, &index_reload_timer);
+  int err = uv_fs_event_start(&index_watcher, index_watch_cb, dir, 0);
+  if (err != 0) {
+    lwsl_warn("can not watch %s for changes of the custom index.html: %s\n", dir, uv_strerror(err));
+    return;
+  }
+  index_watching = true;
+}
+
+bool http_index_init() {
+  index_config = build_config();
 
-  *output = html_cache;
-  *output_len = html_cache_len;
+  if (server->index != NULL) {
+    index_resource = index_load(server->index);
+    if (index_resource == NULL) return false;
+    index_watch_start();
+  } else {
+    index_resource = index_builtin();
+    if (index_resource == NULL) return false;
+  }
 
+  if (html_assets_count == 0) return true;
+  asset_resources = xmalloc(sizeof(http_resource_t) * html_assets_count);
+  memset(asset_resources, 0, sizeof(http_resource_t) * html_assets_count);
+  for (unsigned int i = 0; i < html_assets_count; i++) {
+    if (!resource_init(&asset_resources[i], &html_assets[i], NULL, ASSET_CACHE_CONTROL)) {
+      http_index_free();
+      return false;
+    }
+  }
   return true;
 }
 
+void http_index_free() {
+  if (index_watching) {
+    uv_fs_event_stop(&index_watcher);
+    uv_timer_stop(&index_reload_timer);
+    index_watching = false;
+  }
+  // the done callback swaps the index, wait for it unless it can still be cancelled
+  if (index_reloading != NULL) {
+    uv_cancel((uv_req_t *)&index_reloading->work);
+    while (index_reloading != NULL) uv_run(server->loop, UV_RUN_ONCE);
+  }
+  if (index_resource != NULL) {
+    resource_clear(index_resource);
+    free(index_resource);
+    index_resource = NULL;
+  }
+  if (asset_resources != NULL) {
+    for (unsigned int i = 0; i < html_assets_count; i++) resource_clear(&asset_resources[i]);
+    free(asset_resources);
+    asset_resources = NULL;
+  }
+  free(index_config);
+  index_config = NULL;
+}
+
+// the resource for a request path, NULL if there's none
+static http_resource_t *find_resource(const char *path) {
+  size_t base_len = strlen(endpoints.index);
+  if (strncmp(path, endpoints.index, base_len) != 0) return NULL;
+  if (path[base_len] == '\0') return index_resource;
+  for (unsigned int i = 0; asset_resources != NULL && i < html_assets_count; i++) {
+    if (strcmp(path + base_len, asset_resources[i].path) == 0) return &asset_resources[i];
+  }
+  return NULL;
+}
+
+// the encoding with the highest q-value in Accept-Encoding, ties go to the smaller body
+static http_variant_t *select_variant(struct lws *wsi, http_resource_t *res) {
+  static const int preferred[] = {VARIANT_BR, VARIANT_ZSTD, VARIANT_GZIP};
+  http_variant_t *best = &res->variants[VARIANT_IDENTITY];
+  char buf[256];
+  if (lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_ACCEPT_ENCODING) <= 0) return best;
+
+  int best_q = 0;
+  for (size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++) {
+    http_variant_t *v = &res->variants[preferred[i]];
+    if (v->buf == NULL) continue;
+    int q = accept_qvalue(buf, v->encoding);
+    if (q > best_q) {
+      best = v;
+      best_q = q;
+    }
+  }
+  return best;
+}
+
+// the client's cached copy is still current (If-None-Match uses the weak comparison, so W/"x" matches too)
+static bool etag_match(struct lws *wsi, const char *etag) {
+  char buf[256];
+  int len = lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_IF_NONE_MATCH);
+  return len > 0 && (strcmp(buf, "*") == 0 || strstr(buf, etag) != NULL);
+}
+
 static void pss_buffer_free(struct pss_http *pss) {
-  if (pss->buffer != (char *)index_html && pss->buffer != html_cache) free(pss->buffer);
+  if (pss->resource != NULL)
+    resource_put(pss->resource);
+  else
+    free(pss->buffer);
+  pss->resource = NULL;
+  pss->buffer = NULL;
+}
+
+// bytes the socket can take right now, so a chunk is neither tiny nor left to lws to buffer
+static size_t write_chunk_size(struct lws *wsi) {
+  int n = socket_sndbuf_free(lws_get_socket_fd(lws_get_network_wsi(wsi)));
+  return n > 4096 ? (size_t)n : 4096;
 }
 
 static void access_log(struct lws *wsi, const char *path) {
@@ -98,6 +665,7 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
   switch (reason) {
     case LWS_CALLBACK_HTTP:
+      PROBE1(http_request, (const char *)in);
       access_log(wsi, (const char *)in);
       snprintf(pss->path, sizeof(pss->path), "%s", (const char *)in);
       switch (check_auth(wsi, pss)) {
@@ -113,6 +681,28 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       p = buffer + LWS_PRE;
       end = p + sizeof(buffer) - LWS_PRE;
 
+      if (server->metrics && strcmp(pss->path, endpoints.metrics) == 0) {
+        size_t n;
+        char *text = metrics_render(&n);
+        if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
+            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE,
+                                         (unsigned char *)"text/plain; version=0.0.4", 25, &p, end) ||
+            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (unsigned char *)"no-store", 8, &p,
+                                         end) ||
+            lws_add_http_header_content_length(wsi, (unsigned long)n, &p, end) ||
+            lws_finalize_http_header(wsi, &p, end) ||
+            lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0) {
+          free(text);
+          return 1;
+        }
+
+        pss->buffer = pss->ptr = text;
+        pss->len = n;
+        pss->resource = NULL;
+        lws_callback_on_writable(wsi);
+        break;
+      }
+
       if (strcmp(pss->path, endpoints.token) == 0) {
         const char *credential = server->credential != NULL ? server->credential : "";
         size_t n = snprintf(buf, sizeof(buf), "{\"token\": \"%s\"}", credential);
@@ -126,6 +716,7 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
         pss->buffer = pss->ptr = strdup(buf);
         pss->len = n;
+        pss->resource = NULL;
         lws_callback_on_writable(wsi);
         break;
       }
@@ -141,42 +732,42 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
         goto try_to_reuse;
       }
 
-      if (strcmp(pss->path, endpoints.index) != 0) {
+      http_resource_t *res = find_resource(pss->path);
+      if (res == NULL) {
         lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
         goto try_to_reuse;
       }
 
-      const char *content_type = "text/html";
-      if (server->index != NULL) {
-        int n = lws_serve_http_file(wsi, server->index, content_type, NULL, 0);
-        if (n < 0 || (n > 0 && lws_http_transaction_completed(wsi))) return 1;
-      } else {
-        char *output = (char *)index_html;
-        size_t output_len = index_html_len;
-        if (lws_add_http_header_status(wsi, HTTP_STATUS_OK, &p, end) ||
-            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (const unsigned char *)content_type, 9, &p,
-                                         end))
-          return 1;
-#ifdef LWS_WITH_HTTP_STREAM_COMPRESSION
-        if (!uncompress_html(&output, &output_len)) return 1;
-#else
-        if (accept_gzip(wsi)) {
-          if (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, (unsigned char *)"gzip", 4, &p, end))
-            return 1;
-        } else {
-          if (!uncompress_html(&output, &output_len)) return 1;
-        }
-#endif
+      http_variant_t *v = select_variant(wsi, res);
+      bool fresh = etag_match(wsi, v->etag);
+      if (lws_add_http_header_status(wsi, fresh ? HTTP_STATUS_NOT_MODIFIED : HTTP_STATUS_OK, &p, end) ||
+          lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_ETAG, (unsigned char *)v->etag, (int)strlen(v->etag), &p,
+                                       end) ||
+          lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, (unsigned char *)v->cache_control,
+                                       (int)strlen(v->cache_control), &p, end) ||
+          lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_VARY, (unsigned char *)"accept-encoding", 15, &p, end))
+        return 1;
+      if (!fresh &&
+          (lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, (unsigned char *)v->content_type,
+                                        (int)strlen(v->content_type), &p, end) ||
+           (v->encoding != NULL &&
+            lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, (unsigned char *)v->encoding,
+                                         (int)strlen(v->encoding), &p, end))))
+        return 1;
+      if (lws_add_http_header_content_length(wsi, fresh ? 0 : (unsigned long)v->len, &p, end) ||
+          lws_finalize_http_header(wsi, &p, end) ||
+          lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+        return 1;
+      if (fresh) goto try_to_reuse;
 
-        if (lws_add_http_header_content_length(wsi, (unsigned long)output_len, &p, end) ||
-            lws_finalize_http_header(wsi, &p, end) ||
-            lws_write(wsi, buffer + LWS_PRE, p - (buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
-          return 1;
+      metrics.http_bytes += v->len;
+      metrics.http_identity_bytes += res->variants[VARIANT_IDENTITY].len;
 
-        pss->buffer = pss->ptr = output;
-        pss->len = output_len;
-        lws_callback_on_writable(wsi);
-      }
+      pss->buffer = pss->ptr = (char *)v->buf + LWS_PRE;
+      pss->len = v->len;
+      pss->resource = res;
+      res->refs++;
+      lws_callback_on_writable(wsi);
       break;
 
     case LWS_CALLBACK_HTTP_WRITEABLE:
@@ -185,21 +776,34 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       }
 
       do {
-        int n = sizeof(buffer) - LWS_PRE;
+        size_t n = pss->resource != NULL ? write_chunk_size(wsi) : sizeof(buffer) - LWS_PRE;
         int m = lws_get_peer_write_allowance(wsi);
         if (m == 0) {
           lws_callback_on_writable(wsi);
           return 0;
-        } else if (m != -1 && m < n) {
-          n = m;
+        } else if (m != -1 && (size_t)m < n) {
+          n = (size_t)m;
         }
-        if (pss->ptr + n > pss->buffer + pss->len) {
-          n = (int)(pss->len - (pss->ptr - pss->buffer));
+        if (pss->ptr + n >= pss->buffer + pss->len) {
+          n = pss->len - (pss->ptr - pss->buffer);
           done = true;
         }
-        memcpy(buffer + LWS_PRE, pss->ptr, n);
+
+        int w;
+        if (pss->resource != NULL) {
+          // write from the shared body in place, lending the bytes before the chunk to lws as LWS_PRE.
+          // lws is done with them when lws_write returns, what the socket didn't take is buffered by lws.
+          unsigned char *chunk = (unsigned char *)pss->ptr;
+          unsigned char pre[LWS_PRE];
+          memcpy(pre, chunk - LWS_PRE, LWS_PRE);
+          w = lws_write_http(wsi, chunk, n);
+          memcpy(chunk - LWS_PRE, pre, LWS_PRE);
+        } else {
+          memcpy(buffer + LWS_PRE, pss->ptr, n);
+          w = lws_write_http(wsi, buffer + LWS_PRE, n);
+        }
         pss->ptr += n;
-        if (lws_write_http(wsi, buffer + LWS_PRE, (size_t)n) < n) {
+        if (w < (int)n) {
           pss_buffer_free(pss);
           return -1;
         }
@@ -215,6 +819,11 @@ int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
     case LWS_CALLBACK_HTTP_FILE_COMPLETION:
       goto try_to_reuse;
+
+    case LWS_CALLBACK_CLOSED_HTTP:
+      // closed in the middle of a response
+      if (pss != NULL && pss->buffer != NULL) pss_buffer_free(pss);
+      break;
 #if (defined(LWS_OPENSSL_SUPPORT) || defined(LWS_WITH_TLS)) && !defined(LWS_WITH_MBEDTLS)
     case LWS_CALLBACK_OPENSSL_PERFORM_CLIENT_CERT_VERIFICATION:
       if (!len || (SSL_get_verify_result((SSL *)in) != X509_V_OK)) {
@@ -0,0 +1,304 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "server.h"
+#include "utils.h"
+
+struct metrics metrics;
+
+// the loop lag is sampled every LOOP_SAMPLE_MS, the interval stats roll over every LOOP_INTERVAL_MS
+#define LOOP_SAMPLE_MS 100
+#define LOOP_INTERVAL_MS 1000
+
+static uv_timer_t monitor_timer;
+static uv_loop_t *monitor_loop = NULL;
+static int monitor_warn_ms = 0;
+static uint64_t monitor_due;       // when the timer should fire next (ns)
+static uint64_t interval_start;    // ns
+static uint64_t interval_idle;     // idle time at the start of the interval (ns)
+static uint64_t interval_lag_max;  // us
+static bool idle_supported = false;  // uv_metrics_idle_time() needs libuv 1.39
+
+static const char *protocol_name[] = {"http", "tty"};
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t cap;
+} text_t;
+
+static void text_printf(text_t *t, const char *fmt, ...) {
+  va_list ap;
+  for (;;) {
+    va_start(ap, fmt);
+    int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < t->cap - t->len) {
+      t->len += n;
+      return;
+    }
+    t->cap = t->cap * 2 > t->len + n + 1 ? t->cap * 2 : t->len + n + 1;
+    t->buf = xrealloc(t->buf, t->cap);
+  }
+}
+
+static void metric_header(text_t *t, const char *name, const char *type, const char *help) {
+  text_printf(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void counter(text_t *t, const char *name, const char *help, uint64_t v) {
+  metric_header(t, name, "counter", help);
+  text_printf(t, "%s %llu\n", name, (unsigned long long)v);
+}
+
+static void gauge(text_t *t, const char *name, const char *help, double v) {
+  metric_header(t, name, "gauge", help);
+  text_printf(t, "%s %.15g\n", name, v);
+}
+
+// `scale` converts the recorded values to the unit of the metric (eg: us to seconds)
+static void histogram(text_t *t, const char *name, const char *help, const histogram_t *h, double scale) {
+  metric_header(t, name, "histogram", help);
+  uint64_t cumulative = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+    cumulative += h->buckets[i];
+    text_printf(t, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ULL << i) * scale,
+                (unsigned long long)cumulative);
+  }
+  text_printf(t, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+  text_printf(t, "%s_sum %.15g\n", name, (double)h->sum * scale);
+  text_printf(t, "%s_count %llu\n", name, (unsigned long long)h->count);
+}
+
+static const char *reason_name(int slot) {
+  static char buf[16];
+  if (slot == CALLBACK_REASONS - 1) return "other";
+  switch ((enum lws_callback_reasons)slot) {
+    case LWS_CALLBACK_ESTABLISHED:
+      return "established";
+    case LWS_CALLBACK_CLOSED:
+      return "closed";
+    case LWS_CALLBACK_RECEIVE:
+      return "receive";
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+      return "server_writeable";
+    case LWS_CALLBACK_HTTP:
+      return "http";
+    case LWS_CALLBACK_HTTP_WRITEABLE:
+      return "http_writeable";
+    case LWS_CALLBACK_CLOSED_HTTP:
+      return "closed_http";
+    case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
+      return "filter_protocol_connection";
+    case LWS_CALLBACK_TIMER:
+      return "timer";
+    default:
+      snprintf(buf, sizeof(buf), "%d", slot);
+      return buf;
+  }
+}
+
+static void callbacks(text_t *t) {
+  metric_header(t, "ttyd_callbacks_total", "counter", "lws callbacks, by protocol and reason.");
+  for (int p = 0; p < PROTOCOL_COUNT; p++) {
+    for (int r = 0; r < CALLBACK_REASONS; r++) {
+      const callback_stat_t *st = &metrics.callbacks[p][r];
+      if (st->count == 0) continue;
+      text_printf(t, "ttyd_callbacks_total{protocol=\"%s\",reason=\"%s\"} %llu\n", protocol_name[p], reason_name(r),
+                  (unsigned long long)st->count);
+    }
+  }
+  metric_header(t, "ttyd_callback_seconds_total", "counter", "Time spent in lws callbacks, by protocol and reason.");
+  for (int p = 0; p < PROTOCOL_COUNT; p++) {
+    for (int r = 0; r < CALLBACK_REASONS; r++) {
+      const callback_stat_t *st = &metrics.callbacks[p][r];
+      if (st->count == 0) continue;
+      text_printf(t, "ttyd_callback_seconds_total{protocol=\"%s\",reason=\"%s\"} %.9g\n", protocol_name[p],
+                  reason_name(r), (double)st->total / 1e9);
+    }
+  }
+  metric_header(t, "ttyd_callback_max_seconds", "gauge", "Longest lws callback, by protocol and reason.");
+  for (int p = 0; p < PROTOCOL_COUNT; p++) {
+    for (int r = 0; r < CALLBACK_REASONS; r++) {
+      const callback_stat_t *st = &metrics.callbacks[p][r];
+      if (st->count == 0) continue;
+      text_printf(t, "ttyd_callback_max_seconds{protocol=\"%s\",reason=\"%s\"} %.9g\n", protocol_name[p],
+                  reason_name(r), (double)st->max / 1e9);
+    }
+  }
+
+  const callback_worst_t *w = &metrics.worst;
+  metric_header(t, "ttyd_loop_callback_max_seconds", "gauge", "Longest lws callback of the last interval.");
+  if (w->duration > 0)
+    text_printf(t, "ttyd_loop_callback_max_seconds{protocol=\"%s\",reason=\"%s\"} %.9g\n", protocol_name[w->protocol],
+                reason_name(w->reason), (double)w->duration / 1e9);
+}
+
+char *metrics_render(size_t *len) {
+  text_t t = {xmalloc(8192), 0, 8192};
+
+  gauge(&t, "ttyd_clients", "Connected websocket clients.", server->client_count);
+  gauge(&t, "ttyd_sessions", "Running processes.", (double)metrics.sessions_running);
+  counter(&t, "ttyd_sessions_total", "Processes spawned.", metrics.sessions);
+  counter(&t, "ttyd_spawn_failures_total", "Processes that failed to spawn.", metrics.spawn_failures);
+  histogram(&t, "ttyd_spawn_duration_seconds", "Time to spawn a process.", &metrics.spawn_latency, 1e-6);
+
+  metric_header(&t, "ttyd_process_exits_total", "counter", "Processes exited, by exit code or signal.");
+  for (int i = 0; i < 256; i++) {
+    if (metrics.exit_codes[i] == 0) continue;
+    text_printf(&t, "ttyd_process_exits_total{code=\"%d\"} %llu\n", i, (unsigned long long)metrics.exit_codes[i]);
+  }
+  for (int i = 0; i < 65; i++) {
+    if (metrics.exit_signals[i] == 0) continue;
+    text_printf(&t, "ttyd_process_exits_total{signal=\"%d\"} %llu\n", i,
+                (unsigned long long)metrics.exit_signals[i]);
+  }
+
+  counter(&t, "ttyd_ws_received_bytes_total", "Websocket payload bytes received.", metrics.ws_rx_bytes);
+  counter(&t, "ttyd_ws_received_frames_total", "Websocket frames received.", metrics.ws_rx_frames);
+  counter(&t, "ttyd_ws_sent_bytes_total", "Websocket payload bytes sent.", metrics.ws_tx_bytes);
+  counter(&t, "ttyd_ws_sent_frames_total", "Websocket frames sent.", metrics.ws_tx_frames);
+
+  counter(&t, "ttyd_pty_reads_total", "Reads from the pty.", metrics.pty_read_size.count);
+  counter(&t, "ttyd_pty_read_bytes_total", "Bytes read from the pty.", metrics.pty_read_size.sum);
+  histogram(&t, "ttyd_pty_read_size_bytes", "Bytes per read from the pty.", &metrics.pty_read_size, 1);
+
+  metric_header(&t, "ttyd_flow_control_total", "counter", "Flow control messages from clients.");
+  text_printf(&t, "ttyd_flow_control_total{message=\"pause\"} %llu\n", (unsigned long long)metrics.pauses);
+  text_printf(&t, "ttyd_flow_control_total{message=\"resume\"} %llu\n", (unsigned long long)metrics.resumes);
+
+  metric_header(&t, "ttyd_slow_client_actions_total", "counter", "Actions taken on slow clients.");
+  for (int i = SLOW_PAUSE; i <= SLOW_DISCONNECT; i++) {
+    text_printf(&t, "ttyd_slow_client_actions_total{action=\"%s\"} %llu\n", slow_policy_name[i],
+                (unsigned long long)server->slow_count[i]);
+  }
+
+  size_t queued, peak;
+  send_queue_totals(&queued, &peak);
+  gauge(&t, "ttyd_send_queue_bytes", "Output queued for all clients.", (double)queued);
+  gauge(&t, "ttyd_send_queue_peak_bytes", "High water mark of ttyd_send_queue_bytes.", (double)peak);
+  gauge(&t, "ttyd_send_queue_spill_bytes",
+        "Output spilled for all clients (--spill-dir), held behind a full spill included.",
+        (double)send_queue_spill_total());
+
+  histogram(&t, "ttyd_latency_network_seconds", "Keystroke to echo latency, client round trip outside the server.",
+            &metrics.latency.network, 1e-6);
+  histogram(&t, "ttyd_latency_pty_seconds", "Keystroke to echo latency, from writing the input to reading the pty.",
+            &metrics.latency.pty, 1e-6);
+  histogram(&t, "ttyd_latency_queue_seconds", "Keystroke to echo latency, from reading the pty to writing to lws.",
+            &metrics.latency.queue, 1e-6);
+
+  histogram(&t, "ttyd_output_dispatch_seconds", "Output from the pty read to process_read_cb.",
+            &metrics.output_dispatch, 1e-6);
+  histogram(&t, "ttyd_output_hold_seconds", "Output held back before it is queued (synchronized updates).",
+            &metrics.output_hold, 1e-6);
+  histogram(&t, "ttyd_output_queue_seconds", "Output from the send queue until lws_write of its last byte.",
+            &metrics.output_queue, 1e-6);
+
+  counter(&t, "ttyd_http_sent_bytes_total", "Index and asset body bytes sent.", metrics.http_bytes);
+  counter(&t, "ttyd_http_identity_bytes_total", "Index and asset body bytes sent, before compression.",
+          metrics.http_identity_bytes);
+  gauge(&t, "ttyd_http_compression_ratio", "Uncompressed to sent bytes of the index and assets.",
+        metrics.http_bytes > 0 ? (double)metrics.http_identity_bytes / (double)metrics.http_bytes : 1);
+
+  if (metrics.loop_monitor) {
+    histogram(&t, "ttyd_loop_lag_seconds", "How late a timer fires on the event loop.", &metrics.loop_lag, 1e-6);
+    gauge(&t, "ttyd_loop_lag_max_seconds", "Max event loop lag of the last interval.",
+          (double)metrics.loop_lag_max / 1e6);
+    if (idle_supported) {
+      gauge(&t, "ttyd_loop_utilization", "Share of the last interval the event loop was busy.",
+            metrics.loop_utilization);
+      metric_header(&t, "ttyd_loop_idle_seconds_total", "counter", "Time the event loop spent idle.");
+      text_printf(&t, "ttyd_loop_idle_seconds_total %.9g\n", (double)metrics.loop_idle / 1e9);
+    }
+    callbacks(&t);
+  }
+
+  *len = t.len;
+  return t.buf;
+}
+
+void callback_timed(int protocol, enum lws_callback_reasons reason, uint64_t duration, const char *client) {
+  int slot = (unsigned int)reason < CALLBACK_REASONS - 1 ? (int)reason : CALLBACK_REASONS - 1;
+  callback_stat_t *st = &metrics.callbacks[protocol][slot];
+  st->count++;
+  st->total += duration;
+  if (duration > st->max) st->max = duration;
+
+  callback_worst_t *w = &metrics.worst_now;
+  if (duration <= w->duration) return;
+  w->duration = duration;
+  w->protocol = protocol;
+  w->reason = slot;
+  snprintf(w->client, sizeof(w->client), "%s", client != NULL ? client : "");
+}
+
+static uint64_t idle_time() {
+#if UV_VERSION_HEX >= 0x012700
+  if (idle_supported) return uv_metrics_idle_time(monitor_loop);
+#endif
+  return 0;
+}
+
+static void interval_end(uint64_t now) {
+  uint64_t idle = idle_time();
+  if (idle_supported) {
+    uint64_t wall = now - interval_start;
+    uint64_t idled = idle - interval_idle;
+    metrics.loop_utilization = wall > idled ? (double)(wall - idled) / (double)wall : 0;
+    metrics.loop_idle = idle;
+  }
+  metrics.loop_lag_max = interval_lag_max;
+  metrics.worst = metrics.worst_now;
+  memset(&metrics.worst_now, 0, sizeof(metrics.worst_now));
+  interval_start = now;
+  interval_idle = idle;
+  interval_lag_max = 0;
+
+  if (monitor_warn_ms <= 0) return;
+  uint64_t warn = (uint64_t)monitor_warn_ms * 1000;
+  const callback_worst_t *w = &metrics.worst;
+  if (metrics.loop_lag_max < warn && w->duration / 1000 < warn) return;
+  if (w->duration == 0) {
+    lwsl_warn("event loop stalled: lag %llu ms\n", (unsigned long long)metrics.loop_lag_max / 1000);
+    return;
+  }
+  lwsl_warn("event loop stalled: lag %llu ms, longest callback: %s %s %llu ms (%s)\n",
+            (unsigned long long)metrics.loop_lag_max / 1000, protocol_name[w->protocol], reason_name(w->reason),
+            (unsigned long long)w->duration / 1000000, w->client);
+}
+
+static void monitor_cb(uv_timer_t *timer) {
+  uint64_t now = uv_hrtime();
+  uint64_t lag = now > monitor_due ? (now - monitor_due) / 1000 : 0;
+  histogram_observe(&metrics.loop_lag, lag);
+  if (lag > interval_lag_max) interval_lag_max = lag;
+  monitor_due = now + LOOP_SAMPLE_MS * 1000000ULL;
+  if (now - interval_start >= LOOP_INTERVAL_MS * 1000000ULL) interval_end(now);
+}
+
+void loop_monitor_start(uv_loop_t *loop, int warn_ms) {
+  monitor_loop = loop;
+  monitor_warn_ms = warn_ms;
+  metrics.loop_monitor = true;
+#if UV_VERSION_HEX >= 0x012700
+  idle_supported = uv_loop_configure(loop, UV_METRICS_IDLE_TIME) == 0;
+#endif
+  interval_start = uv_hrtime();
+  interval_idle = idle_time();
+  monitor_due = interval_start + LOOP_SAMPLE_MS * 1000000ULL;
+  uv_timer_init(loop, &monitor_timer);
+  uv_timer_start(&monitor_timer, monitor_cb, LOOP_SAMPLE_MS, LOOP_SAMPLE_MS);
+}
+
+void loop_monitor_stop() {
+  if (!metrics.loop_monitor) return;
+  uv_timer_stop(&monitor_timer);
+  metrics.loop_monitor = false;
+}
@@ -0,0 +1,109 @@
+#ifndef TTYD_METRICS_H
+#define TTYD_METRICS_H
+
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+#define HISTOGRAM_BUCKETS 25
+
+// lws callback reasons are counted by value, the few larger ones (eg: LWS_CALLBACK_USER) share the last slot
+#define CALLBACK_REASONS 128
+
+enum { PROTOCOL_HTTP, PROTOCOL_TTY, PROTOCOL_COUNT };
+
+// histogram with power of 2 buckets: buckets[i] counts the values in (2^(i-1), 2^i],
+// the last one everything larger
+typedef struct {
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+} histogram_t;
+
+// keystroke to echo latency, split at the server: network is the client's round trip minus the time
+// the probe spent in the server, pty is from writing the input to reading the next output, queue is
+// from that read to handing the output to lws
+typedef struct {
+  histogram_t network;  // us
+  histogram_t pty;      // us
+  histogram_t queue;    // us
+} latency_stats_t;
+
+// the latency probe of a session in flight, times are uv_hrtime() (ns)
+typedef struct {
+  uint32_t id;
+  uint64_t received;  // probe received, 0 if none in flight
+  uint64_t written;   // the input following it written to the pty
+  uint64_t read;      // the first output read from the pty after that
+  uint64_t target;    // the output is sent once the send queue wrote this many bytes
+  uint32_t done_id;   // the last probe answered
+  uint64_t done;      // the server part of its latency (ns), for the client's round trip report
+} latency_probe_t;
+
+typedef struct {
+  uint64_t count;
+  uint64_t total;  // ns
+  uint64_t max;    // ns
+} callback_stat_t;
+
+// the longest callback of an interval
+typedef struct {
+  uint64_t duration;  // ns
+  int protocol;
+  int reason;
+  char client[128];   // client address or request path
+} callback_worst_t;
+
+// counters are only updated from the event loop thread, so they are plain integers:
+// an update on the hot path is an increment, no locks or atomics
+struct metrics {
+  uint64_t sessions;             // processes spawned
+  uint64_t sessions_running;     // processes spawned and not freed yet
+  uint64_t spawn_failures;       // processes failed to spawn
+  histogram_t spawn_latency;     // time to spawn a process (us)
+  uint64_t exit_codes[256];      // processes exited, by exit code
+  uint64_t exit_signals[65];     // processes killed, by signal
+  uint64_t ws_rx_bytes;          // websocket payload bytes received
+  uint64_t ws_rx_frames;         // websocket frames received
+  uint64_t ws_tx_bytes;          // websocket payload bytes sent
+  uint64_t ws_tx_frames;         // websocket frames sent
+  histogram_t pty_read_size;     // bytes per read from the pty
+  uint64_t pauses;               // PAUSE messages from clients
+  uint64_t resumes;              // RESUME messages from clients
+  uint64_t http_bytes;           // index and asset body bytes sent
+  uint64_t http_identity_bytes;  // the same bodies uncompressed
+  latency_stats_t latency;       // keystroke latency of all sessions
+  histogram_t output_dispatch;   // output from the pty read to process_read_cb (us)
+  histogram_t output_hold;       // output from process_read_cb to the send queue, eg: synchronized updates (us)
+  histogram_t output_queue;      // output from the send queue to lws_write of its last byte (us)
+
+  bool loop_monitor;             // whether the loop lag and callback durations are measured
+  histogram_t loop_lag;          // how late the monitor timer fired (us)
+  uint64_t loop_lag_max;         // max lag in the last interval (us)
+  double loop_utilization;       // share of the last interval the loop was busy
+  uint64_t loop_idle;            // time the loop spent idle in total (ns)
+  callback_stat_t callbacks[PROTOCOL_COUNT][CALLBACK_REASONS];
+  callback_worst_t worst;        // longest callback of the last interval
+  callback_worst_t worst_now;    // longest callback of the current interval
+};
+
+extern struct metrics metrics;
+
+static inline void histogram_observe(histogram_t *h, uint64_t v) {
+  int i = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1);
+  h->buckets[i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1]++;
+  h->count++;
+  h->sum += v;
+}
+
+// the metrics in the prometheus text format, the caller frees it
+char *metrics_render(size_t *len);
+
+// measure the loop lag, idle time and callback durations, log the intervals with a stall of `warn_ms` or more
+void loop_monitor_start(uv_loop_t *loop, int warn_ms);
+void loop_monitor_stop();
+void callback_timed(int protocol, enum lws_callback_reasons reason, uint64_t duration, const char *client);
+
+#endif  // TTYD_METRICS_H
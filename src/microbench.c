@@ -0,0 +1,439 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include "pty.h"
+#include "queue.h"
+#include "server.h"
+#include "sync.h"
+#include "utils.h"
+
+// ttyd-microbench: runs the output pipeline in process, without a browser or a shell. a writer thread
+// feeds a VT stream into a socketpair that stands in for the pty master, the real pty read_cb reads it,
+// the dispatch stage mirrors process_read_cb (sync_feed + queue) and the write stage mirrors wsi_output
+// with lws_write stubbed by a sink. reports ns/byte, allocations per chunk and frames per MB by stage.
+
+#define CORPUS_SIZE (1024 * 1024)
+
+// with -Wl,--wrap=malloc,... the allocations of ttyd's code are counted, libuv and libc are not
+#ifdef BENCH_COUNT_ALLOCS
+static uint64_t allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  allocs++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocs++;
+  return __real_realloc(p, size);
+}
+#define ALLOCS() allocs
+#define ALLOCS_COUNTED true
+#else
+#define ALLOCS() ((uint64_t)0)
+#define ALLOCS_COUNTED false
+#endif
+
+typedef struct {
+  uint64_t ns;
+  uint64_t allocs;
+  uint64_t units;  // chunks read, messages queued or frames written
+} stage_t;
+
+typedef struct {
+  const char *name;
+  char *data;
+  size_t len;
+} corpus_t;
+
+static struct {
+  size_t total;       // bytes to feed per workload
+  size_t write_size;  // bytes per write into the socketpair
+  bool sync;          // synchronized output detection, like the default --sync-timeout
+  size_t frame_size;  // like --frame-size
+  bool json;
+} opts;
+
+static struct {
+  const corpus_t *corpus;
+  int fd;
+  size_t fed;
+} feeder;
+
+static struct {
+  sync_state_t sync;
+  send_queue_t queue;
+  size_t bytes;       // read from the socketpair
+  uint64_t chunks;    // reads delivered by the pty read_cb
+  uint64_t sunk;      // payload bytes that reached lws_write
+  stage_t dispatch;
+  stage_t write;
+} run;
+
+static volatile unsigned char sink_sum;
+
+// the sink: a real lws_write copies into the socket or its own buffer, touching the bytes is close enough
+int lws_write(struct lws *wsi, unsigned char *buf, size_t len, enum lws_write_protocol protocol) {
+  unsigned char s = 0;
+  for (size_t i = 0; i < len; i += 64) s ^= buf[i];
+  sink_sum = s;
+  run.write.units++;
+  return (int)len;
+}
+
+static void feeder_thread(void *arg) {
+  const corpus_t *c = feeder.corpus;
+  size_t off = 0;
+  while (feeder.fed < opts.total) {
+    size_t n = opts.write_size;
+    if (n > c->len - off) n = c->len - off;
+    if (n > opts.total - feeder.fed) n = opts.total - feeder.fed;
+    ssize_t w = write(feeder.fd, c->data + off, n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    feeder.fed += (size_t)w;
+    off = (off + (size_t)w) % c->len;
+  }
+  close(feeder.fd);
+}
+
+static void queue_output(void *ctx, const char *data, size_t len) {
+  send_msg_t *msg = send_msg_new(OUTPUT, data, len, true);
+  send_queue_push(&run.queue, msg);
+  run.dispatch.units++;
+}
+
+static void drain() {
+  uint64_t start = uv_hrtime(), a = ALLOCS();
+  while (run.queue.head != NULL) {
+    size_t len = run.queue.head->len - run.queue.head->sent;
+    int n = send_queue_write(NULL, &run.queue, len, opts.frame_size);
+    if (n < 0) break;
+    run.sunk += (uint64_t)n;
+  }
+  run.write.ns += uv_hrtime() - start;
+  run.write.allocs += ALLOCS() - a;
+}
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static void read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
+  if (eof) {
+    sync_flush(&run.sync, queue_output, NULL);
+    drain();
+    uv_close((uv_handle_t *)process->out, close_cb);
+    process->out = NULL;
+    return;
+  }
+
+  uint64_t start = uv_hrtime(), a = ALLOCS();
+  run.bytes += buf->len;
+  run.chunks++;
+  if (opts.sync)
+    sync_feed(&run.sync, buf->base, buf->len, start / 1000000, queue_output, NULL);
+  else
+    queue_output(NULL, buf->base, buf->len);
+  pty_buf_free(buf);
+  run.dispatch.ns += uv_hrtime() - start;
+  run.dispatch.allocs += ALLOCS() - a;
+
+  // in ttyd the queue is written on the next writable callback, after the pty read resumed
+  pty_resume(process);
+  drain();
+}
+
+static void corpus_printf(corpus_t *c, const char *fmt, ...) {
+  char buf[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n <= 0) return;
+  if ((size_t)n >= sizeof(buf)) n = sizeof(buf) - 1;
+  c->data = xrealloc(c->data, c->len + n);
+  memcpy(c->data + c->len, buf, n);
+  c->len += n;
+}
+
+static unsigned int lcg(unsigned int *seed) { return (*seed = *seed * 1103515245 + 12345) >> 16; }
+
+// ls -R --color: long runs of short lines, few escape sequences
+static void gen_ls(corpus_t *c) {
+  unsigned int seed = 1;
+  for (int dir = 0; c->len < CORPUS_SIZE; dir++) {
+    corpus_printf(c, "./src/module%d/lib%d:\r\n", dir / 10, dir);
+    int entries = 5 + lcg(&seed) % 40;
+    for (int i = 0; i < entries; i++) {
+      switch (lcg(&seed) % 4) {
+        case 0:
+          corpus_printf(c, "\x1b[01;34mdir%d\x1b[0m\r\n", i);
+          break;
+        case 1:
+          corpus_printf(c, "\x1b[01;32mbuild_%d.sh\x1b[0m\r\n", i);
+          break;
+        default:
+          corpus_printf(c, "file_%05u.c\r\n", lcg(&seed) % 100000);
+          break;
+      }
+    }
+    corpus_printf(c, "\r\n");
+  }
+}
+
+// htop: full screen redraws, cursor addressing and color changes every few bytes
+static void gen_htop(corpus_t *c) {
+  unsigned int seed = 2;
+  while (c->len < CORPUS_SIZE) {
+    corpus_printf(c, "\x1b[?25l\x1b[H");
+    for (int cpu = 0; cpu < 8; cpu++) {
+      int used = lcg(&seed) % 30, sys = lcg(&seed) % 10;
+      corpus_printf(c, "\x1b[%d;1H\x1b[36m%3d\x1b[39m\x1b[1m[\x1b[0m\x1b[32m%.*s\x1b[31m%.*s\x1b[0m%*s\x1b[1m%5.1f%%]\x1b[0m\x1b[K",
+                    cpu + 1, cpu, used, "||||||||||||||||||||||||||||||", sys, "||||||||||", 40 - used - sys, "",
+                    (used + sys) * 2.5);
+    }
+    corpus_printf(c, "\x1b[10;1H\x1b[30;42m    PID USER      PRI  NI  VIRT   RES   SHR S CPU%% MEM%%   TIME+  Command\x1b[K\x1b[0m");
+    for (int row = 0; row < 38; row++) {
+      unsigned int pid = 1000 + lcg(&seed) % 60000;
+      corpus_printf(c, "\x1b[%d;1H%s%7u \x1b[36muser\x1b[39m       20   0 \x1b[1m%4uM\x1b[0m %4uM  %4uM S %4.1f %4.1f  %2u:%02u.%02u %s\x1b[K",
+                    row + 11, row == 3 ? "\x1b[30;46m" : "", pid, lcg(&seed) % 4096, lcg(&seed) % 512, lcg(&seed) % 128,
+                    (lcg(&seed) % 1000) / 10.0, (lcg(&seed) % 500) / 10.0, lcg(&seed) % 60, lcg(&seed) % 60,
+                    lcg(&seed) % 100, row == 3 ? "/usr/bin/python3 worker.py\x1b[0m" : "/usr/lib/systemd/systemd");
+    }
+    corpus_printf(c, "\x1b[49;1HF1\x1b[30;46mHelp  \x1b[0mF2\x1b[30;46mSetup \x1b[0mF10\x1b[30;46mQuit\x1b[K\x1b[0m");
+  }
+}
+
+// neovim: synchronized updates with scroll regions and 256 color syntax highlighting
+static void gen_nvim(corpus_t *c) {
+  static const char *words[] = {"static", "void", "int", "return", "if", "struct", "size_t", "const", "char", "for"};
+  unsigned int seed = 3;
+  for (int line = 0; c->len < CORPUS_SIZE; line++) {
+    corpus_printf(c, "\x1b[?2026h\x1b[?25l\x1b[2;48r\x1b[48;1H\n\x1b[r\x1b[48;1H\x1b[38;5;242m%5d \x1b[m", line);
+    int words_n = 2 + lcg(&seed) % 8;
+    for (int i = 0; i < words_n; i++)
+      corpus_printf(c, "\x1b[38;5;%um%s\x1b[m ", 100 + lcg(&seed) % 100, words[lcg(&seed) % 10]);
+    corpus_printf(c, "\x1b[K\x1b[49;1H\x1b[7m NORMAL \x1b[m src/protocol.c%*s%d:%u \x1b[K", 40, "", line,
+                  lcg(&seed) % 80);
+    corpus_printf(c, "\x1b[%u;%uH\x1b[?25h\x1b[?2026l", 2 + lcg(&seed) % 46, 7 + lcg(&seed) % 60);
+  }
+}
+
+static bool load_file(corpus_t *c, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "ttyd-microbench: can not open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    c->data = xrealloc(c->data, c->len + n);
+    memcpy(c->data + c->len, buf, n);
+    c->len += n;
+  }
+  fclose(fp);
+  if (c->len == 0) {
+    fprintf(stderr, "ttyd-microbench: %s is empty\n", path);
+    return false;
+  }
+  const char *name = strrchr(path, '/');
+  c->name = name != NULL ? name + 1 : path;
+  return true;
+}
+
+static void print_stage(const char *name, const stage_t *s, bool first) {
+  double ns_byte = run.bytes > 0 ? (double)s->ns / run.bytes : 0;
+  double allocs_chunk = run.chunks > 0 ? (double)s->allocs / run.chunks : 0;
+  double per_mb = run.bytes > 0 ? s->units * 1048576.0 / run.bytes : 0;
+  if (opts.json)
+    printf("%s\"%s\":{\"ns_per_byte\":%.4f,\"allocs_per_chunk\":%.2f,\"frames_per_mb\":%.1f}", first ? "" : ",", name,
+           ns_byte, allocs_chunk, per_mb);
+  else
+    printf("  %-10s %12.4f %14.2f %12.1f\n", name, ns_byte, allocs_chunk, per_mb);
+}
+
+static bool bench(uv_loop_t *loop, const corpus_t *c, bool first) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    fprintf(stderr, "ttyd-microbench: socketpair: %s\n", strerror(errno));
+    return false;
+  }
+
+  memset(&run, 0, sizeof(run));
+  feeder.corpus = c;
+  feeder.fd = fds[1];
+  feeder.fed = 0;
+
+  pty_process *process = process_init(NULL, loop, NULL, NULL);
+  process->out = xmalloc(sizeof(uv_pipe_t));
+  uv_pipe_init(loop, process->out, 0);
+  if (uv_pipe_open(process->out, fds[0]) != 0) {
+    fprintf(stderr, "ttyd-microbench: can not open the socketpair\n");
+    return false;
+  }
+  process->paused = true;
+  process->read_cb = read_cb;
+
+  uv_thread_t tid;
+  uint64_t start = uv_hrtime(), a = ALLOCS();
+  uv_thread_create(&tid, feeder_thread, NULL);
+  pty_resume(process);
+  uv_run(loop, UV_RUN_DEFAULT);
+  uint64_t total_ns = uv_hrtime() - start, total_allocs = ALLOCS() - a;
+  uv_thread_join(&tid);
+  free(process);
+
+  // the read stage is what the others don't account for: libuv, the syscalls and the pty read_cb with
+  // its buffer copy. it includes waiting for the feeder thread, which is rare with a 1 MB corpus in memory.
+  stage_t read = {total_ns - run.dispatch.ns - run.write.ns, total_allocs - run.dispatch.allocs - run.write.allocs,
+                  run.chunks};
+
+  if (run.bytes != opts.total || run.sunk != run.bytes)
+    fprintf(stderr, "ttyd-microbench: %s: fed %zu bytes, read %zu, written %llu\n", c->name, opts.total, run.bytes,
+            (unsigned long long)run.sunk);
+
+  double mbps = total_ns > 0 ? run.bytes / 1048576.0 / (total_ns / 1e9) : 0;
+  if (opts.json) {
+    printf("%s{\"workload\":\"%s\",\"bytes\":%zu,\"chunks\":%llu,\"mb_per_s\":%.1f,", first ? "" : ",", c->name,
+           run.bytes, (unsigned long long)run.chunks, mbps);
+  } else {
+    printf("%s: %.1f MB in %llu chunks, %.1f MB/s\n", c->name, run.bytes / 1048576.0, (unsigned long long)run.chunks,
+           mbps);
+    printf("  %-10s %12s %14s %12s\n", "stage", "ns/byte", "allocs/chunk", "frames/MB");
+  }
+  print_stage("read", &read, true);
+  print_stage("dispatch", &run.dispatch, false);
+  print_stage("write", &run.write, false);
+  if (opts.json) printf("}");
+
+  sync_free(&run.sync);
+  send_queue_clear(&run.queue);
+  return true;
+}
+
+static const struct option options[] = {{"size", required_argument, NULL, 's'},
+                                        {"write-size", required_argument, NULL, 'w'},
+                                        {"frame-size", required_argument, NULL, 'F'},
+                                        {"no-sync", no_argument, NULL, 'n'},
+                                        {"file", required_argument, NULL, 'f'},
+                                        {"json", no_argument, NULL, 'j'},
+                                        {"help", no_argument, NULL, 'h'},
+                                        {NULL, 0, 0, 0}};
+static const char *opt_string = "s:w:F:nf:jh";
+
+static void print_help() {
+  // clang-format off
+  fprintf(stderr, "ttyd-microbench runs the pty to websocket output pipeline in process\n\n"
+          "USAGE:\n"
+          "    ttyd-microbench [options]\n\n"
+          "OPTIONS:\n"
+          "    -s, --size              MB to feed per workload (default: 64)\n"
+          "    -w, --write-size        Bytes per write into the fake pty (default: 4096)\n"
+          "    -F, --frame-size        Max ws fragment size, like ttyd --frame-size (default: 0)\n"
+          "    -n, --no-sync           Don't detect synchronized output, like ttyd --sync-timeout 0\n"
+          "    -f, --file              Feed a recorded VT stream (eg: from script(1)) instead of the built-in ls, htop\n"
+          "                            and nvim workloads, can be repeated\n"
+          "    -j, --json              Print the report as JSON\n"
+          "    -h, --help              Print this text and exit\n"
+  );
+  // clang-format on
+}
+
+static long parse_long(const char *name, const char *str, long min) {
+  char *end;
+  errno = 0;
+  long v = strtol(str, &end, 10);
+  if (errno != 0 || *end != '\0' || v < min || v > INT32_MAX) {
+    fprintf(stderr, "ttyd-microbench: invalid %s: %s\n", name, str);
+    exit(EXIT_FAILURE);
+  }
+  return v;
+}
+
+int main(int argc, char **argv) {
+  corpus_t corpora[16];
+  int count = 0;
+  opts.total = 64 * 1048576;
+  opts.write_size = 4096;
+  opts.sync = true;
+
+  int c;
+  while ((c = getopt_long(argc, argv, opt_string, options, NULL)) != -1) {
+    switch (c) {
+      case 's':
+        opts.total = (size_t)parse_long("size", optarg, 1) * 1048576;
+        break;
+      case 'w':
+        opts.write_size = (size_t)parse_long("write size", optarg, 1);
+        break;
+      case 'F':
+        opts.frame_size = (size_t)parse_long("frame size", optarg, 0);
+        break;
+      case 'n':
+        opts.sync = false;
+        break;
+      case 'f':
+        if (count == sizeof(corpora) / sizeof(corpora[0])) {
+          fprintf(stderr, "ttyd-microbench: too many files\n");
+          return EXIT_FAILURE;
+        }
+        memset(&corpora[count], 0, sizeof(corpus_t));
+        if (!load_file(&corpora[count++], optarg)) return EXIT_FAILURE;
+        break;
+      case 'j':
+        opts.json = true;
+        break;
+      case 'h':
+        print_help();
+        return EXIT_SUCCESS;
+      default:
+        print_help();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (count == 0) {
+    void (*gen[])(corpus_t *) = {gen_ls, gen_htop, gen_nvim};
+    const char *names[] = {"ls", "htop", "nvim"};
+    for (; count < 3; count++) {
+      memset(&corpora[count], 0, sizeof(corpus_t));
+      corpora[count].name = names[count];
+      gen[count](&corpora[count]);
+    }
+  }
+
+  uv_loop_t *loop = uv_default_loop();
+  if (opts.json)
+    printf("{\"sync\":%s,\"frame_size\":%zu,\"write_size\":%zu,\"allocs_counted\":%s,\"workloads\":[",
+           opts.sync ? "true" : "false", opts.frame_size, opts.write_size, ALLOCS_COUNTED ? "true" : "false");
+  int rc = EXIT_SUCCESS;
+  for (int i = 0; i < count; i++) {
+    if (!bench(loop, &corpora[i], i == 0)) rc = EXIT_FAILURE;
+    free(corpora[i].data);
+  }
+  if (opts.json)
+    printf("]}\n");
+  else if (!ALLOCS_COUNTED)
+    printf("allocations are not counted in this build\n");
+  uv_loop_close(loop);
+  return rc;
+}
@@ -0,0 +1,33 @@
+#ifndef TTYD_PROBES_H
+#define TTYD_PROBES_H
+
+// USDT static probes of the "ttyd" provider, for bpftrace, perf and SystemTap, eg:
+//   bpftrace -e 'usdt:/usr/bin/ttyd:ttyd:pty_read { @bytes = hist(arg1); }'
+// built with -DTTYD_USDT=ON a probe is a nop in the code plus an ELF note, nothing runs until a
+// tracer attaches. otherwise they compile to nothing and the arguments aren't evaluated.
+//
+//   session_established(sid, address)     session_closed(sid, address)
+//   spawn_start(sid)                      spawn_end(sid, pid, ok)
+//   pty_spawn(pid, fd)                    pty_read(pid, bytes)
+//   pty_write(pid, bytes)                 pty_pause(pid)
+//   pty_resume(pid)                       ws_output(sid, bytes, queued)
+//   http_request(path)
+#ifdef TTYD_WITH_USDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(ttyd, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(ttyd, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(ttyd, name, a, b, c)
+#else
+#define PROBE1(name, a) \
+  do {                  \
+  } while (0)
+#define PROBE2(name, a, b) \
+  do {                     \
+  } while (0)
+#define PROBE3(name, a, b, c) \
+  do {                        \
+  } while (0)
+#endif
+
+#endif  // TTYD_PROBES_H
@@ -6,34 +6,39 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "metrics.h"
+#include "probes.h"
 #include "pty.h"
+#include "queue.h"
 #include "server.h"
+#include "trace.h"
 #include "utils.h"
 #include "compat.h"
 
 // initial message list
-static char initial_cmds[] = {SET_WINDOW_TITLE, SET_PREFERENCES};
-
-static int send_initial_message(struct lws *wsi, int index) {
-  unsigned char message[LWS_PRE + 1 + 4096];
-  unsigned char *p = &message[LWS_PRE];
-  char buffer[128];
-  int n = 0;
-
-  char cmd = initial_cmds[index];
-  switch (cmd) {
-    case SET_WINDOW_TITLE:
-      gethostname(buffer, sizeof(buffer) - 1);
-      n = snprintf((char *)p, 1 + 4096, "%c%s (%s)", cmd, server->command, buffer);
-      break;
-    case SET_PREFERENCES:
-      n = snprintf((char *)p, 1 + 4096, "%c%s", cmd, server->prefs_json);
-      break;
-    default:
-      break;
+// the initial messages are the same for every session, their payloads are built once
+static char *initial_title = NULL;
+static size_t initial_title_len = 0;
+
+static unsigned int session_count = 0;
+
+// ms between the shrink and the restore of the window size that make the application repaint
+#define SNAPSHOT_RESTORE_DELAY 75
+
+static void queue_initial_messages(struct pss_tty *pss) {
+  if (initial_title == NULL) {
+    char hostname[128];
+    memset(hostname, 0, sizeof(hostname));
+    gethostname(hostname, sizeof(hostname) - 1);
+    size_t n = strlen(server->command) + strlen(hostname) + 4;
+    initial_title = xmalloc(n);
+    initial_title_len = snprintf(initial_title, n, "%s (%s)", server->command, hostname);
   }
 
-  return lws_write(wsi, p, (size_t)n, LWS_WRITE_BINARY);
+  send_queue_push(&pss->queue, send_msg_new(SET_WINDOW_TITLE, initial_title, initial_title_len, false));
+  // a page served by us carries the preferences already (window.ttydConfig)
+  if (!pss->skip_prefs)
+    send_queue_push(&pss->queue, send_msg_new(SET_PREFERENCES, server->prefs_json, strlen(server->prefs_json), false));
 }
 
 static json_object *parse_window_size(const char *buf, size_t len, uint16_t *cols, uint16_t *rows) {
@@ -79,6 +84,120 @@ static pty_ctx_t *pty_ctx_init(struct pss_tty *pss) {
 
 static void pty_ctx_free(pty_ctx_t *ctx) { free(ctx); }
 
+// lws keeps a single timer per connection, arm it for the earliest deadline
+static void session_timer(struct lws *wsi, struct pss_tty *pss, uint64_t delay) {
+  uint64_t at = uv_now(server->loop) + delay;
+  if (pss->timer_at != 0 && pss->timer_at <= at) return;
+  pss->timer_at = at;
+  lws_set_timer_usecs(wsi, (delay > 0 ? delay : 1) * 1000);
+}
+
+static void queue_output(void *ctx, const char *data, size_t len) {
+  struct pss_tty *pss = (struct pss_tty *)ctx;
+  send_queue_t *q = &pss->queue;
+  // beyond --send-queue-size the output goes to the spill (--spill-dir), behind what is already there
+  if ((q->spilled > 0 || q->bytes > server->send_queue_size) && send_queue_spill(q, OUTPUT, data, len)) return;
+  send_msg_t *msg = send_msg_new(OUTPUT, data, len, true);
+  // held back output is timed from the read that completed it
+  msg->read_at = pss->read_at;
+  msg->dispatch_at = pss->dispatch_at;
+  msg->queued_at = uv_hrtime();
+  // the spill couldn't take it, the pty stays paused (output_resume) until the spill drains
+  if (q->spilled > 0)
+    send_queue_hold(q, msg);
+  else
+    send_queue_push(q, msg);
+}
+
+// the last byte of an output message went to lws_write
+static void output_sent(struct pss_tty *pss, uint64_t read_at, uint64_t dispatch_at, uint64_t queued_at, size_t len) {
+  uint64_t now = uv_hrtime();
+  bool read = read_at > 0 && dispatch_at >= read_at;
+  if (read) {
+    histogram_observe(&metrics.output_dispatch, (dispatch_at - read_at) / 1000);
+    histogram_observe(&metrics.output_hold, (queued_at - dispatch_at) / 1000);
+  }
+  histogram_observe(&metrics.output_queue, (now - queued_at) / 1000);
+  if (!trace_enabled()) return;
+  if (read) {
+    trace_event("dispatch", pss->id, read_at, dispatch_at, len);
+    if (queued_at > dispatch_at) trace_event("hold", pss->id, dispatch_at, queued_at, len);
+  }
+  trace_event("queue", pss->id, queued_at, now, len);
+}
+
+// flush a synchronized update that did not close within --sync-timeout
+static void check_sync_timeout(struct pss_tty *pss) {
+  if (!pss->sync.active) return;
+  uint64_t elapsed = uv_now(server->loop) - pss->sync.started;
+  if (elapsed < (uint64_t)server->sync_timeout) {
+    session_timer(pss->wsi, pss, server->sync_timeout - elapsed);
+    return;
+  }
+  sync_flush(&pss->sync, queue_output, pss);
+  lws_callback_on_writable(pss->wsi);
+}
+
+// a probe comes right before the INPUT it measures: {"id": n}, or {"id": n, "rtt": ms} to report the
+// round trip the client measured for an answered probe
+static void probe_received(struct pss_tty *pss, const char *buf, size_t len) {
+  json_tokener *tok = json_tokener_new();
+  json_object *obj = json_tokener_parse_ex(tok, buf, len);
+  struct json_object *o = NULL;
+  latency_probe_t *p = &pss->probe;
+
+  uint32_t id = json_object_object_get_ex(obj, "id", &o) ? (uint32_t)json_object_get_int64(o) : 0;
+  if (json_object_object_get_ex(obj, "rtt", &o)) {
+    if (id == p->done_id && p->done > 0) {
+      uint64_t rtt = (uint64_t)(json_object_get_double(o) * 1000);
+      uint64_t network = rtt > p->done / 1000 ? rtt - p->done / 1000 : 0;
+      histogram_observe(&pss->latency.network, network);
+      histogram_observe(&metrics.latency.network, network);
+      p->done = 0;
+    }
+  } else {
+    p->id = id;
+    p->received = uv_hrtime();
+    p->written = p->read = p->target = 0;
+  }
+
+  json_tokener_free(tok);
+  json_object_put(obj);
+}
+
+// the output read after the probed input left the server, send the server side times back
+static void probe_answer(struct pss_tty *pss) {
+  latency_probe_t *p = &pss->probe;
+  uint64_t now = uv_hrtime();
+  uint64_t pty = (p->read - p->written) / 1000;
+  uint64_t queue = (now - p->read) / 1000;
+  histogram_observe(&pss->latency.pty, pty);
+  histogram_observe(&pss->latency.queue, queue);
+  histogram_observe(&metrics.latency.pty, pty);
+  histogram_observe(&metrics.latency.queue, queue);
+
+  p->done_id = p->id;
+  p->done = now - p->received;
+  // answered once, later output and input don't belong to this probe
+  p->received = p->written = p->read = p->target = 0;
+
+  char buf[128];
+  int n = snprintf(buf, sizeof(buf), "{\"id\":%u,\"pty\":%.3f,\"queue\":%.3f,\"server\":%.3f}", p->id,
+                   pty / 1e3, queue / 1e3, p->done / 1e6);
+  send_queue_push(&pss->queue, send_msg_new(LATENCY, buf, n, false));
+}
+
+static double histogram_avg_ms(const histogram_t *h) { return h->count > 0 ? (double)h->sum / h->count / 1e3 : 0; }
+
+// keep reading from the pty while the queued output is within --send-queue-size, or the spill can take it.
+// once there is a spill, what is read goes behind it, so only the spill decides.
+static void output_resume(struct pss_tty *pss) {
+  if (pss->process == NULL || pss->paused || pss->slow) return;
+  send_queue_t *q = &pss->queue;
+  bool room = q->spilled > 0 ? send_queue_can_spill(q) : q->bytes <= server->send_queue_size || send_queue_can_spill(q);
+  if (room) pty_resume(pss->process);
+}
+
 static void process_read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
   pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
   if (ctx->ws_closed) {
@@ -86,21 +205,47 @@ static void process_read_cb(pty_process *process, pty_buf_t *buf, bool eof) {
     return;
   }
 
-  if (eof && !process_running(process))
-    ctx->pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
-  else
-    ctx->pss->pty_buf = buf;
-  lws_callback_on_writable(ctx->pss->wsi);
+  struct pss_tty *pss = ctx->pss;
+  if (eof && !process_running(process)) {
+    sync_flush(&pss->sync, queue_output, pss);
+    pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
+  } else if (buf != NULL) {
+    histogram_observe(&metrics.pty_read_size, buf->len);
+    record_output(pss->record, buf->base, buf->len);
+    pss->read_at = buf->read_at;
+    pss->dispatch_at = uv_hrtime();
+    if (server->sync_timeout > 0) {
+      sync_feed(&pss->sync, buf->base, buf->len, uv_now(server->loop), queue_output, pss);
+      check_sync_timeout(pss);
+    } else {
+      queue_output(pss, buf->base, buf->len);
+    }
+    if (pss->probe.written > 0 && pss->probe.read == 0) {
+      pss->probe.read = uv_hrtime();
+      pss->probe.target = pss->queue.written + pss->queue.bytes + pss->queue.spilled;
+    }
+    pty_buf_free(buf);
+    output_resume(pss);
+  }
+  lws_callback_on_writable(pss->wsi);
 }
 
+// the process is freed right after this returns
 static void process_exit_cb(pty_process *process) {
   pty_ctx_t *ctx = (pty_ctx_t *)process->ctx;
+  metrics.sessions_running--;
+  if (process->exit_signal > 0 && process->exit_signal < 65)
+    metrics.exit_signals[process->exit_signal]++;
+  else
+    metrics.exit_codes[process->exit_code & 0xff]++;
+
   if (ctx->ws_closed) {
     lwsl_notice("process killed with signal %d, pid: %d\n", process->exit_signal, process->pid);
     goto done;
   }
 
   lwsl_notice("process exited with code %d, pid: %d\n", process->exit_code, process->pid);
+  sync_flush(&ctx->pss->sync, queue_output, ctx->pss);
   ctx->pss->process = NULL;
   ctx->pss->lws_close_status = process->exit_code == 0 ? 1000 : 1006;
   lws_callback_on_writable(ctx->pss->wsi);
@@ -152,36 +297,188 @@ static char **build_env(struct pss_tty *pss) {
 }
 
 static bool spawn_process(struct pss_tty *pss, uint16_t columns, uint16_t rows) {
+  PROBE1(spawn_start, pss->id);
   pty_process *process = process_init((void *)pty_ctx_init(pss), server->loop, build_args(pss), build_env(pss));
+  process->backend = server->backend;
   if (server->cwd != NULL) process->cwd = strdup(server->cwd);
   if (columns > 0) process->columns = columns;
   if (rows > 0) process->rows = rows;
+  uint64_t start = uv_hrtime();
   if (pty_spawn(process, process_read_cb, process_exit_cb) != 0) {
     lwsl_err("pty_spawn: %d (%s)\n", errno, strerror(errno));
+    metrics.spawn_failures++;
+    PROBE3(spawn_end, pss->id, 0, 0);
     process_free(process);
     return false;
   }
+  histogram_observe(&metrics.spawn_latency, (uv_hrtime() - start) / 1000);
+  metrics.sessions++;
+  metrics.sessions_running++;
+  PROBE3(spawn_end, pss->id, process->pid, 1);
   lwsl_notice("started process, pid: %d\n", process->pid);
   pss->process = process;
+  if (server->record.dir != NULL)
+    pss->record = record_open(server->loop, &server->record, pss->id, server->command, server->terminal_type,
+                              pss->user, process->columns, process->rows);
+  queue_initial_messages(pss);
+  output_resume(pss);
   lws_callback_on_writable(pss->wsi);
 
   return true;
 }
 
-static void wsi_output(struct lws *wsi, pty_buf_t *buf) {
-  if (buf == NULL) return;
-  char *message = xmalloc(LWS_PRE + 1 + buf->len);
-  char *ptr = message + LWS_PRE;
+// output can be split at any byte, so the deficit of deficit round robin never carries over between rounds:
+// every writable round grants the session `write_quantum` bytes, which the session and user token buckets
+// may shrink further. 0 means try again later, the retry is already arranged.
+static size_t output_quota(struct lws *wsi, struct pss_tty *pss, size_t pending) {
+  size_t n = pending;
+  if (server->write_quantum > 0) {
+    if (pss->deficit == 0) {
+      lws_callback_on_writable(wsi);
+      return 0;
+    }
+    if (n > pss->deficit) n = pss->deficit;
+  }
+
+  uint64_t now = uv_now(server->loop);
+  n = tb_peek(&pss->bucket, n, now);
+  if (pss->user_bucket != NULL) n = tb_peek(&pss->user_bucket->tb, n, now);
+  if (n == 0) {
+    uint64_t delay = tb_delay(&pss->bucket, pending);
+    if (pss->user_bucket != NULL) {
+      uint64_t d = tb_delay(&pss->user_bucket->tb, pending);
+      if (d > delay) delay = d;
+    }
+    session_timer(wsi, pss, delay);
+  }
+  return n;
+}
+
+static void output_consume(struct pss_tty *pss, size_t n) {
+  tb_consume(&pss->bucket, n);
+  if (pss->user_bucket != NULL) tb_consume(&pss->user_bucket->tb, n);
+  pss->deficit = n < pss->deficit ? pss->deficit - n : 0;
+}
+
+// write queued messages until the queue is empty, the socket is choked or the session used up its quota.
+// unsent data stays queued for the next writable callback.
+static int wsi_output(struct lws *wsi, struct pss_tty *pss) {
+  send_queue_t *q = &pss->queue;
+  pss->deficit = server->write_quantum;
+
+  while (q->head != NULL || send_queue_refill(q, OUTPUT, server->send_queue_size) > 0) {
+    if (lws_send_pipe_choked(wsi)) {
+      lws_callback_on_writable(wsi);
+      return 0;
+    }
+
+    bool split = q->head->split;
+    size_t len = q->head->len - q->head->sent;
+    if (split && (len = output_quota(wsi, pss, len)) == 0) return 0;
+
+    send_msg_t *msg = q->head;
+    uint64_t read_at = msg->read_at, dispatch_at = msg->dispatch_at, queued_at = msg->queued_at;
+    size_t size = msg->len;
+    int n = send_queue_write(wsi, q, len, server->frame_size);
+    if (n < 0) return -1;
+    // popped: the message is out
+    if (queued_at > 0 && q->head != msg) output_sent(pss, read_at, dispatch_at, queued_at, size);
+    PROBE3(ws_output, pss->id, n, q->bytes);
+    if (n > 0) {
+      metrics.ws_tx_frames++;
+      metrics.ws_tx_bytes += (size_t)n;
+    }
+    if (pss->probe.read > 0 && q->written >= pss->probe.target) probe_answer(pss);
+    if (split) output_consume(pss, (size_t)n);
+    // one fragment per writable round, lws sends pending pings and pongs between them
+    if ((size_t)n < len || q->fragmented) {
+      lws_callback_on_writable(wsi);
+      return 0;
+    }
+  }
 
-  *ptr = OUTPUT;
-  memcpy(ptr + 1, buf->base, buf->len);
-  size_t n = buf->len + 1;
+  return 0;
+}
 
-  if (lws_write(wsi, (unsigned char *)ptr, n, LWS_WRITE_BINARY) < n) {
-    lwsl_err("write OUTPUT to WS\n");
+// the size is restored once the application had time to see the smaller one
+static void check_redraw(struct pss_tty *pss) {
+  if (pss->redraw_at == 0) return;
+  uint64_t now = uv_now(server->loop);
+  if (now < pss->redraw_at) {
+    session_timer(pss->wsi, pss, pss->redraw_at - now);
+    return;
   }
+  pss->redraw_at = 0;
+  pty_resize(pss->process);
+}
 
-  free(message);
+// the client skipped output in snapshot mode: cancel any partial escape sequence, clear the screen and
+// have the backend repaint, or make the application repaint by nudging the window size (SIGWINCH). a shrink
+// restored right away coalesces into one SIGWINCH with an unchanged size, which most programs ignore.
+static void snapshot_redraw(struct pss_tty *pss) {
+  static const char clear[] = "\x18\x1b[0m\x1b[H\x1b[2J";
+  send_queue_push(&pss->queue, send_msg_new(OUTPUT, clear, sizeof(clear) - 1, true));
+
+  pty_process *process = pss->process;
+  if (process == NULL || pty_redraw(process) || process->rows < 2 || pss->redraw_at != 0) return;
+  process->rows--;
+  pty_resize(process);
+  process->rows++;
+  pss->redraw_at = uv_now(server->loop) + SNAPSHOT_RESTORE_DELAY;
+  session_timer(pss->wsi, pss, SNAPSHOT_RESTORE_DELAY);
+}
+
+// called periodically for each connection when --slow-client is set, a client is slow when
+// nothing it was sent left the socket for --slow-timeout, or too much is waiting (--slow-size).
+static int check_slow_client(struct lws *wsi, struct pss_tty *pss) {
+  uint64_t now = uv_now(server->loop);
+  int outq = socket_outq(lws_get_socket_fd(lws_get_network_wsi(wsi)));
+  size_t pending = outq > 0 ? (size_t)outq : 0;
+  size_t unsent = pss->queue.bytes + pss->queue.spilled + pending;
+  uint64_t delivered = pss->queue.written > pending ? pss->queue.written - pending : 0;
+  bool choked = lws_send_pipe_choked(wsi);
+
+  if (delivered > pss->delivered || (unsent == 0 && !choked)) {
+    pss->delivered = delivered;
+    pss->progress_at = now;
+  }
+
+  uint64_t stalled = now - pss->progress_at;
+  bool slow = (unsent > 0 || choked) && stalled >= (uint64_t)server->slow_timeout * 1000;
+  if (server->slow_size > 0 && unsent >= server->slow_size) slow = true;
+
+  if (!slow) {
+    if (pss->slow) {
+      lwsl_notice("client %s is reading again, unsent: %zu bytes\n", pss->address, unsent);
+      pss->slow = false;
+      if (server->slow_policy == SLOW_SNAPSHOT) snapshot_redraw(pss);
+      output_resume(pss);
+      lws_callback_on_writable(wsi);
+    }
+    return 0;
+  }
+  if (pss->slow) return 0;
+
+  lwsl_warn("slow client %s, unsent: %zu bytes, stalled: %llu ms, action: %s\n", pss->address, unsent,
+            (unsigned long long)stalled, slow_policy_name[server->slow_policy]);
+  server->slow_count[server->slow_policy]++;
+  switch (server->slow_policy) {
+    case SLOW_PAUSE:
+      pss->slow = true;
+      pty_pause(pss->process);
+      break;
+    case SLOW_SNAPSHOT:
+      pss->slow = true;
+      pty_pause(pss->process);
+      send_queue_drop(&pss->queue);
+      break;
+    case SLOW_DISCONNECT:
+      lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION, (unsigned char *)"slow client", 11);
+      return -1;
+    default:
+      break;
+  }
+  return 0;
 }
 
 static bool check_auth(struct lws *wsi, struct pss_tty *pss) {
@@ -233,7 +530,7 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       break;
 
     case LWS_CALLBACK_ESTABLISHED:
-      pss->initialized = false;
+      pss->id = ++session_count;
       pss->authenticated = false;
       pss->wsi = wsi;
       pss->lws_close_status = LWS_CLOSE_STATUS_NOSTATUS;
@@ -251,40 +548,46 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       server->client_count++;
 
       lws_get_peer_simple(lws_get_network_wsi(wsi), pss->address, sizeof(pss->address));
+      pss->progress_at = uv_now(server->loop);
+      tb_init(&pss->bucket, server->rate_limit, 0, uv_now(server->loop));
+      if (server->user_limit > 0) {
+        const char *name = strlen(pss->user) > 0 ? pss->user : pss->address;
+        pss->user_bucket = user_bucket_get(name, server->user_limit, 0, uv_now(server->loop));
+      }
+      PROBE2(session_established, pss->id, pss->address);
       lwsl_notice("WS   %s - %s, clients: %d\n", pss->path, pss->address, server->client_count);
       break;
 
     case LWS_CALLBACK_SERVER_WRITEABLE:
-      if (!pss->initialized) {
-        if (pss->initial_cmd_index == sizeof(initial_cmds)) {
-          pss->initialized = true;
-          pty_resume(pss->process);
-          break;
-        }
-        if (send_initial_message(wsi, pss->initial_cmd_index) < 0) {
-          lwsl_err("failed to send initial message, index: %d\n", pss->initial_cmd_index);
-          lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
-          return -1;
-        }
-        pss->initial_cmd_index++;
-        lws_callback_on_writable(wsi);
-        break;
+      if (wsi_output(wsi, pss) < 0) {
+        lwsl_err("failed to write to WS, queued: %zu bytes\n", pss->queue.bytes);
+        lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
+        return -1;
       }
+      output_resume(pss);
 
-      if (pss->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS) {
+      // close after everything queued has been sent
+      if (pss->lws_close_status > LWS_CLOSE_STATUS_NOSTATUS && pss->queue.head == NULL && pss->queue.spilled == 0) {
         lws_close_reason(wsi, pss->lws_close_status, NULL, 0);
         return 1;
       }
+      break;
 
-      if (pss->pty_buf != NULL) {
-        wsi_output(wsi, pss->pty_buf);
-        pty_buf_free(pss->pty_buf);
-        pss->pty_buf = NULL;
-        pty_resume(pss->process);
-      }
+    case LWS_CALLBACK_TIMER:
+      // rate limit delay, synchronized update timeout or snapshot redraw expired
+      pss->timer_at = 0;
+      check_sync_timeout(pss);
+      check_redraw(pss);
+      lws_callback_on_writable(wsi);
       break;
 
+    case LWS_CALLBACK_USER:
+      if (pss->wsi == NULL || server->slow_policy == SLOW_NONE) break;
+      return check_slow_client(wsi, pss);
+
     case LWS_CALLBACK_RECEIVE:
+      metrics.ws_rx_frames++;
+      metrics.ws_rx_bytes += len;
       if (pss->buffer == NULL) {
         pss->buffer = xmalloc(len);
         pss->len = len;
@@ -311,31 +614,44 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       switch (command) {
         case INPUT:
           if (!server->writable) break;
+          record_input(pss->record, pss->buffer + 1, pss->len - 1);
           int err = pty_write(pss->process, pty_buf_init(pss->buffer + 1, pss->len - 1));
           if (err) {
             lwsl_err("uv_write: %s (%s)\n", uv_err_name(err), uv_strerror(err));
             return -1;
           }
+          if (pss->probe.received > 0 && pss->probe.written == 0) pss->probe.written = uv_hrtime();
+          break;
+        case LATENCY_PROBE:
+          if (!server->writable || pss->process == NULL) break;
+          probe_received(pss, pss->buffer + 1, pss->len - 1);
           break;
         case RESIZE_TERMINAL:
           if (pss->process == NULL) break;
           json_object_put(
               parse_window_size(pss->buffer + 1, pss->len - 1, &pss->process->columns, &pss->process->rows));
           pty_resize(pss->process);
+          record_resize(pss->record, pss->process->columns, pss->process->rows);
           break;
         case PAUSE:
+          metrics.pauses++;
+          pss->paused = true;
           pty_pause(pss->process);
           break;
         case RESUME:
-          pty_resume(pss->process);
+          metrics.resumes++;
+          pss->paused = false;
+          // still held back while the client is slow or too much is queued
+          output_resume(pss);
           break;
         case JSON_DATA:
           if (pss->process != NULL) break;
           uint16_t columns = 0;
           uint16_t rows = 0;
           json_object *obj = parse_window_size(pss->buffer, pss->len, &columns, &rows);
+          struct json_object *o = NULL;
+          if (json_object_object_get_ex(obj, "skipPreferences", &o)) pss->skip_prefs = json_object_get_boolean(o);
           if (server->credential != NULL) {
-            struct json_object *o = NULL;
             if (json_object_object_get_ex(obj, "AuthToken", &o)) {
               const char *token = json_object_get_string(o);
               if (token != NULL && !strcmp(token, server->credential))
@@ -367,9 +683,19 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
       if (pss->wsi == NULL) break;
 
       server->client_count--;
+      PROBE2(session_closed, pss->id, pss->address);
       lwsl_notice("WS closed from %s, clients: %d\n", pss->address, server->client_count);
       if (pss->buffer != NULL) free(pss->buffer);
-      if (pss->pty_buf != NULL) pty_buf_free(pss->pty_buf);
+      lwsl_info("send queue of %s: %zu bytes left, peak: %zu bytes\n", pss->address, pss->queue.bytes, pss->queue.peak);
+      if (pss->latency.pty.count > 0)
+        lwsl_notice("latency of %s: %llu probes, avg pty: %.1f ms, queue: %.1f ms, network: %.1f ms\n", pss->address,
+                    (unsigned long long)pss->latency.pty.count, histogram_avg_ms(&pss->latency.pty),
+                    histogram_avg_ms(&pss->latency.queue), histogram_avg_ms(&pss->latency.network));
+      send_queue_clear(&pss->queue);
+      sync_free(&pss->sync);
+      record_close(pss->record);
+      pss->record = NULL;
+      user_bucket_put(pss->user_bucket);
       for (int i = 0; i < pss->argc; i++) {
         free(pss->args[i]);
       }
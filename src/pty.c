@@ -28,6 +28,7 @@ extern char **environ;
 #endif
 #endif
 
+#include "probes.h"
 #include "pty.h"
 #include "utils.h"
 
@@ -48,11 +49,26 @@ static void async_free_cb(uv_handle_t *handle) {
   free((uv_async_t *) handle -> data);
 }
 
+static const pty_backend *backends[] = {&pty_backend_pty,
+#ifndef _WIN32
+                                        &pty_backend_pipe,   &pty_backend_tmux,
+#endif
+                                        &pty_backend_socket, &pty_backend_replay,
+                                        &pty_backend_cast,   &pty_backend_synthetic, NULL};
+
+const pty_backend *pty_backend_find(const char *name) {
+  for (int i = 0; backends[i] != NULL; i++) {
+    if (strcmp(backends[i]->name, name) == 0) return backends[i];
+  }
+  return NULL;
+}
+
 pty_buf_t *pty_buf_init(char *base, size_t len) {
   pty_buf_t *buf = xmalloc(sizeof(pty_buf_t));
   buf->base = xmalloc(len);
   memcpy(buf->base, base, len);
   buf->len = len;
+  buf->read_at = 0;
   return buf;
 }
 
@@ -62,18 +78,49 @@ void pty_buf_free(pty_buf_t *buf) {
   free(buf);
 }
 
+// hand a read to the session, reading stays paused until pty_resume. takes buf.
+void pty_deliver(pty_process *process, pty_buf_t *buf) {
+  process->paused = true;
+  PROBE2(pty_read, process->pid, buf->len);
+  buf->read_at = uv_hrtime();
+  process->read_cb(process, buf, false);
+}
+
+// same as pty_deliver, with a copy of data
+void pty_emit(pty_process *process, const char *data, size_t len) {
+  pty_deliver(process, pty_buf_init((char *) data, len));
+}
+
+// the session ended with exit_code (and exit_signal), exit_cb runs on the next loop iteration
+void pty_exited(pty_process *process) { uv_async_send(&process->async); }
+
+static void async_cb(uv_async_t *async) {
+  pty_process *process = (pty_process *) async->data;
+  process->exit_cb(process);
+
+  uv_close((uv_handle_t *) async, async_free_cb);
+  process_free(process);
+}
+
 static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
-  uv_read_stop(stream);
   pty_process *process = (pty_process *) stream->data;
-  if (n <= 0) {
-    if (n == UV_ENOBUFS || n == 0) return;
+  if (n == UV_ENOBUFS || n == 0) {
+    // nothing read, keep reading
+    if (buf->base != NULL) free(buf->base);
+    return;
+  }
+  uv_read_stop(stream);
+  process->paused = true;
+  if (n < 0) {
     process->read_cb(process, NULL, true);
-    goto done;
+    free(buf->base);
+    return;
   }
-  process->read_cb(process, pty_buf_init(buf->base, (size_t) n), false);
-
-done:
-  free(buf->base);
+  // the read buffer is handed over as is, not copied
+  pty_buf_t *data = xmalloc(sizeof(pty_buf_t));
+  data->base = buf->base;
+  data->len = (size_t) n;
+  pty_deliver(process, data);
 }
 
 static void write_cb(uv_write_t *req, int unused) {
@@ -82,6 +129,21 @@ static void write_cb(uv_write_t *req, int unused) {
   free(req);
 }
 
+// backends reading from process->out and writing to process->in
+void pty_stream_pause(pty_process *process) { uv_read_stop((uv_stream_t *) process->out); }
+
+bool pty_stream_resume(pty_process *process) {
+  process->out->data = process;
+  return uv_read_start((uv_stream_t *) process->out, alloc_cb, read_cb) == 0;
+}
+
+int pty_stream_write(pty_process *process, pty_buf_t *buf) {
+  uv_buf_t b = uv_buf_init(buf->base, buf->len);
+  uv_write_t *req = xmalloc(sizeof(uv_write_t));
+  req->data = buf;
+  return uv_write(req, (uv_stream_t *) process->in, &b, 1, write_cb);
+}
+
 pty_process *process_init(void *ctx, uv_loop_t *loop, char *argv[], char *envp[]) {
   pty_process *process = xmalloc(sizeof(pty_process));
   memset(process, 0, sizeof(pty_process));
@@ -92,46 +154,57 @@ pty_process *process_init(void *ctx, uv_loop_t *loop, char *argv[], char *envp[]
   process->columns = 80;
   process->rows = 24;
   process->exit_code = -1;
+  process->backend = &pty_backend_pty;
   return process;
 }
 
 bool process_running(pty_process *process) {
-  return process != NULL && process->pid > 0 && uv_kill(process->pid, 0) == 0;
+  return process != NULL && process->backend->running(process);
 }
 
 void process_free(pty_process *process) {
   if (process == NULL) return;
-#ifdef _WIN32
-  if (process->si.lpAttributeList != NULL) {
-    DeleteProcThreadAttributeList(process->si.lpAttributeList);
-    free(process->si.lpAttributeList);
-  }
-  if (process->pty != NULL) pClosePseudoConsole(process->pty);
-  if (process->handle != NULL) CloseHandle(process->handle);
-#else
-  close(process->pty);
-  uv_thread_join(&process->tid);
-#endif
+  process->backend->free(process);
   if (process->in != NULL) uv_close((uv_handle_t *) process->in, close_cb);
   if (process->out != NULL) uv_close((uv_handle_t *) process->out, close_cb);
   if (process->argv != NULL) free(process->argv);
   if (process->cwd != NULL) free(process->cwd);
-  char **p = process->envp;
-  for (; *p; p++) free(*p);
-  free(process->envp);
+  if (process->envp != NULL) {
+    char **p = process->envp;
+    for (; *p; p++) free(*p);
+    free(process->envp);
+  }
+}
+
+int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+  process->paused = true;
+  process->read_cb = read_cb;
+  process->exit_cb = exit_cb;
+  process->async.data = process;
+  uv_async_init(process->loop, &process->async, async_cb);
+
+  int status = process->backend->spawn(process);
+  if (status != 0) {
+    uv_close((uv_handle_t *) &process->async, NULL);
+    return status;
+  }
+  PROBE2(pty_spawn, process->pid, process->pty);
+  return 0;
 }
 
 void pty_pause(pty_process *process) {
   if (process == NULL) return;
   if (process->paused) return;
-  uv_read_stop((uv_stream_t *) process->out);
+  PROBE1(pty_pause, process->pid);
+  process->backend->pause(process);
+  process->paused = true;
 }
 
 void pty_resume(pty_process *process) {
   if (process == NULL) return;
   if (!process->paused) return;
-  process->out->data = process;
-  uv_read_start((uv_stream_t *) process->out, alloc_cb, read_cb);
+  PROBE1(pty_resume, process->pid);
+  if (process->backend->resume(process)) process->paused = false;
 }
 
 int pty_write(pty_process *process, pty_buf_t *buf) {
@@ -139,31 +212,24 @@ int pty_write(pty_process *process, pty_buf_t *buf) {
     pty_buf_free(buf);
     return UV_ESRCH;
   }
-  uv_buf_t b = uv_buf_init(buf->base, buf->len);
-  uv_write_t *req = xmalloc(sizeof(uv_write_t));
-  req->data = buf;
-  return uv_write(req, (uv_stream_t *) process->in, &b, 1, write_cb);
+  PROBE2(pty_write, process->pid, buf->len);
+  return process->backend->write(process, buf);
 }
 
 bool pty_resize(pty_process *process) {
   if (process == NULL) return false;
   if (process->columns <= 0 || process->rows <= 0) return false;
-#ifdef _WIN32
-  COORD size = {(int16_t) process->columns, (int16_t) process->rows};
-  return pResizePseudoConsole(process->pty, size) == S_OK;
-#else
-  struct winsize size = {process->rows, process->columns, 0, 0};
-  return ioctl(process->pty, TIOCSWINSZ, &size) == 0;
-#endif
+  return process->backend->resize(process);
 }
 
 bool pty_kill(pty_process *process, int sig) {
   if (process == NULL) return false;
-#ifdef _WIN32
-  return TerminateProcess(process->handle, 1) != 0;
-#else
-  return uv_kill(-process->pid, sig) == 0;
-#endif
+  return process->backend->kill(process, sig);
+}
+
+bool pty_redraw(pty_process *process) {
+  if (process == NULL || process->backend->redraw == NULL) return false;
+  return process->backend->redraw(process);
 }
 
 #ifdef _WIN32
@@ -292,24 +358,14 @@ static void connect_cb(uv_connect_t *req, int status) {
 
 static void CALLBACK conpty_exit(void *context, BOOLEAN unused) {
   pty_process *process = (pty_process *) context;
-  uv_async_send(&process->async);
-}
-
-static void async_cb(uv_async_t *async) {
-  pty_process *process = (pty_process *) async->data;
-  UnregisterWait(process->wait);
-
   DWORD exit_code;
   GetExitCodeProcess(process->handle, &exit_code);
   process->exit_code = (int) exit_code;
   process->exit_signal = 1;
-  process->exit_cb(process);
-
-  uv_close((uv_handle_t *) async, async_free_cb);
-  process_free(process);
+  pty_exited(process);
 }
 
-int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+static int conpty_spawn(pty_process *process) {
   char *in_name = NULL;
   char *out_name = NULL;
   DWORD flags = EXTENDED_STARTUPINFO_PRESENT | CREATE_UNICODE_ENVIRONMENT;
@@ -357,11 +413,6 @@ int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
 
   process->pid = pi.dwProcessId;
   process->handle = pi.hProcess;
-  process->paused = true;
-  process->read_cb = read_cb;
-  process->exit_cb = exit_cb;
-  process->async.data = process;
-  uv_async_init(process->loop, &process->async, async_cb);
 
   if (!RegisterWaitForSingleObject(&process->wait, pi.hProcess, conpty_exit, process, INFINITE, WT_EXECUTEONLYONCE)) {
     print_error("RegisterWaitForSingleObject");
@@ -377,6 +428,28 @@ cleanup:
   if (cwd != NULL) free(cwd);
   return status;
 }
+
+static bool conpty_resize(pty_process *process) {
+  COORD size = {(int16_t) process->columns, (int16_t) process->rows};
+  return pResizePseudoConsole(process->pty, size) == S_OK;
+}
+
+static bool conpty_kill(pty_process *process, int sig) { return TerminateProcess(process->handle, 1) != 0; }
+
+static bool conpty_running(pty_process *process) { return process->pid > 0 && uv_kill(process->pid, 0) == 0; }
+
+static void conpty_free(pty_process *process) {
+  if (process->wait != NULL) UnregisterWait(process->wait);
+  if (process->si.lpAttributeList != NULL) {
+    DeleteProcThreadAttributeList(process->si.lpAttributeList);
+    free(process->si.lpAttributeList);
+  }
+  if (process->pty != NULL) pClosePseudoConsole(process->pty);
+  if (process->handle != NULL) CloseHandle(process->handle);
+}
+
+const pty_backend pty_backend_pty = {"pty",          conpty_spawn, pty_stream_pause, pty_stream_resume, pty_stream_write,
+                                     conpty_resize, conpty_kill,  conpty_running,   conpty_free, NULL};
 #else
 static bool fd_set_cloexec(const int fd) {
   int flags = fcntl(fd, F_GETFD);
@@ -413,18 +486,10 @@ static void wait_cb(void *arg) {
     process->exit_signal = sig;
   }
 
-  uv_async_send(&process->async);
-}
-
-static void async_cb(uv_async_t *async) {
-  pty_process *process = (pty_process *) async->data;
-  process->exit_cb(process);
-
-  uv_close((uv_handle_t *) async, async_free_cb);
-  process_free(process);
+  pty_exited(process);
 }
 
-int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
+static int forkpty_spawn(pty_process *process) {
   int status = 0;
 
   uv_disable_stdio_inheritance();
@@ -475,11 +540,6 @@ int pty_spawn(pty_process *process, pty_read_cb read_cb, pty_exit_cb exit_cb) {
 
   process->pty = master;
   process->pid = pid;
-  process->paused = true;
-  process->read_cb = read_cb;
-  process->exit_cb = exit_cb;
-  process->async.data = process;
-  uv_async_init(process->loop, &process->async, async_cb);
   uv_thread_create(&process->tid, wait_cb, process);
 
   return 0;
@@ -490,4 +550,22 @@ error:
   waitpid(pid, NULL, 0);
   return status;
 }
+
+static bool forkpty_resize(pty_process *process) {
+  struct winsize size = {process->rows, process->columns, 0, 0};
+  return ioctl(process->pty, TIOCSWINSZ, &size) == 0;
+}
+
+static bool forkpty_kill(pty_process *process, int sig) { return uv_kill(-process->pid, sig) == 0; }
+
+static bool forkpty_running(pty_process *process) { return process->pid > 0 && uv_kill(process->pid, 0) == 0; }
+
+static void forkpty_free(pty_process *process) {
+  if (process->pid <= 0) return;
+  close(process->pty);
+  uv_thread_join(&process->tid);
+}
+
+const pty_backend pty_backend_pty = {"pty",           forkpty_spawn, pty_stream_pause, pty_stream_resume, pty_stream_write,
+                                     forkpty_resize, forkpty_kill,  forkpty_running,  forkpty_free, NULL};
 #endif
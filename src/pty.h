@@ -19,6 +19,7 @@ bool conpty_init();
 typedef struct {
   char *base;
   size_t len;
+  uint64_t read_at;  // when it was read from the pty (uv_hrtime)
 } pty_buf_t;
 
 struct pty_process_;
@@ -26,6 +27,31 @@ typedef struct pty_process_ pty_process;
 typedef void (*pty_read_cb)(pty_process *, pty_buf_t *, bool);
 typedef void (*pty_exit_cb)(pty_process *);
 
+// a session backend: where the output of a session comes from and where its input goes.
+// output is delivered one read at a time, reading pauses after each read until it's resumed.
+typedef struct {
+  const char *name;
+  int (*spawn)(pty_process *process);                  // start the session, reading paused
+  void (*pause)(pty_process *process);                 // stop reading output
+  bool (*resume)(pty_process *process);                // deliver the next read to read_cb
+  int (*write)(pty_process *process, pty_buf_t *buf);  // write input, takes buf
+  bool (*resize)(pty_process *process);                // apply columns and rows
+  bool (*kill)(pty_process *process, int sig);
+  bool (*running)(pty_process *process);
+  void (*free)(pty_process *process);                  // release the backend state
+  bool (*redraw)(pty_process *process);                // repaint the whole screen, NULL if it can't
+} pty_backend;
+
+extern const pty_backend pty_backend_pty;        // forkpty or ConPTY, the default
+#ifndef _WIN32
+extern const pty_backend pty_backend_pipe;       // stdin and stdout/stderr are pipes
+extern const pty_backend pty_backend_tmux;       // a window of a shared tmux server, kept when the session closes
+#endif
+extern const pty_backend pty_backend_socket;     // connects to the socket argv[0] (unix:PATH or tcp:HOST:PORT)
+extern const pty_backend pty_backend_replay;     // plays the file argv[0] as output
+extern const pty_backend pty_backend_cast;       // plays asciicast recordings with their timing and seeking
+extern const pty_backend pty_backend_synthetic;  // generated output at a given rate, echoes input
+
 struct pty_process_ {
   int pid, exit_code, exit_signal;
   uint16_t columns, rows;
@@ -51,6 +77,9 @@ struct pty_process_ {
   pty_read_cb read_cb;
   pty_exit_cb exit_cb;
   void *ctx;
+
+  const pty_backend *backend;
+  void *data;  // backend state
 };
 
 pty_buf_t *pty_buf_init(char *base, size_t len);
@@ -64,5 +93,16 @@ void pty_resume(pty_process *process);
 int pty_write(pty_process *process, pty_buf_t *buf);
 bool pty_resize(pty_process *process);
 bool pty_kill(pty_process *process, int sig);
+bool pty_redraw(pty_process *process);
+
+const pty_backend *pty_backend_find(const char *name);
+
+// for backends
+void pty_deliver(pty_process *process, pty_buf_t *buf);
+void pty_emit(pty_process *process, const char *data, size_t len);
+void pty_exited(pty_process *process);
+void pty_stream_pause(pty_process *process);
+bool pty_stream_resume(pty_process *process);
+int pty_stream_write(pty_process *process, pty_buf_t *buf);
 
 #endif  // TTYD_PTY_H
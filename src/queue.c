@@ -0,0 +1,355 @@
+#include "queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "utils.h"
+
+// the spill is a list of segments, each an unlinked file of SPILL_SEGMENT bytes mapped whole. output is
+// appended at the tail and read back from the head in SPILL_CHUNK messages, the kernel writes the pages
+// back and drops them as memory is needed. a consumed segment is unmapped, which frees its disk space.
+#define SPILL_SEGMENT (64 * 1024 * 1024)
+#define SPILL_CHUNK (64 * 1024)
+
+typedef struct spill_seg_ {
+  struct spill_seg_ *next;
+  char *base;
+  size_t head;  // read offset
+  size_t tail;  // write offset
+} spill_seg_t;
+
+static size_t total_bytes = 0;
+static size_t total_peak = 0;
+static char *spill_dir = NULL;
+static size_t spill_limit = 0;
+static size_t spill_total = 0;
+
+#define payload(msg) ((msg)->buf + LWS_PRE + 1)
+
+send_msg_t *send_msg_new(char cmd, const char *data, size_t len, bool split) {
+  send_msg_t *msg = xmalloc(sizeof(send_msg_t) + LWS_PRE + 1 + len);
+  msg->next = NULL;
+  msg->cmd = cmd;
+  msg->split = split;
+  msg->len = len;
+  msg->sent = 0;
+  msg->read_at = msg->dispatch_at = msg->queued_at = 0;
+  if (len > 0) memcpy(payload(msg), data, len);
+  return msg;
+}
+
+static void queue_account(send_queue_t *q, size_t add, size_t sub) {
+  q->bytes = q->bytes + add - sub;
+  total_bytes = total_bytes + add - sub;
+  if (q->bytes > q->peak) q->peak = q->bytes;
+  if (total_bytes > total_peak) total_peak = total_bytes;
+}
+
+// messages that can't be split (eg: SET_WINDOW_TITLE) go ahead of the queued output that
+// hasn't started yet, so they don't wait behind bulk output.
+void send_queue_push(send_queue_t *q, send_msg_t *msg) {
+  send_msg_t **pp = &q->head;
+  send_msg_t *prev = NULL;
+  if (!msg->split) {
+    if (*pp != NULL && (*pp)->sent > 0) {
+      prev = *pp;
+      pp = &prev->next;
+    }
+    while (*pp != NULL && !(*pp)->split) {
+      prev = *pp;
+      pp = &prev->next;
+    }
+  } else {
+    prev = q->tail;
+    pp = prev != NULL ? &prev->next : &q->head;
+  }
+  msg->next = *pp;
+  *pp = msg;
+  if (msg->next == NULL) q->tail = msg;
+  q->count++;
+  queue_account(q, msg->len, 0);
+}
+
+static void send_queue_pop(send_queue_t *q) {
+  send_msg_t *msg = q->head;
+  q->head = msg->next;
+  if (q->head == NULL) q->tail = NULL;
+  q->count--;
+  queue_account(q, 0, msg->len - msg->sent);
+  free(msg);
+}
+
+// write the head message, at most `max` payload bytes of it if the message can be split.
+// without `frame`, the rest of a message cut at `max` goes out later as a new message of the same type.
+// with `frame`, a split message larger than it is sent as ws fragments of at most `frame` bytes, one per
+// call; other messages can't be written until the last fragment is out. lws buffers what the socket
+// doesn't take, a write is accepted whole or fails. returns the payload bytes written, or -1 on error.
+int send_queue_write(struct lws *wsi, send_queue_t *q, size_t max, size_t frame) {
+  send_msg_t *msg = q->head;
+  if (msg == NULL) return 0;
+
+  size_t len = msg->len - msg->sent;
+  if (msg->split && max < len) len = max;
+
+  if (msg->split && frame > 0 && (q->fragmented || len > frame || msg->sent + len < msg->len)) {
+    if (len > frame) len = frame;
+    bool fin = msg->sent + len == msg->len;
+    unsigned char *p = payload(msg) + msg->sent;
+    int mode = q->fragmented ? LWS_WRITE_CONTINUATION : LWS_WRITE_BINARY;
+    if (!q->fragmented) *--p = (unsigned char)msg->cmd;
+    if (!fin) mode |= LWS_WRITE_NO_FIN;
+    int n = lws_write(wsi, p, len + (q->fragmented ? 0 : 1), (enum lws_write_protocol)mode);
+    // lws buffers what the socket didn't take, a fragment is never partially accepted
+    if (n < 0) return -1;
+    q->fragmented = !fin;
+    q->written += len;
+    if (fin) {
+      send_queue_pop(q);
+    } else {
+      msg->sent += len;
+      queue_account(q, 0, len);
+    }
+    return (int)len;
+  }
+
+  // the rest of a message cut at `max` is a message of its own, with its own command byte
+  unsigned char *out = msg->buf;
+  if (msg->sent > 0) {
+    out = xmalloc(LWS_PRE + 1 + len);
+    memcpy(out + LWS_PRE + 1, payload(msg) + msg->sent, len);
+  }
+  out[LWS_PRE] = (unsigned char)msg->cmd;
+  int n = lws_write(wsi, out + LWS_PRE, len + 1, LWS_WRITE_BINARY);
+  if (out != msg->buf) free(out);
+  if (n != (int)len + 1) return -1;
+
+  q->written += len;
+  if (msg->sent + len == msg->len) {
+    send_queue_pop(q);
+  } else {
+    msg->sent += len;
+    queue_account(q, 0, len);
+  }
+  return (int)len;
+}
+
+#ifndef _WIN32
+static spill_seg_t *spill_seg_new() {
+  size_t size = strlen(spill_dir) + 32;
+  char *path = xmalloc(size);
+  snprintf(path, size, "%s/ttyd-spill-XXXXXX", spill_dir);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "spill: can not create a file in %s: %s\n", spill_dir, strerror(errno));
+    free(path);
+    return NULL;
+  }
+  unlink(path);
+  free(path);
+
+  // the blocks are allocated upfront, so a full disk fails here and not as SIGBUS on a write to the map
+#ifdef __linux__
+  int err = posix_fallocate(fd, 0, SPILL_SEGMENT);
+#else
+  int err = ftruncate(fd, SPILL_SEGMENT) == 0 ? 0 : errno;
+#endif
+  void *base = err == 0 ? mmap(NULL, SPILL_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if (base == MAP_FAILED && err == 0) err = errno;
+  close(fd);
+  if (err != 0) {
+    fprintf(stderr, "spill: can not allocate a segment in %s: %s\n", spill_dir, strerror(err));
+    return NULL;
+  }
+  spill_seg_t *seg = xmalloc(sizeof(spill_seg_t));
+  seg->next = NULL;
+  seg->base = base;
+  seg->head = seg->tail = 0;
+  return seg;
+}
+
+static void spill_seg_free(spill_seg_t *seg) {
+  munmap(seg->base, SPILL_SEGMENT);
+  free(seg);
+}
+#endif
+
+bool send_queue_spill_init(const char *dir, size_t limit) {
+#ifdef _WIN32
+  return false;
+#else
+  free(spill_dir);
+  spill_dir = strdup(dir);
+  spill_limit = limit;
+  return true;
+#endif
+}
+
+bool send_queue_can_spill(send_queue_t *q) {
+  return spill_dir != NULL && !q->spill_full && q->spilled < spill_limit;
+}
+
+// append to the spill, all of data or nothing. if the spill can't take it (a new segment fails or it would
+// go past the limit), it's left as is and marked full until it drains, data is for the caller to hold.
+bool send_queue_spill(send_queue_t *q, char cmd, const char *data, size_t len) {
+#ifndef _WIN32
+  if (spill_dir == NULL) return false;
+  if (q->spill_full || q->spilled + len > spill_limit) {
+    q->spill_full = true;
+    return false;
+  }
+  size_t room = q->spill_tail != NULL ? SPILL_SEGMENT - q->spill_tail->tail : 0;
+  spill_seg_t *first = room > 0 ? q->spill_tail : NULL;
+  while (room < len) {
+    spill_seg_t *seg = spill_seg_new();
+    if (seg == NULL) {
+      q->spill_full = true;
+      return false;
+    }
+    if (q->spill_tail != NULL)
+      q->spill_tail->next = seg;
+    else
+      q->spill_head = seg;
+    q->spill_tail = seg;
+    if (first == NULL) first = seg;
+    room += SPILL_SEGMENT;
+  }
+
+  for (spill_seg_t *seg = first; len > 0; seg = seg->next) {
+    size_t n = SPILL_SEGMENT - seg->tail;
+    if (n > len) n = len;
+    memcpy(seg->base + seg->tail, data, n);
+    seg->tail += n;
+    data += n;
+    len -= n;
+    q->spilled += n;
+    spill_total += n;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+// queue msg behind the spill, for output the spill couldn't take. takes msg.
+void send_queue_hold(send_queue_t *q, send_msg_t *msg) {
+  msg->next = NULL;
+  if (q->held_tail != NULL)
+    q->held_tail->next = msg;
+  else
+    q->held_head = msg;
+  q->held_tail = msg;
+  q->spilled += msg->len;
+  spill_total += msg->len;
+}
+
+// move spilled output to memory while less than `cap` bytes are queued, then the held messages once the
+// spill is empty. returns the bytes moved.
+size_t send_queue_refill(send_queue_t *q, char cmd, size_t cap) {
+  size_t moved = 0;
+#ifndef _WIN32
+  while (q->spill_head != NULL && q->bytes < cap) {
+    spill_seg_t *seg = q->spill_head;
+    size_t n = seg->tail - seg->head;
+    if (n > SPILL_CHUNK) n = SPILL_CHUNK;
+    if (n > 0) {
+      send_queue_push(q, send_msg_new(cmd, seg->base + seg->head, n, true));
+      seg->head += n;
+      q->spilled -= n;
+      spill_total -= n;
+      moved += n;
+    }
+    if (seg->head < seg->tail) continue;
+    if (seg == q->spill_tail && seg->tail < SPILL_SEGMENT) {
+      // the last one is written to again from the start
+      seg->head = seg->tail = 0;
+      break;
+    }
+    q->spill_head = seg->next;
+    if (q->spill_head == NULL) q->spill_tail = NULL;
+    spill_seg_free(seg);
+  }
+  // an emptied tail segment is kept for reuse
+  bool drained = q->spill_head == NULL || q->spill_head->head == q->spill_head->tail;
+#else
+  bool drained = true;
+#endif
+  while (drained && q->held_head != NULL && q->bytes < cap) {
+    send_msg_t *msg = q->held_head;
+    q->held_head = msg->next;
+    if (q->held_head == NULL) q->held_tail = NULL;
+    q->spilled -= msg->len;
+    spill_total -= msg->len;
+    moved += msg->len;
+    send_queue_push(q, msg);
+  }
+  if (q->spilled == 0 && q->bytes < cap) q->spill_full = false;
+  return moved;
+}
+
+static void spill_clear(send_queue_t *q) {
+#ifndef _WIN32
+  while (q->spill_head != NULL) {
+    spill_seg_t *seg = q->spill_head;
+    q->spill_head = seg->next;
+    spill_seg_free(seg);
+  }
+#endif
+  q->spill_tail = NULL;
+  while (q->held_head != NULL) {
+    send_msg_t *msg = q->held_head;
+    q->held_head = msg->next;
+    free(msg);
+  }
+  q->held_tail = NULL;
+  spill_total -= q->spilled;
+  q->spilled = 0;
+  q->spill_full = false;
+}
+
+size_t send_queue_spill_total() { return spill_total; }
+
+// drop the queued messages that can be split (eg: OUTPUT) and the spill, returns the payload bytes dropped.
+// a message in the middle of being sent as fragments is kept, the ws message must be finished.
+size_t send_queue_drop(send_queue_t *q) {
+  size_t dropped = 0;
+  send_msg_t **pp = &q->head;
+  q->tail = NULL;
+  if (q->fragmented) {
+    q->tail = q->head;
+    pp = &q->head->next;
+  }
+  while (*pp != NULL) {
+    send_msg_t *msg = *pp;
+    if (!msg->split) {
+      q->tail = msg;
+      pp = &msg->next;
+      continue;
+    }
+    *pp = msg->next;
+    q->count--;
+    dropped += msg->len - msg->sent;
+    queue_account(q, 0, msg->len - msg->sent);
+    free(msg);
+  }
+  dropped += q->spilled;
+  spill_clear(q);
+  return dropped;
+}
+
+void send_queue_clear(send_queue_t *q) {
+  while (q->head != NULL) send_queue_pop(q);
+  q->fragmented = false;
+  spill_clear(q);
+}
+
+void send_queue_totals(size_t *bytes, size_t *peak) {
+  *bytes = total_bytes;
+  *peak = total_peak;
+}
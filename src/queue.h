@@ -0,0 +1,57 @@
+#ifndef TTYD_QUEUE_H
+#define TTYD_QUEUE_H
+
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct send_msg_ {
+  struct send_msg_ *next;
+  char cmd;              // message type
+  bool split;            // whether the payload may be sent as several messages (eg: OUTPUT)
+  size_t len;            // payload length
+  size_t sent;           // payload bytes already written
+  uint64_t read_at;      // output: when it was read from the pty (ns)
+  uint64_t dispatch_at;  // output: when it reached process_read_cb (ns)
+  uint64_t queued_at;    // output: when it was queued (ns)
+  unsigned char buf[];   // LWS_PRE + command byte + payload
+} send_msg_t;
+
+struct spill_seg_;
+
+typedef struct {
+  send_msg_t *head;
+  send_msg_t *tail;
+  size_t count;      // queued messages
+  size_t bytes;      // queued payload bytes not written yet
+  size_t peak;       // high water mark of bytes
+  uint64_t written;  // payload bytes handed to lws in total
+  bool fragmented;   // the head message is being sent as ws fragments and isn't finished yet
+  struct spill_seg_ *spill_head;  // output spilled to disk, sent after the queued messages
+  struct spill_seg_ *spill_tail;
+  send_msg_t *held_head;  // output the spill couldn't take, queued once the spill is drained
+  send_msg_t *held_tail;
+  size_t spilled;    // bytes in the spill, held included
+  bool spill_full;   // the spill failed or reached the limit, it takes nothing more until drained
+} send_queue_t;
+
+send_msg_t *send_msg_new(char cmd, const char *data, size_t len, bool split);
+void send_queue_push(send_queue_t *q, send_msg_t *msg);
+int send_queue_write(struct lws *wsi, send_queue_t *q, size_t max, size_t frame);
+size_t send_queue_drop(send_queue_t *q);
+void send_queue_clear(send_queue_t *q);
+
+// queued bytes and its high water mark summed over all connections
+void send_queue_totals(size_t *bytes, size_t *peak);
+
+// spill to disk: output beyond the in-memory cap of a connection goes to files in `dir`, up to `limit`
+// bytes per connection, and is read back as messages of type `cmd` as the queue drains
+bool send_queue_spill_init(const char *dir, size_t limit);
+bool send_queue_can_spill(send_queue_t *q);
+bool send_queue_spill(send_queue_t *q, char cmd, const char *data, size_t len);
+void send_queue_hold(send_queue_t *q, send_msg_t *msg);
+size_t send_queue_refill(send_queue_t *q, char cmd, size_t cap);
+size_t send_queue_spill_total();
+
+#endif  // TTYD_QUEUE_H
@@ -0,0 +1,444 @@
+#include "record.h"
+
+#include <fcntl.h>
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "utils.h"
+
+// events are written out in blocks of RECORD_BLOCK bytes or after RECORD_FLUSH_MS, and dropped while
+// RECORD_PENDING_MAX bytes of the session are waiting for the disk
+#define RECORD_BLOCK (64 * 1024)
+#define RECORD_FLUSH_MS 1000
+#define RECORD_PENDING_MAX (8 * 1024 * 1024)
+
+// a block of events, runs on the thread pool
+typedef struct record_job_ {
+  uv_work_t work;
+  struct record_job_ *next;
+  record_t *rec;
+  char *data;
+  size_t len;
+  char *path;  // start this file before writing data
+  bool close;  // the recording is over, close the file after writing data
+  int err;
+} record_job_t;
+
+struct record_ {
+  uv_loop_t *loop;
+  const record_opts_t *opts;
+  struct record_ *next;       // open recordings
+  unsigned int sid;
+  unsigned int part;          // number of the current file
+  char *command;
+  char *term;
+  char *user;
+  uint16_t columns;
+  uint16_t rows;
+  uint64_t start;             // ns, start of the current file, the event times are relative to it
+  uint64_t size;              // bytes of events in the current file
+  char *block;                // events not handed to a job yet
+  size_t len;
+  size_t cap;
+  char partial[2][4];         // incomplete utf-8 sequence at the end of the last output/input
+  size_t partial_len[2];
+  uv_timer_t *timer;          // flushes the block
+  record_job_t *head;         // jobs in order, head is on the thread pool if busy
+  record_job_t *tail;
+  bool busy;
+  size_t pending;             // bytes in jobs, not written yet
+  uint64_t dropped;           // event bytes dropped since the last marker
+  bool closed;
+  bool warned;
+  uv_file fd;                 // used by the jobs only
+};
+
+static record_t *recordings = NULL;
+static bool exit_hook = false;
+
+static void reserve(record_t *rec, size_t n) {
+  if (rec->len + n <= rec->cap) return;
+  rec->cap = rec->len + n > RECORD_BLOCK * 2 ? rec->len + n : RECORD_BLOCK * 2;
+  rec->block = xrealloc(rec->block, rec->cap);
+}
+
+static void append(record_t *rec, const char *data, size_t len) {
+  reserve(rec, len);
+  memcpy(rec->block + rec->len, data, len);
+  rec->len += len;
+}
+
+static void append_str(record_t *rec, const char *str) { append(rec, str, strlen(str)); }
+
+// length of the utf-8 sequence at s (n bytes available): > 0 if valid, 0 if incomplete, -1 if invalid
+static int utf8_seq(const unsigned char *s, size_t n) {
+  int len;
+  unsigned char lo = 0x80, hi = 0xbf;
+  if (s[0] >= 0xc2 && s[0] <= 0xdf)
+    len = 2;
+  else if (s[0] >= 0xe0 && s[0] <= 0xef)
+    len = 3;
+  else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+    len = 4;
+  else
+    return -1;
+  // no overlong forms, surrogates or code points above U+10FFFF
+  if (s[0] == 0xe0) lo = 0xa0;
+  if (s[0] == 0xed) hi = 0x9f;
+  if (s[0] == 0xf0) lo = 0x90;
+  if (s[0] == 0xf4) hi = 0x8f;
+  for (int i = 1; i < len; i++) {
+    if ((size_t)i >= n) return 0;
+    if (s[i] < (i == 1 ? lo : 0x80) || s[i] > (i == 1 ? hi : 0xbf)) return -1;
+  }
+  return len;
+}
+
+// append data as the contents of a JSON string, invalid utf-8 becomes U+FFFD.
+// returns how many bytes at the end are an incomplete sequence, left out
+static size_t append_json(record_t *rec, const char *data, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *s = (const unsigned char *)data;
+  reserve(rec, len * 6);
+  char *p = rec->block + rec->len;
+  size_t i = 0;
+  while (i < len) {
+    unsigned char c = s[i];
+    if (c >= 0x80) {
+      int n = utf8_seq(s + i, len - i);
+      if (n == 0) break;
+      if (n < 0) {
+        memcpy(p, "\xef\xbf\xbd", 3);
+        p += 3;
+        i++;
+        continue;
+      }
+      memcpy(p, s + i, (size_t)n);
+      p += n;
+      i += (size_t)n;
+      continue;
+    }
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = (char)c;
+    } else if (c == '\n') {
+      *p++ = '\\';
+      *p++ = 'n';
+    } else if (c == '\r') {
+      *p++ = '\\';
+      *p++ = 'r';
+    } else if (c < 0x20 || c == 0x7f) {
+      memcpy(p, "\\u00", 4);
+      p[4] = hex[c >> 4];
+      p[5] = hex[c & 0xf];
+      p += 6;
+    } else {
+      *p++ = (char)c;
+    }
+    i++;
+  }
+  rec->len = (size_t)(p - rec->block);
+  return len - i;
+}
+
+static void job_write(record_job_t *job, const char *data, size_t len) {
+  record_t *rec = job->rec;
+  uv_fs_t req;
+  while (len > 0) {
+    uv_buf_t buf = uv_buf_init((char *)data, (unsigned int)len);
+    int n = uv_fs_write(NULL, &req, rec->fd, &buf, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    if (n < 0) {
+      job->err = n;
+      return;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+}
+
+// a complete gzip member, concatenated members are a valid gzip file and each is a point to seek to
+static void job_write_gzip(record_job_t *job) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    job->err = UV_ENOMEM;
+    return;
+  }
+  size_t size = deflateBound(&zs, (uLong)job->len);
+  unsigned char *out = xmalloc(size);
+  zs.next_in = (unsigned char *)job->data;
+  zs.avail_in = (uInt)job->len;
+  zs.next_out = out;
+  zs.avail_out = (uInt)size;
+  if (deflate(&zs, Z_FINISH) == Z_STREAM_END)
+    job_write(job, (char *)out, zs.total_out);
+  else
+    job->err = UV_EIO;
+  deflateEnd(&zs);
+  free(out);
+}
+
+static void work_cb(uv_work_t *work) {
+  record_job_t *job = (record_job_t *)work;
+  record_t *rec = job->rec;
+  uv_fs_t req;
+  if (job->path != NULL) {
+    if (rec->fd >= 0) {
+      uv_fs_close(NULL, &req, rec->fd, NULL);
+      uv_fs_req_cleanup(&req);
+    }
+    rec->fd = uv_fs_open(NULL, &req, job->path, O_WRONLY | O_CREAT | O_APPEND, 0600, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  if (rec->fd < 0) {
+    job->err = rec->fd;
+  } else if (job->len > 0) {
+    if (rec->opts->gzip)
+      job_write_gzip(job);
+    else
+      job_write(job, job->data, job->len);
+  }
+  if (job->close && rec->fd >= 0) {
+    uv_fs_close(NULL, &req, rec->fd, NULL);
+    uv_fs_req_cleanup(&req);
+    rec->fd = -1;
+  }
+}
+
+static void job_free(record_job_t *job) {
+  free(job->data);
+  free(job->path);
+  free(job);
+}
+
+static void after_work_cb(uv_work_t *work, int status);
+
+static void job_next(record_t *rec) {
+  if (rec->busy || rec->head == NULL) return;
+  rec->busy = true;
+  uv_queue_work(rec->loop, &rec->head->work, work_cb, after_work_cb);
+}
+
+static void after_work_cb(uv_work_t *work, int status) {
+  record_job_t *job = (record_job_t *)work;
+  record_t *rec = job->rec;
+  if (job->err < 0 && !rec->warned) {
+    lwsl_warn("failed to write recording of session %u: %s\n", rec->sid, uv_strerror(job->err));
+    rec->warned = true;
+  }
+  rec->head = job->next;
+  if (rec->head == NULL) rec->tail = NULL;
+  rec->pending -= job->len;
+  rec->busy = false;
+  job_free(job);
+
+  if (rec->closed && rec->head == NULL) {
+    free(rec->block);
+    free(rec->command);
+    free(rec->term);
+    free(rec->user);
+    free(rec);
+    return;
+  }
+  job_next(rec);
+}
+
+// hand the block to a job, that starts the file `path` first if not NULL
+static void flush(record_t *rec, char *path, bool close) {
+  if (rec->len == 0 && path == NULL && !close) return;
+  record_job_t *job = xmalloc(sizeof(record_job_t));
+  memset(job, 0, sizeof(record_job_t));
+  job->rec = rec;
+  job->data = rec->block;
+  job->len = rec->len;
+  job->path = path;
+  job->close = close;
+  rec->block = NULL;
+  rec->len = rec->cap = 0;
+  uv_timer_stop(rec->timer);
+
+  rec->pending += job->len;
+  if (rec->tail != NULL)
+    rec->tail->next = job;
+  else
+    rec->head = job;
+  rec->tail = job;
+  job_next(rec);
+}
+
+static void timer_cb(uv_timer_t *timer) { flush((record_t *)timer->data, NULL, false); }
+
+// start the next file with the asciicast header
+static void start_file(record_t *rec) {
+  char name[64];
+  time_t now = time(NULL);
+  strftime(name, sizeof(name), "%Y%m%d-%H%M%S", localtime(&now));
+  size_t size = strlen(rec->opts->dir) + 128;
+  char *path = xmalloc(size);
+  snprintf(path, size, "%s/%s-%d-%u.%u.cast%s", rec->opts->dir, name, uv_os_getpid(), rec->sid, ++rec->part,
+           rec->opts->gzip ? ".gz" : "");
+  flush(rec, NULL, false);  // the rest of the last file
+  flush(rec, path, false);
+
+  char buf[128];
+  int n = snprintf(buf, sizeof(buf), "{\"version\": 2, \"width\": %u, \"height\": %u, \"timestamp\": %lld",
+                   rec->columns, rec->rows, (long long)now);
+  append(rec, buf, (size_t)n);
+  append_str(rec, ", \"command\": \"");
+  append_json(rec, rec->command, strlen(rec->command));
+  append_str(rec, "\", \"env\": {\"TERM\": \"");
+  append_json(rec, rec->term, strlen(rec->term));
+  if (rec->user != NULL) {
+    append_str(rec, "\", \"TTYD_USER\": \"");
+    append_json(rec, rec->user, strlen(rec->user));
+  }
+  append_str(rec, "\"}}\n");
+  rec->start = uv_hrtime();
+  rec->size = 0;
+}
+
+static void event_start(record_t *rec, char type) {
+  uint64_t t = (uv_hrtime() - rec->start) / 1000;
+  char buf[64];
+  int n = snprintf(buf, sizeof(buf), "[%llu.%06u, \"%c\", \"", (unsigned long long)(t / 1000000),
+                   (unsigned int)(t % 1000000), type);
+  append(rec, buf, (size_t)n);
+}
+
+static void event_end(record_t *rec, size_t start) {
+  append_str(rec, "\"]\n");
+  rec->size += rec->len - start;
+  if (rec->len >= RECORD_BLOCK)
+    flush(rec, NULL, false);
+  else if (!uv_is_active((uv_handle_t *)rec->timer))
+    uv_timer_start(rec->timer, timer_cb, RECORD_FLUSH_MS, 0);
+}
+
+// whether an event of len bytes fits, a marker event notes what was dropped before it
+static bool event_check(record_t *rec, size_t len) {
+  if (rec->opts->max_size > 0 && rec->size >= rec->opts->max_size) start_file(rec);
+  if (rec->opts->max_age > 0 && uv_hrtime() - rec->start >= (uint64_t)rec->opts->max_age * 1000000000) start_file(rec);
+  if (rec->pending + rec->len + len > RECORD_PENDING_MAX) {
+    rec->dropped += len;
+    return false;
+  }
+  if (rec->dropped > 0) {
+    size_t start = rec->len;
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%llu bytes dropped", (unsigned long long)rec->dropped);
+    event_start(rec, 'm');
+    append(rec, buf, (size_t)n);
+    event_end(rec, start);
+    rec->dropped = 0;
+  }
+  return true;
+}
+
+static void event_data(record_t *rec, int stream, const char *data, size_t len) {
+  if (rec == NULL || rec->closed || len == 0) return;
+  if (!event_check(rec, len)) return;
+  size_t start = rec->len;
+  event_start(rec, stream == 0 ? 'o' : 'i');
+
+  // the sequence split at the end of the last event goes first
+  char *joined = NULL;
+  size_t partial = rec->partial_len[stream];
+  if (partial > 0) {
+    joined = xmalloc(partial + len);
+    memcpy(joined, rec->partial[stream], partial);
+    memcpy(joined + partial, data, len);
+    data = joined;
+    len += partial;
+    rec->partial_len[stream] = 0;
+  }
+  size_t left = append_json(rec, data, len);
+  if (left > 0) {
+    memcpy(rec->partial[stream], data + len - left, left);
+    rec->partial_len[stream] = left;
+  }
+  free(joined);
+  event_end(rec, start);
+}
+
+// the hook of ttyd exiting from a callback (eg: --once), write out the blocks of the sessions with
+// nothing on the thread pool, the others are lost
+static void record_exit() {
+  for (record_t *rec = recordings; rec != NULL; rec = rec->next) {
+    if (rec->busy || rec->len == 0) continue;
+    record_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.rec = rec;
+    job.data = rec->block;
+    job.len = rec->len;
+    job.close = true;
+    work_cb(&job.work);
+  }
+}
+
+record_t *record_open(uv_loop_t *loop, const record_opts_t *opts, unsigned int sid, const char *command,
+                      const char *term, const char *user, uint16_t columns, uint16_t rows) {
+  record_t *rec = xmalloc(sizeof(record_t));
+  memset(rec, 0, sizeof(record_t));
+  rec->loop = loop;
+  rec->opts = opts;
+  rec->sid = sid;
+  rec->command = strdup(command != NULL ? command : "");
+  rec->term = strdup(term);
+  if (user != NULL && *user != '\0') rec->user = strdup(user);
+  rec->columns = columns;
+  rec->rows = rows;
+  rec->fd = -1;
+  rec->timer = xmalloc(sizeof(uv_timer_t));
+  uv_timer_init(loop, rec->timer);
+  rec->timer->data = rec;
+  start_file(rec);
+
+  rec->next = recordings;
+  recordings = rec;
+  if (!exit_hook) {
+    atexit(record_exit);
+    exit_hook = true;
+  }
+  return rec;
+}
+
+void record_output(record_t *rec, const char *data, size_t len) { event_data(rec, 0, data, len); }
+
+void record_input(record_t *rec, const char *data, size_t len) {
+  if (rec != NULL && rec->opts->input) event_data(rec, 1, data, len);
+}
+
+void record_resize(record_t *rec, uint16_t columns, uint16_t rows) {
+  if (rec == NULL || rec->closed || (columns == rec->columns && rows == rec->rows)) return;
+  rec->columns = columns;
+  rec->rows = rows;
+  if (!event_check(rec, 16)) return;
+  size_t start = rec->len;
+  char buf[16];
+  int n = snprintf(buf, sizeof(buf), "%ux%u", columns, rows);
+  event_start(rec, 'r');
+  append(rec, buf, (size_t)n);
+  event_end(rec, start);
+}
+
+static void timer_close_cb(uv_handle_t *handle) { free(handle); }
+
+void record_close(record_t *rec) {
+  if (rec == NULL) return;
+  for (record_t **r = &recordings; *r != NULL; r = &(*r)->next) {
+    if (*r == rec) {
+      *r = rec->next;
+      break;
+    }
+  }
+  if (rec->dropped > 0) lwsl_warn("recording of session %u: %llu bytes dropped, the disk couldn't keep up\n", rec->sid,
+                                  (unsigned long long)rec->dropped);
+  uv_close((uv_handle_t *)rec->timer, timer_close_cb);
+  flush(rec, NULL, true);
+  rec->closed = true;
+}
@@ -0,0 +1,29 @@
+#ifndef TTYD_RECORD_H
+#define TTYD_RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// session recording in the asciicast v2 format (asciinema), events are buffered and written to the
+// file on the thread pool, one file at a time per session
+typedef struct {
+  char *dir;          // where the recordings go, NULL disables recording
+  bool input;         // record input events too
+  uint64_t max_size;  // start a new file after this many bytes of events, 0 means no limit
+  int max_age;        // start a new file after this many seconds, 0 means no limit
+  bool gzip;          // compress the files, one gzip member per written block
+} record_opts_t;
+
+typedef struct record_ record_t;
+
+record_t *record_open(uv_loop_t *loop, const record_opts_t *opts, unsigned int sid, const char *command,
+                      const char *term, const char *user, uint16_t columns, uint16_t rows);
+void record_output(record_t *rec, const char *data, size_t len);
+void record_input(record_t *rec, const char *data, size_t len);
+void record_resize(record_t *rec, uint16_t columns, uint16_t rows);
+// writes out what is buffered, rec is freed once it is on disk
+void record_close(record_t *rec);
+
+#endif  // TTYD_RECORD_H
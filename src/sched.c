@@ -0,0 +1,83 @@
+#include "sched.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+static user_bucket_t *user_buckets = NULL;
+
+void tb_init(token_bucket_t *tb, uint64_t rate, uint64_t burst, uint64_t now) {
+  tb->rate = rate;
+  tb->burst = burst > 0 ? burst : rate;
+  tb->tokens = tb->burst * 1000;
+  tb->last = now;
+}
+
+static void tb_refill(token_bucket_t *tb, uint64_t now) {
+  if (now <= tb->last) return;
+  uint64_t max = tb->burst * 1000;
+  uint64_t elapsed = now - tb->last;
+  tb->last = now;
+  // elapsed ms * bytes/s = milli-bytes
+  if (elapsed >= max / tb->rate + 1) {
+    tb->tokens = max;
+    return;
+  }
+  tb->tokens += elapsed * tb->rate;
+  if (tb->tokens > max) tb->tokens = max;
+}
+
+size_t tb_peek(token_bucket_t *tb, size_t want, uint64_t now) {
+  if (tb == NULL || tb->rate == 0) return want;
+  tb_refill(tb, now);
+  uint64_t avail = tb->tokens / 1000;
+  return avail < want ? (size_t)avail : want;
+}
+
+void tb_consume(token_bucket_t *tb, size_t n) {
+  if (tb == NULL || tb->rate == 0) return;
+  uint64_t m = (uint64_t)n * 1000;
+  tb->tokens = m < tb->tokens ? tb->tokens - m : 0;
+}
+
+uint64_t tb_delay(token_bucket_t *tb, size_t want) {
+  if (tb == NULL || tb->rate == 0) return 0;
+  // never wait for more than the bucket can hold
+  uint64_t need = (want < tb->burst ? want : tb->burst) * 1000;
+  if (need <= tb->tokens) return 0;
+  return (need - tb->tokens + tb->rate - 1) / tb->rate;
+}
+
+user_bucket_t *user_bucket_get(const char *name, uint64_t rate, uint64_t burst, uint64_t now) {
+  user_bucket_t *ub = user_buckets;
+  for (; ub != NULL; ub = ub->next) {
+    if (strcmp(ub->name, name) == 0) {
+      ub->refs++;
+      return ub;
+    }
+  }
+
+  ub = xmalloc(sizeof(user_bucket_t));
+  memset(ub, 0, sizeof(user_bucket_t));
+  snprintf(ub->name, sizeof(ub->name), "%s", name);
+  ub->refs = 1;
+  tb_init(&ub->tb, rate, burst, now);
+  ub->next = user_buckets;
+  user_buckets = ub;
+  return ub;
+}
+
+void user_bucket_put(user_bucket_t *ub) {
+  if (ub == NULL || --ub->refs > 0) return;
+
+  user_bucket_t **pp = &user_buckets;
+  for (; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == ub) {
+      *pp = ub->next;
+      break;
+    }
+  }
+  free(ub);
+}
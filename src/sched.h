@@ -0,0 +1,32 @@
+#ifndef TTYD_SCHED_H
+#define TTYD_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// token bucket, tokens are kept in milli-bytes so that refill is exact with ms timestamps
+typedef struct {
+  uint64_t rate;    // bytes per second, 0 means unlimited
+  uint64_t burst;   // bucket capacity in bytes
+  uint64_t tokens;  // available tokens (milli-bytes)
+  uint64_t last;    // last refill time (ms)
+} token_bucket_t;
+
+// token bucket shared by all sessions of the same user
+typedef struct user_bucket_ {
+  char name[50];
+  int refs;
+  token_bucket_t tb;
+  struct user_bucket_ *next;
+} user_bucket_t;
+
+void tb_init(token_bucket_t *tb, uint64_t rate, uint64_t burst, uint64_t now);
+size_t tb_peek(token_bucket_t *tb, size_t want, uint64_t now);
+void tb_consume(token_bucket_t *tb, size_t n);
+uint64_t tb_delay(token_bucket_t *tb, size_t want);
+
+user_bucket_t *user_bucket_get(const char *name, uint64_t rate, uint64_t burst, uint64_t now);
+void user_bucket_put(user_bucket_t *ub);
+
+#endif  // TTYD_SCHED_H
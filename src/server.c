@@ -11,6 +11,8 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include "metrics.h"
+#include "trace.h"
 #include "utils.h"
 #include "compat.h"
 
@@ -21,14 +23,39 @@
 volatile bool force_exit = false;
 struct lws_context *context;
 struct server *server;
-struct endpoints endpoints = {"/ws", "/", "/token", ""};
+struct endpoints endpoints = {"/ws", "/", "/token", "", "/metrics"};
+const char *slow_policy_name[] = {"none", "pause", "snapshot", "disconnect"};
 
 extern int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 extern int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
+// the session of a connection callback, NULL for the others: the ssl ones pass an SSL_CTX or X509_STORE_CTX as user
+static void *session_of(struct lws *wsi, void *user) {
+  return user != NULL && wsi != NULL && user == lws_wsi_user(wsi) ? user : NULL;
+}
+
+// the callbacks timed for the loop monitor, the user data is still valid after a CLOSED callback returns
+static int timed_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  if (!metrics.loop_monitor) return callback_http(wsi, reason, user, in, len);
+  uint64_t start = uv_hrtime();
+  int ret = callback_http(wsi, reason, user, in, len);
+  struct pss_http *pss = (struct pss_http *)session_of(wsi, user);
+  callback_timed(PROTOCOL_HTTP, reason, uv_hrtime() - start, pss != NULL ? pss->path : NULL);
+  return ret;
+}
+
+static int timed_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+  if (!metrics.loop_monitor) return callback_tty(wsi, reason, user, in, len);
+  uint64_t start = uv_hrtime();
+  int ret = callback_tty(wsi, reason, user, in, len);
+  struct pss_tty *pss = (struct pss_tty *)session_of(wsi, user);
+  callback_timed(PROTOCOL_TTY, reason, uv_hrtime() - start, pss != NULL ? pss->address : NULL);
+  return ret;
+}
+
 // websocket protocols
-static const struct lws_protocols protocols[] = {{"http-only", callback_http, sizeof(struct pss_http), 0},
-                                                 {"tty", callback_tty, sizeof(struct pss_tty), 0},
+static const struct lws_protocols protocols[] = {{"http-only", timed_http, sizeof(struct pss_http), 0},
+                                                 {"tty", timed_tty, sizeof(struct pss_tty), 0},
                                                  {NULL, NULL, 0, 0}};
 
 #ifndef LWS_WITHOUT_EXTENSIONS
@@ -51,6 +78,33 @@ static lws_retry_bo_t retry = {
 };
 #endif
 
+// long only options
+enum {
+  OPT_WRITE_QUANTUM = 256,
+  OPT_RATE_LIMIT,
+  OPT_USER_RATE_LIMIT,
+  OPT_SEND_QUEUE_SIZE,
+  OPT_SLOW_CLIENT,
+  OPT_SLOW_TIMEOUT,
+  OPT_SLOW_SIZE,
+  OPT_SYNC_TIMEOUT,
+  OPT_FRAME_SIZE,
+  OPT_CACHE_CONTROL,
+  OPT_METRICS,
+  OPT_LOOP_WARN,
+  OPT_TRACE,
+  OPT_BACKEND,
+  OPT_NO_PTY,
+  OPT_RECORD,
+  OPT_RECORD_INPUT,
+  OPT_RECORD_MAX_SIZE,
+  OPT_RECORD_MAX_AGE,
+  OPT_RECORD_GZIP,
+  OPT_REPLAY,
+  OPT_SPILL_DIR,
+  OPT_SPILL_LIMIT,
+};
+
 // command line options
 static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"interface", required_argument, NULL, 'i'},
@@ -67,6 +121,29 @@ static const struct option options[] = {{"port", required_argument, NULL, 'p'},
                                         {"ping-interval", required_argument, NULL, 'P'},
 #endif
                                         {"srv-buf-size", required_argument, NULL, 'f'},
+                                        {"write-quantum", required_argument, NULL, OPT_WRITE_QUANTUM},
+                                        {"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+                                        {"user-rate-limit", required_argument, NULL, OPT_USER_RATE_LIMIT},
+                                        {"send-queue-size", required_argument, NULL, OPT_SEND_QUEUE_SIZE},
+                                        {"spill-dir", required_argument, NULL, OPT_SPILL_DIR},
+                                        {"spill-limit", required_argument, NULL, OPT_SPILL_LIMIT},
+                                        {"slow-client", required_argument, NULL, OPT_SLOW_CLIENT},
+                                        {"slow-timeout", required_argument, NULL, OPT_SLOW_TIMEOUT},
+                                        {"slow-size", required_argument, NULL, OPT_SLOW_SIZE},
+                                        {"sync-timeout", required_argument, NULL, OPT_SYNC_TIMEOUT},
+                                        {"frame-size", required_argument, NULL, OPT_FRAME_SIZE},
+                                        {"cache-control", required_argument, NULL, OPT_CACHE_CONTROL},
+                                        {"metrics", no_argument, NULL, OPT_METRICS},
+                                        {"loop-warn", required_argument, NULL, OPT_LOOP_WARN},
+                                        {"trace", required_argument, NULL, OPT_TRACE},
+                                        {"backend", required_argument, NULL, OPT_BACKEND},
+                                        {"no-pty", no_argument, NULL, OPT_NO_PTY},
+                                        {"record", required_argument, NULL, OPT_RECORD},
+                                        {"record-input", no_argument, NULL, OPT_RECORD_INPUT},
+                                        {"record-max-size", required_argument, NULL, OPT_RECORD_MAX_SIZE},
+                                        {"record-max-age", required_argument, NULL, OPT_RECORD_MAX_AGE},
+                                        {"record-gzip", no_argument, NULL, OPT_RECORD_GZIP},
+                                        {"replay", required_argument, NULL, OPT_REPLAY},
                                         {"ipv6", no_argument, NULL, '6'},
                                         {"ssl", no_argument, NULL, 'S'},
                                         {"ssl-cert", required_argument, NULL, 'C'},
@@ -113,12 +190,41 @@ static void print_help() {
           "    -o, --once              Accept only one client and exit on disconnection\n"
           "    -q, --exit-no-conn      Exit on all clients disconnection\n"
           "    -B, --browser           Open terminal with the default system browser\n"
-          "    -I, --index             Custom index.html path\n"
+          "    -I, --index             Custom index.html path, reloaded when the file changes\n"
           "    -b, --base-path         Expected base path for requests coming from a reverse proxy (eg: /mounted/here, max length: 128)\n"
 #if LWS_LIBRARY_VERSION_NUMBER >= 4000000
           "    -P, --ping-interval     Websocket ping interval(sec) (default: 5)\n"
 #endif
           "    -f, --srv-buf-size      Maximum chunk of file (in bytes) that can be sent at once, a larger value may improve throughput (default: 4096)\n"
+          "        --write-quantum     Maximum output (in bytes) a session can send per write round, keeps busy sessions from starving others (default: 0, no limit)\n"
+          "        --rate-limit        Output rate limit of each session (bytes/s, eg: 512K, 2M) (default: 0, no limit)\n"
+          "        --user-rate-limit   Output rate limit shared by all sessions of a user or client address (bytes/s) (default: 0, no limit)\n"
+          "        --send-queue-size   Output (in bytes) queued per client before the command is paused, a larger value may improve throughput (default: 0, pause until sent)\n"
+#ifndef _WIN32
+          "        --spill-dir         Spill the output beyond --send-queue-size (default: 1M with this option) to files in this directory instead of pausing the command, it is sent when the client catches up\n"
+          "        --spill-limit       Output (in bytes) spilled per client before the command is paused (default: 1G)\n"
+#endif
+          "        --slow-client       Action on clients that stop reading: pause, snapshot (skip output and redraw) or disconnect (default: none)\n"
+          "        --slow-timeout      Seconds without send progress before a client is considered slow (default: 30)\n"
+          "        --slow-size         Unsent bytes (queued and in the socket) before a client is considered slow (default: 0, no limit)\n"
+          "        --sync-timeout      Max time (ms) to hold back a synchronized update (DEC mode 2026) to send it as one frame, 0 to disable (default: 100)\n"
+          "        --frame-size        Send output larger than this as websocket fragments, so pings don't wait behind it (default: 0, disabled)\n"
+          "        --cache-control     Cache-Control header of index.html, revalidated by ETag, always no-store with --credential (default: no-cache)\n"
+          "        --metrics           Serve Prometheus metrics on /metrics\n"
+          "        --loop-warn         Log the event loop stalls (lag or a callback) longer than this (ms) with the longest callback (default: 0, disabled)\n"
+          "        --trace             Write the output pipeline trace (pty read, queue, socket write) to this file in the Chrome trace format\n"
+#ifdef _WIN32
+          "        --backend           Session backend: pty, socket (the command is unix:PATH or tcp:HOST:PORT to connect to), replay (the command is a file to play), cast (the command is an asciicast recording, or a directory of them and the recording, then the speed and start in seconds) or synthetic (the command is the output rate in bytes/s or max, and an optional total) (default: pty)\n"
+#else
+          "        --backend           Session backend: pty, pipe (no terminal), tmux (a window of a shared tmux server, left running to be resumed by the next session of the same --auth-header user), socket (the command is unix:PATH or tcp:HOST:PORT to connect to), replay (the command is a file to play), cast (the command is an asciicast recording, or a directory of them and the recording, then the speed and start in seconds) or synthetic (the command is the output rate in bytes/s or max, and an optional total) (default: pty)\n"
+          "        --no-pty            Run the command on pipes instead of a terminal, for non-interactive output like tail -f (same as --backend pipe)\n"
+#endif
+          "        --record            Record the sessions in the asciicast v2 format into this directory, one file per session\n"
+          "        --record-input      Record the input of the sessions too\n"
+          "        --record-max-size   Start a new recording file after this many bytes of events, eg: 64M (default: 0, no limit)\n"
+          "        --record-max-age    Start a new recording file after this many seconds (default: 0, no limit)\n"
+          "        --record-gzip       Compress the recordings with gzip\n"
+          "        --replay            Serve the recordings in this directory read-only instead of a command, picked with ?arg=NAME, optionally &arg=SPEED&arg=START (space pauses, +/- change the speed, arrows and 0-9 seek)\n"
 #ifdef LWS_WITH_IPV6
           "    -6, --ipv6              Enable IPv6 support\n"
 #endif
@@ -158,6 +264,24 @@ static void print_config() {
   if (server->exit_no_conn) lwsl_notice("  exit_no_conn: true\n");
   if (server->index != NULL) lwsl_notice("  custom index.html: %s\n", server->index);
   if (server->cwd != NULL) lwsl_notice("  working directory: %s\n", server->cwd);
+  if (server->write_quantum > 0) lwsl_notice("  write quantum: %zu\n", server->write_quantum);
+  if (server->rate_limit > 0) lwsl_notice("  rate limit: %llu bytes/s\n", (unsigned long long)server->rate_limit);
+  if (server->user_limit > 0) lwsl_notice("  user rate limit: %llu bytes/s\n", (unsigned long long)server->user_limit);
+  if (server->send_queue_size > 0) lwsl_notice("  send queue size: %zu\n", server->send_queue_size);
+  if (server->spill_dir != NULL) lwsl_notice("  spill: %s, limit: %zu\n", server->spill_dir, server->spill_limit);
+  if (server->slow_policy != SLOW_NONE)
+    lwsl_notice("  slow client: %s after %ds stalled or %zu bytes unsent\n", slow_policy_name[server->slow_policy],
+                server->slow_timeout, server->slow_size);
+  if (server->sync_timeout > 0) lwsl_notice("  sync timeout: %dms\n", server->sync_timeout);
+  if (server->frame_size > 0) lwsl_notice("  frame size: %zu\n", server->frame_size);
+  lwsl_notice("  cache control: %s\n", server->credential != NULL ? "no-store, private" : server->cache_control);
+  if (server->metrics) lwsl_notice("  metrics: %s\n", endpoints.metrics);
+  if (server->loop_warn > 0) lwsl_notice("  loop warn: %dms\n", server->loop_warn);
+  if (server->trace != NULL) lwsl_notice("  trace: %s\n", server->trace);
+  if (server->backend != &pty_backend_pty) lwsl_notice("  backend: %s\n", server->backend->name);
+  if (server->record.dir != NULL)
+    lwsl_notice("  record: %s (input: %s, gzip: %s)\n", server->record.dir, server->record.input ? "yes" : "no",
+                server->record.gzip ? "yes" : "no");
   if (!server->writable) lwsl_warn("The --writable option is not set, will start in readonly mode\n");
 }
 
@@ -170,6 +294,11 @@ static struct server *server_new(int argc, char **argv, int start) {
   memset(ts, 0, sizeof(struct server));
   ts->client_count = 0;
   ts->sig_code = SIGHUP;
+  ts->slow_timeout = 30;
+  ts->sync_timeout = 100;
+  ts->spill_limit = 1024 * 1024 * 1024;
+  ts->backend = &pty_backend_pty;
+  ts->cache_control = strdup("no-cache");
   snprintf(ts->terminal_type, sizeof(ts->terminal_type), "%s", "xterm-256color");
   get_sig_name(ts->sig_code, ts->sig_name, sizeof(ts->sig_name));
   if (start == argc) return ts;
@@ -210,6 +339,10 @@ static void server_free(struct server *ts) {
   if (ts->auth_header != NULL) free(ts->auth_header);
   if (ts->index != NULL) free(ts->index);
   if (ts->cwd != NULL) free(ts->cwd);
+  free(ts->cache_control);
+  free(ts->trace);
+  free(ts->record.dir);
+  free(ts->spill_dir);
   free(ts->command);
   free(ts->prefs_json);
 
@@ -230,6 +363,8 @@ static void server_free(struct server *ts) {
   free(ts);
 }
 
+static void slow_check_cb(uv_timer_t *timer) { lws_callback_all_protocol(context, &protocols[1], LWS_CALLBACK_USER); }
+
 static void signal_cb(uv_signal_t *watcher, int signum) {
   char sig_name[20];
 
@@ -264,6 +399,37 @@ static int parse_int(char *name, char *str) {
   return (int)val;
 }
 
+// parse size with optional K/M/G suffix, eg: 64K
+static uint64_t parse_size(char *name, char *str) {
+  char *endptr;
+  errno = 0;
+  long long val = strtoll(str, &endptr, 0);
+  if (errno != 0 || endptr == str || val < 0) goto invalid;
+  switch (*endptr) {
+    case 'g':
+    case 'G':
+      val *= 1024;
+      // fall through
+    case 'm':
+    case 'M':
+      val *= 1024;
+      // fall through
+    case 'k':
+    case 'K':
+      val *= 1024;
+      endptr++;
+      break;
+    default:
+      break;
+  }
+  if (*endptr != '\0') goto invalid;
+  return (uint64_t)val;
+
+invalid:
+  fprintf(stderr, "ttyd: invalid value for %s: %s\n", name, str);
+  exit(EXIT_FAILURE);
+}
+
 static int calc_command_start(int argc, char **argv) {
   // make a copy of argc and argv
   int argc_copy = argc;
@@ -453,7 +619,7 @@ int main(int argc, char **argv) {
 #define sc(f)                                  \
   strncpy(path + len, endpoints.f, 128 - len); \
   endpoints.f = strdup(path);
-        sc(ws) sc(index) sc(token) sc(parent)
+        sc(ws) sc(index) sc(token) sc(parent) sc(metrics)
 #undef sc
       } break;
 #if LWS_LIBRARY_VERSION_NUMBER >= 4000000
@@ -475,6 +641,149 @@ int main(int argc, char **argv) {
         }
         info.pt_serv_buf_size = serv_buf_size;
       } break;
+      case OPT_WRITE_QUANTUM:
+        server->write_quantum = (size_t)parse_size("write-quantum", optarg);
+        break;
+      case OPT_RATE_LIMIT:
+        server->rate_limit = parse_size("rate-limit", optarg);
+        break;
+      case OPT_USER_RATE_LIMIT:
+        server->user_limit = parse_size("user-rate-limit", optarg);
+        break;
+      case OPT_SEND_QUEUE_SIZE:
+        server->send_queue_size = (size_t)parse_size("send-queue-size", optarg);
+        break;
+      case OPT_SPILL_DIR: {
+#ifdef _WIN32
+        fprintf(stderr, "ttyd: --spill-dir is not supported on windows\n");
+        return -1;
+#else
+        struct stat st;
+        if (stat(optarg, &st) == -1 || !S_ISDIR(st.st_mode)) {
+          fprintf(stderr, "ttyd: invalid spill directory: %s\n", optarg);
+          return -1;
+        }
+        free(server->spill_dir);
+        server->spill_dir = strdup(optarg);
+#endif
+      } break;
+      case OPT_SPILL_LIMIT:
+        server->spill_limit = (size_t)parse_size("spill-limit", optarg);
+        break;
+      case OPT_SLOW_CLIENT: {
+        int policy = SLOW_NONE;
+        for (int i = SLOW_NONE; i <= SLOW_DISCONNECT; i++) {
+          if (strcmp(optarg, slow_policy_name[i]) == 0) policy = i;
+        }
+        if (policy == SLOW_NONE && strcmp(optarg, "none") != 0) {
+          fprintf(stderr, "ttyd: invalid slow client action: %s\n", optarg);
+          return -1;
+        }
+        server->slow_policy = policy;
+      } break;
+      case OPT_SLOW_TIMEOUT:
+        server->slow_timeout = parse_int("slow-timeout", optarg);
+        if (server->slow_timeout <= 0) {
+          fprintf(stderr, "ttyd: invalid slow timeout: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_SLOW_SIZE:
+        server->slow_size = (size_t)parse_size("slow-size", optarg);
+        break;
+      case OPT_FRAME_SIZE:
+        server->frame_size = (size_t)parse_size("frame-size", optarg);
+        break;
+      case OPT_CACHE_CONTROL:
+        if (strlen(optarg) == 0 || strpbrk(optarg, "\r\n") != NULL) {
+          fprintf(stderr, "ttyd: invalid cache control: %s\n", optarg);
+          return -1;
+        }
+        free(server->cache_control);
+        server->cache_control = strdup(optarg);
+        break;
+      case OPT_METRICS:
+        server->metrics = true;
+        break;
+      case OPT_TRACE:
+        free(server->trace);
+        server->trace = strdup(optarg);
+        break;
+      case OPT_BACKEND:
+        server->backend = pty_backend_find(optarg);
+        if (server->backend == NULL) {
+          fprintf(stderr, "ttyd: invalid backend: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_NO_PTY:
+#ifdef _WIN32
+        fprintf(stderr, "ttyd: --no-pty is not supported on windows\n");
+        return -1;
+#else
+        server->backend = &pty_backend_pipe;
+        break;
+#endif
+      case OPT_RECORD: {
+        struct stat st;
+        if (stat(optarg, &st) == -1 || !S_ISDIR(st.st_mode)) {
+          fprintf(stderr, "ttyd: invalid record directory: %s\n", optarg);
+          return -1;
+        }
+        free(server->record.dir);
+        server->record.dir = strdup(optarg);
+      } break;
+      case OPT_RECORD_INPUT:
+        server->record.input = true;
+        break;
+      case OPT_RECORD_MAX_SIZE:
+        server->record.max_size = parse_size("record-max-size", optarg);
+        break;
+      case OPT_RECORD_MAX_AGE:
+        server->record.max_age = parse_int("record-max-age", optarg);
+        if (server->record.max_age < 0) {
+          fprintf(stderr, "ttyd: invalid record max age: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_RECORD_GZIP:
+        server->record.gzip = true;
+        break;
+      case OPT_REPLAY: {
+        struct stat st;
+        if (stat(optarg, &st) == -1 || !S_ISDIR(st.st_mode)) {
+          fprintf(stderr, "ttyd: invalid replay directory: %s\n", optarg);
+          return -1;
+        }
+        if (server->argc > 0) {
+          fprintf(stderr, "ttyd: --replay does not take a command\n");
+          return -1;
+        }
+        // the directory is the command of the cast backend, the recording comes from the url, input controls
+        // the playback
+        server->argv = xmalloc(2 * sizeof(char *));
+        server->argv[0] = strdup(optarg);
+        server->argv[1] = NULL;
+        server->argc = 1;
+        server->command = strdup(optarg);
+        server->backend = &pty_backend_cast;
+        server->url_arg = true;
+        server->writable = true;
+      } break;
+      case OPT_LOOP_WARN:
+        server->loop_warn = parse_int("loop-warn", optarg);
+        if (server->loop_warn < 0) {
+          fprintf(stderr, "ttyd: invalid loop warn: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_SYNC_TIMEOUT:
+        server->sync_timeout = parse_int("sync-timeout", optarg);
+        if (server->sync_timeout < 0) {
+          fprintf(stderr, "ttyd: invalid sync timeout: %s\n", optarg);
+          return -1;
+        }
+        break;
       case '6':
         info.options &= ~(LWS_SERVER_OPTION_DISABLE_IPV6);
         break;
@@ -532,6 +841,12 @@ int main(int argc, char **argv) {
     return -1;
   }
 
+  if (server->spill_dir != NULL) {
+    // spilling from the first byte queued would write most output to disk
+    if (server->send_queue_size == 0) server->send_queue_size = 1024 * 1024;
+    send_queue_spill_init(server->spill_dir, server->spill_limit);
+  }
+
   lws_set_log_level(debug_level, NULL);
 
   char server_hdr[128] = "";
@@ -579,6 +894,11 @@ int main(int argc, char **argv) {
   lwsl_notice("ttyd %s (libwebsockets %s)\n", TTYD_VERSION, LWS_LIBRARY_VERSION);
   print_config();
 
+  if (!http_index_init()) {
+    lwsl_err("failed to load index.html: %s\n", server->index != NULL ? server->index : "built-in");
+    return 1;
+  }
+
   // lws custom header requires lower case name, and terminating :
   if (server->auth_header != NULL) {
     size_t auth_header_len = strlen(server->auth_header);
@@ -620,16 +940,29 @@ int main(int argc, char **argv) {
     uv_signal_start(&signals[i], signal_cb, sig_nums[i]);
   }
 
+  uv_timer_t slow_timer;
+  if (server->slow_policy != SLOW_NONE) {
+    uv_timer_init(server->loop, &slow_timer);
+    uv_timer_start(&slow_timer, slow_check_cb, 1000, 1000);
+  }
+
+  if (server->metrics || server->loop_warn > 0) loop_monitor_start(server->loop, server->loop_warn);
+  if (server->trace != NULL && !trace_open(server->loop, server->trace)) return 1;
+
   lws_service(context, 0);
 
   for (int i = 0; i < sig_count; i++) {
     uv_signal_stop(&signals[i]);
   }
 #undef sig_count
+  if (server->slow_policy != SLOW_NONE) uv_timer_stop(&slow_timer);
+  loop_monitor_stop();
+  trace_close();
 
   lws_context_destroy(context);
 
   // cleanup
+  http_index_free();
   server_free(server);
 
   return 0;
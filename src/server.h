@@ -2,19 +2,29 @@
 #include <stdbool.h>
 #include <uv.h>
 
+#include "metrics.h"
 #include "pty.h"
+#include "queue.h"
+#include "record.h"
+#include "sched.h"
+#include "sync.h"
 
 // client message
 #define INPUT '0'
 #define RESIZE_TERMINAL '1'
 #define PAUSE '2'
 #define RESUME '3'
+#define LATENCY_PROBE '4'
 #define JSON_DATA '{'
 
 // server message
 #define OUTPUT '0'
 #define SET_WINDOW_TITLE '1'
 #define SET_PREFERENCES '2'
+#define LATENCY '3'
+
+// slow client policy
+enum { SLOW_NONE, SLOW_PAUSE, SLOW_SNAPSHOT, SLOW_DISCONNECT };
 
 // url paths
 struct endpoints {
@@ -22,23 +32,28 @@ struct endpoints {
   char *index;
   char *token;
   char *parent;
+  char *metrics;
 };
 
 extern volatile bool force_exit;
 extern struct lws_context *context;
 extern struct server *server;
 extern struct endpoints endpoints;
+extern const char *slow_policy_name[];
+
+bool http_index_init();
+void http_index_free();
 
 struct pss_http {
   char path[128];
   char *buffer;
   char *ptr;
   size_t len;
+  struct http_resource *resource;  // buffer is a shared body with LWS_PRE headroom owned by it, NULL if owned
 };
 
 struct pss_tty {
-  bool initialized;
-  int initial_cmd_index;
+  unsigned int id;         // session number, the track of its trace events
   bool authenticated;
   char user[30];
   char address[50];
@@ -51,7 +66,26 @@ struct pss_tty {
   size_t len;
 
   pty_process *process;
-  pty_buf_t *pty_buf;
+  send_queue_t queue;
+  bool paused;
+  bool skip_prefs;         // the client has the preferences from the page, don't send SET_PREFERENCES
+  sync_state_t sync;
+  uint64_t timer_at;       // when the lws timer of this connection fires (ms)
+  uint64_t read_at;        // when the output being processed was read from the pty (ns)
+  uint64_t dispatch_at;    // when it reached process_read_cb (ns)
+  latency_probe_t probe;   // keystroke latency probe in flight
+  latency_stats_t latency;
+
+  bool slow;               // slow client action in effect
+  uint64_t redraw_at;      // when to restore the window size shrunk for a snapshot redraw (ms), 0 if not
+  uint64_t delivered;      // bytes known to have left the socket
+  uint64_t progress_at;    // last time delivered grew (ms)
+
+  size_t deficit;
+  token_bucket_t bucket;
+  user_bucket_t *user_bucket;
+
+  record_t *record;        // asciicast recording of the session, NULL if not recording
 
   int lws_close_status;
 };
@@ -67,6 +101,7 @@ struct server {
   char *credential;        // encoded basic auth credential
   char *auth_header;       // header name used for auth proxy
   char *index;             // custom index.html
+  char *cache_control;     // Cache-Control of the built-in index.html
   char *command;           // full command line
   char **argv;             // command with arguments
   int argc;                // command + arguments count
@@ -81,6 +116,23 @@ struct server {
   bool exit_no_conn;       // whether exit on all clients disconnection
   char socket_path[255];   // UNIX domain socket path
   char terminal_type[30];  // terminal type to report
+  size_t write_quantum;    // bytes a session may send per writable round, 0 means no limit
+  uint64_t rate_limit;     // output rate limit per session (bytes/s)
+  uint64_t user_limit;     // output rate limit per user (bytes/s)
+  size_t send_queue_size;  // output to queue per client before pausing the command
+  char *spill_dir;         // where output beyond send_queue_size is spilled, NULL to pause the command instead
+  size_t spill_limit;      // output to spill per client before pausing the command
+  int slow_policy;         // what to do with a client that stopped reading
+  int slow_timeout;        // seconds without progress before a client is slow
+  size_t slow_size;        // unsent bytes before a client is slow, 0 means no limit
+  uint64_t slow_count[4];  // slow client actions taken, by policy
+  int sync_timeout;        // max ms to hold back a synchronized update, 0 disables
+  size_t frame_size;       // max ws fragment size for output, 0 sends each output as one frame
+  bool metrics;            // whether to serve prometheus metrics
+  int loop_warn;           // log event loop stalls longer than this (ms), 0 disables
+  char *trace;             // file to write the output pipeline trace to
+  const pty_backend *backend;  // where the sessions' output comes from and their input goes
+  record_opts_t record;    // session recording (--record)
 
   uv_loop_t *loop;         // the libuv event loop
 };
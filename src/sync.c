@@ -0,0 +1,112 @@
+#include "sync.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// BSU is CSI ? 2026 h, ESU is CSI ? 2026 l, they only differ in the final byte
+#define SEQ_PREFIX "\x1b[?2026"
+#define SEQ_PREFIX_LEN 7
+#define SEQ_LEN 8
+
+// a block is flushed anyway once this much output is held back
+#define SYNC_HELD_MAX (1024 * 1024)
+
+static void hold(sync_state_t *s, const char *data, size_t len) {
+  if (len == 0) return;
+  if (s->held_len + len > s->held_cap) {
+    s->held_cap = s->held_cap * 2 > s->held_len + len ? s->held_cap * 2 : s->held_len + len;
+    s->held = xrealloc(s->held, s->held_cap);
+  }
+  memcpy(s->held + s->held_len, data, len);
+  s->held_len += len;
+}
+
+static void output(sync_state_t *s, const char *data, size_t len, sync_emit_cb emit, void *ctx) {
+  if (len == 0) return;
+  if (s->active)
+    hold(s, data, len);
+  else
+    emit(ctx, data, len);
+}
+
+// the final byte of a BSU/ESU completed at data[end - 1], data[begin, end) is the rest of the sequence
+static size_t on_sequence(sync_state_t *s, const char *data, size_t begin, size_t end, uint64_t now,
+                          sync_emit_cb emit, void *ctx) {
+  char final = data[end - 1];
+  if (final == 'h' && !s->active) {
+    output(s, data, begin, emit, ctx);
+    s->active = true;
+    s->started = now;
+    return begin;
+  }
+  if (final == 'l' && s->active) {
+    hold(s, data, end);
+    sync_flush(s, emit, ctx);
+    return end;
+  }
+  return 0;
+}
+
+void sync_feed(sync_state_t *s, const char *data, size_t len, uint64_t now, sync_emit_cb emit, void *ctx) {
+  size_t pos = 0;   // data[0, pos) has been output
+  size_t scan = 0;  // where to look for the next ESC
+
+  // a sequence split across reads, its first bytes have been output already
+  if (s->carry_len > 0) {
+    size_t need = SEQ_LEN - s->carry_len;
+    size_t n = len < need ? len : need;
+    size_t cmp = n < SEQ_PREFIX_LEN - s->carry_len ? n : SEQ_PREFIX_LEN - s->carry_len;
+    if (memcmp(data, SEQ_PREFIX + s->carry_len, cmp) == 0) {
+      if (n < need) {
+        memcpy(s->carry + s->carry_len, data, n);
+        s->carry_len += n;
+        output(s, data, len, emit, ctx);
+        return;
+      }
+      pos = on_sequence(s, data, 0, need, now, emit, ctx);
+      scan = need;
+    }
+    s->carry_len = 0;
+  }
+
+  while (scan < len) {
+    // memchr is vectorized by the libc, most chunks hold few ESC bytes
+    const char *esc = memchr(data + scan, 0x1b, len - scan);
+    if (esc == NULL) break;
+    size_t i = (size_t)(esc - data);
+    size_t left = len - i;
+    if (left < SEQ_LEN) {
+      if (memcmp(esc, SEQ_PREFIX, left < SEQ_PREFIX_LEN ? left : SEQ_PREFIX_LEN) == 0) {
+        memcpy(s->carry, esc, left);
+        s->carry_len = left;
+        break;
+      }
+      // a later ESC may still start one
+      scan = i + 1;
+      continue;
+    }
+    if (memcmp(esc, SEQ_PREFIX, SEQ_PREFIX_LEN) == 0 && (esc[SEQ_PREFIX_LEN] == 'h' || esc[SEQ_PREFIX_LEN] == 'l')) {
+      size_t n = on_sequence(s, data + pos, i - pos, i + SEQ_LEN - pos, now, emit, ctx);
+      pos += n;
+      scan = i + SEQ_LEN;
+      continue;
+    }
+    scan = i + 1;
+  }
+
+  output(s, data + pos, len - pos, emit, ctx);
+  if (s->active && s->held_len >= SYNC_HELD_MAX) sync_flush(s, emit, ctx);
+}
+
+void sync_flush(sync_state_t *s, sync_emit_cb emit, void *ctx) {
+  if (s->held_len > 0) emit(ctx, s->held, s->held_len);
+  s->held_len = 0;
+  s->active = false;
+}
+
+void sync_free(sync_state_t *s) {
+  if (s->held != NULL) free(s->held);
+  memset(s, 0, sizeof(sync_state_t));
+}
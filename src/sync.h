@@ -0,0 +1,26 @@
+#ifndef TTYD_SYNC_H
+#define TTYD_SYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// synchronized output (DEC private mode 2026): output between BSU (CSI ? 2026 h) and
+// ESU (CSI ? 2026 l) is held back and emitted as a whole once the block closes.
+typedef void (*sync_emit_cb)(void *ctx, const char *data, size_t len);
+
+typedef struct {
+  bool active;       // inside a synchronized update block
+  uint64_t started;  // when the block started (ms)
+  char carry[8];     // possible sequence prefix at the end of the last chunk
+  size_t carry_len;
+  char *held;        // output held back since BSU
+  size_t held_len;
+  size_t held_cap;
+} sync_state_t;
+
+void sync_feed(sync_state_t *s, const char *data, size_t len, uint64_t now, sync_emit_cb emit, void *ctx);
+void sync_flush(sync_state_t *s, sync_emit_cb emit, void *ctx);
+void sync_free(sync_state_t *s);
+
+#endif  // TTYD_SYNC_H
@@ -0,0 +1,591 @@
+#ifndef _WIN32
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pty.h"
+#include "utils.h"
+
+// tmux: every session is a window of one tmux server (tmux -L ttyd), driven by a single control mode
+// client (tmux -C) over pipes. %output notifications feed the sessions, input goes out with send-keys -H.
+// a closed session leaves its window running, the next session of the same user resumes it: windows
+// survive browser reloads and ttyd restarts, and there is no process per session on ttyd's side.
+// without a user (--auth-header) nothing tells sessions apart, each gets a window of its own that is
+// killed with the session.
+
+#define TMUX_SOCKET "ttyd"
+#define TMUX_SESSION "ttyd"
+#define TMUX_BUF_MAX (1024 * 1024)  // output held for a paused session before tmux is asked to pause the pane
+#define TMUX_KEYS_MAX 256           // input bytes per send-keys command
+#define PANE_BUCKETS 256
+
+typedef struct tmux_pane_ {
+  uv_timer_t timer;             // first member, the close callback frees the pane through it
+  struct tmux_pane_ *next;      // all panes
+  struct tmux_pane_ *hash_next;
+  pty_process *process;
+  unsigned int serial;          // identifies the pane in responses, it may be gone by then
+  int pane;                     // %N, -1 until the window exists
+  int window;                   // @N
+  char tag[64];                 // @ttyd window option, the user the window belongs to, empty without one
+  char *buf;                    // output not delivered yet
+  size_t len;
+  size_t cap;
+  char *pending;                // input written before the window exists
+  size_t pending_len;
+  bool tmux_paused;             // the pane was paused in tmux, its output is being dropped
+  bool done;
+} tmux_pane_t;
+
+enum { CMD_IGNORE, CMD_LIST, CMD_NEW, CMD_CAPTURE, CMD_CURSOR };
+
+typedef struct tmux_cmd_ {
+  struct tmux_cmd_ *next;
+  int type;
+  unsigned int serial;
+} tmux_cmd_t;
+
+static struct {
+  uv_loop_t *loop;
+  uv_process_t *proc;           // the control client, NULL if not running
+  uv_pipe_t *in;
+  uv_pipe_t *out;
+  char *line;                   // partial line read from the control client
+  size_t line_len;
+  size_t line_cap;
+  tmux_cmd_t *head;             // commands waiting for their response, in order
+  tmux_cmd_t *tail;
+  bool in_block;                // between %begin and %end/%error
+  char **block;                 // response lines of the current block
+  size_t block_len;
+  size_t block_cap;
+  tmux_pane_t *panes;
+  tmux_pane_t *buckets[PANE_BUCKETS];
+  unsigned int serial;
+} tmux;
+
+static void close_cb(uv_handle_t *handle) { free(handle); }
+
+static void write_cb(uv_write_t *req, int status) {
+  free(req->data);
+  free(req);
+}
+
+static tmux_pane_t *pane_by_serial(unsigned int serial) {
+  for (tmux_pane_t *p = tmux.panes; p != NULL; p = p->next) {
+    if (p->serial == serial) return p;
+  }
+  return NULL;
+}
+
+static tmux_pane_t *pane_by_id(int id) {
+  for (tmux_pane_t *p = tmux.buckets[id % PANE_BUCKETS]; p != NULL; p = p->hash_next) {
+    if (p->pane == id) return p;
+  }
+  return NULL;
+}
+
+static tmux_pane_t *pane_by_window(int id) {
+  for (tmux_pane_t *p = tmux.panes; p != NULL; p = p->next) {
+    if (p->window == id) return p;
+  }
+  return NULL;
+}
+
+static void pane_set_id(tmux_pane_t *p, int pane, int window) {
+  p->pane = pane;
+  p->window = window;
+  tmux_pane_t **b = &tmux.buckets[pane % PANE_BUCKETS];
+  p->hash_next = *b;
+  *b = p;
+}
+
+static void pane_unlink(tmux_pane_t *p) {
+  for (tmux_pane_t **pp = &tmux.panes; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == p) {
+      *pp = p->next;
+      break;
+    }
+  }
+  if (p->pane < 0) return;
+  for (tmux_pane_t **pp = &tmux.buckets[p->pane % PANE_BUCKETS]; *pp != NULL; pp = &(*pp)->hash_next) {
+    if (*pp == p) {
+      *pp = p->hash_next;
+      break;
+    }
+  }
+}
+
+// queue what to do with the next response
+static void tmux_expect(int type, unsigned int serial) {
+  tmux_cmd_t *c = xmalloc(sizeof(tmux_cmd_t));
+  c->next = NULL;
+  c->type = type;
+  c->serial = serial;
+  if (tmux.tail != NULL)
+    tmux.tail->next = c;
+  else
+    tmux.head = c;
+  tmux.tail = c;
+}
+
+// send a command, `type` says what to do with its response
+static void tmux_send(int type, unsigned int serial, const char *fmt, ...) {
+  if (tmux.proc == NULL) return;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  char *cmd = xmalloc((size_t)n + 2);
+  va_start(ap, fmt);
+  vsnprintf(cmd, (size_t)n + 1, fmt, ap);
+  va_end(ap);
+  cmd[n] = '\n';
+  tmux_expect(type, serial);
+
+  uv_buf_t b = uv_buf_init(cmd, (unsigned int)n + 1);
+  uv_write_t *req = xmalloc(sizeof(uv_write_t));
+  req->data = cmd;
+  uv_write(req, (uv_stream_t *)tmux.in, &b, 1, write_cb);
+}
+
+// a double quoted argument for the tmux command parser
+static char *quote(const char *arg) {
+  char *q = xmalloc(strlen(arg) * 2 + 3);
+  char *p = q;
+  *p++ = '"';
+  for (; *arg; arg++) {
+    if (*arg == '"' || *arg == '\\' || *arg == '$') *p++ = '\\';
+    *p++ = *arg;
+  }
+  *p++ = '"';
+  *p = '\0';
+  return q;
+}
+
+static void pane_finish(tmux_pane_t *p, int code) {
+  if (p->done || p->process == NULL) return;
+  p->done = true;
+  uv_timer_stop(&p->timer);
+  p->process->exit_code = code;
+  pty_exited(p->process);
+}
+
+static void deliver_cb(uv_timer_t *timer) {
+  tmux_pane_t *p = (tmux_pane_t *)timer;
+  if (p->process == NULL || p->process->paused || p->len == 0) return;
+  // the buffer is handed over as is
+  pty_buf_t *buf = xmalloc(sizeof(pty_buf_t));
+  buf->base = p->buf;
+  buf->len = p->len;
+  p->buf = NULL;
+  p->len = p->cap = 0;
+  pty_deliver(p->process, buf);
+}
+
+static void pane_output(tmux_pane_t *p, const char *data, size_t len) {
+  if (p->tmux_paused) return;
+  if (p->len + len > p->cap) {
+    p->cap = p->len + len > p->cap * 2 ? p->len + len : p->cap * 2;
+    p->buf = xrealloc(p->buf, p->cap);
+  }
+  memcpy(p->buf + p->len, data, len);
+  p->len += len;
+  if (p->len > TMUX_BUF_MAX && p->process->paused) {
+    tmux_send(CMD_IGNORE, 0, "refresh-client -A \"%%%d:pause\"", p->pane);
+    p->tmux_paused = true;
+  }
+  // delivered on the next loop iteration, with the rest of what this read brings
+  if (!p->process->paused && !uv_is_active((uv_handle_t *)&p->timer)) uv_timer_start(&p->timer, deliver_cb, 0, 0);
+}
+
+static void pane_resize(tmux_pane_t *p) {
+  tmux_send(CMD_IGNORE, 0, "resize-window -t @%d -x %d -y %d", p->window, p->process->columns, p->process->rows);
+}
+
+// repaint the client from the pane's screen, when it resumes a window or output was dropped
+static void pane_redraw(tmux_pane_t *p) {
+  tmux_send(CMD_CAPTURE, p->serial, "capture-pane -p -e -t %%%d", p->pane);
+  tmux_send(CMD_CURSOR, p->serial, "display-message -p -t %%%d \"#{cursor_x} #{cursor_y}\"", p->pane);
+}
+
+static void pane_send_keys(tmux_pane_t *p, const char *data, size_t len) {
+  char cmd[64 + TMUX_KEYS_MAX * 3];
+  while (len > 0) {
+    size_t n = len < TMUX_KEYS_MAX ? len : TMUX_KEYS_MAX;
+    int off = snprintf(cmd, sizeof(cmd), "send-keys -t %%%d -H", p->pane);
+    for (size_t i = 0; i < n; i++) off += snprintf(cmd + off, sizeof(cmd) - off, " %02x", (unsigned char)data[i]);
+    tmux_send(CMD_IGNORE, 0, "%s", cmd);
+    data += n;
+    len -= n;
+  }
+}
+
+static void pane_ready(tmux_pane_t *p) {
+  pane_resize(p);
+  if (p->pending != NULL) {
+    pane_send_keys(p, p->pending, p->pending_len);
+    free(p->pending);
+    p->pending = NULL;
+    p->pending_len = 0;
+  }
+}
+
+static void new_window(tmux_pane_t *p) {
+  pty_process *process = p->process;
+  size_t size = 256;
+  for (char **a = process->argv; *a != NULL; a++) size += strlen(*a) * 2 + 3;
+  for (char **e = process->envp; e != NULL && *e != NULL; e++) size += strlen(*e) * 2 + 6;
+  if (process->cwd != NULL) size += strlen(process->cwd) * 2 + 6;
+  char *cmd = xmalloc(size);
+  int off = snprintf(cmd, size, "new-window -d -t %s: -P -F \"#{pane_id} #{window_id}\"", TMUX_SESSION);
+  if (process->cwd != NULL) {
+    char *q = quote(process->cwd);
+    off += snprintf(cmd + off, size - off, " -c %s", q);
+    free(q);
+  }
+  for (char **e = process->envp; e != NULL && *e != NULL; e++) {
+    if (strncmp(*e, "TERM=", 5) == 0) continue;  // tmux sets its own
+    char *q = quote(*e);
+    off += snprintf(cmd + off, size - off, " -e %s", q);
+    free(q);
+  }
+  off += snprintf(cmd + off, size - off, " --");
+  for (char **a = process->argv; *a != NULL; a++) {
+    char *q = quote(*a);
+    off += snprintf(cmd + off, size - off, " %s", q);
+    free(q);
+  }
+  tmux_send(CMD_NEW, p->serial, "%s", cmd);
+  free(cmd);
+}
+
+static void on_response(tmux_cmd_t *c, char **lines, size_t n, bool ok) {
+  tmux_pane_t *p = c->serial > 0 ? pane_by_serial(c->serial) : NULL;
+  int pane, window;
+
+  switch (c->type) {
+    case CMD_LIST:
+      if (p == NULL || p->done) break;
+      // resume a window of the same user nobody has open
+      for (size_t i = 0; ok && i < n; i++) {
+        char tag[64];
+        if (sscanf(lines[i], "@%d %%%d %63s", &window, &pane, tag) != 3 || strcmp(tag, p->tag) != 0) continue;
+        if (pane_by_id(pane) != NULL) continue;
+        pane_set_id(p, pane, window);
+        fprintf(stderr, "tmux: resuming window @%d (pane %%%d)\n", window, pane);
+        pane_ready(p);
+        pane_redraw(p);
+        return;
+      }
+      new_window(p);
+      break;
+    case CMD_NEW:
+      if (!ok || n == 0 || sscanf(lines[0], "%%%d @%d", &pane, &window) != 2) {
+        fprintf(stderr, "tmux: new-window failed: %s\n", n > 0 ? lines[0] : "");
+        if (p != NULL) pane_finish(p, 1);
+        break;
+      }
+      if (p == NULL || p->done) {
+        // the session ended before its window was there
+        tmux_send(CMD_IGNORE, 0, "kill-window -t @%d", window);
+        break;
+      }
+      pane_set_id(p, pane, window);
+      if (p->tag[0] != '\0') {
+        char *q = quote(p->tag);
+        tmux_send(CMD_IGNORE, 0, "set-option -w -t @%d @ttyd %s", window, q);
+        free(q);
+      }
+      pane_ready(p);
+      break;
+    case CMD_CAPTURE:
+      if (p == NULL || p->done || !ok) break;
+      p->tmux_paused = false;
+      p->len = 0;
+      pane_output(p, "\x1b[H\x1b[2J", 7);
+      while (n > 0 && lines[n - 1][0] == '\0') n--;
+      for (size_t i = 0; i < n; i++) {
+        if (i > 0) pane_output(p, "\r\n", 2);
+        pane_output(p, lines[i], strlen(lines[i]));
+      }
+      break;
+    case CMD_CURSOR:
+      if (p == NULL || p->done || !ok || n == 0) break;
+      int x, y;
+      if (sscanf(lines[0], "%d %d", &x, &y) == 2) {
+        char seq[32];
+        int len = snprintf(seq, sizeof(seq), "\x1b[%d;%dH", y + 1, x + 1);
+        pane_output(p, seq, (size_t)len);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// %output data escapes the bytes < 0x20 and backslash as \ooo
+static size_t unescape(char *s) {
+  char *out = s;
+  for (char *in = s; *in;) {
+    if (in[0] == '\\' && in[1] >= '0' && in[1] <= '7' && in[2] >= '0' && in[2] <= '7' && in[3] >= '0' &&
+        in[3] <= '7') {
+      *out++ = (char)(((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+      in += 4;
+    } else {
+      *out++ = *in++;
+    }
+  }
+  return (size_t)(out - s);
+}
+
+static void tmux_reset() {
+  while (tmux.head != NULL) {
+    tmux_cmd_t *c = tmux.head;
+    tmux.head = c->next;
+    free(c);
+  }
+  tmux.tail = NULL;
+  for (size_t i = 0; i < tmux.block_len; i++) free(tmux.block[i]);
+  tmux.block_len = 0;
+  tmux.in_block = false;
+  tmux.line_len = 0;
+  for (tmux_pane_t *p = tmux.panes; p != NULL; p = p->next) pane_finish(p, 1);
+}
+
+static void on_line(char *line) {
+  if (tmux.in_block) {
+    bool end = strncmp(line, "%end ", 5) == 0, error = strncmp(line, "%error ", 7) == 0;
+    if (!end && !error) {
+      if (tmux.block_len == tmux.block_cap) {
+        tmux.block_cap = tmux.block_cap > 0 ? tmux.block_cap * 2 : 32;
+        tmux.block = xrealloc(tmux.block, tmux.block_cap * sizeof(char *));
+      }
+      tmux.block[tmux.block_len++] = strdup(line);
+      return;
+    }
+    tmux.in_block = false;
+    tmux_cmd_t *c = tmux.head;
+    if (c != NULL) {
+      tmux.head = c->next;
+      if (tmux.head == NULL) tmux.tail = NULL;
+      on_response(c, tmux.block, tmux.block_len, end);
+      free(c);
+    }
+    for (size_t i = 0; i < tmux.block_len; i++) free(tmux.block[i]);
+    tmux.block_len = 0;
+    return;
+  }
+
+  if (strncmp(line, "%output %", 9) == 0) {
+    char *end;
+    int id = (int)strtol(line + 9, &end, 10);
+    tmux_pane_t *p = pane_by_id(id);
+    if (p == NULL || p->done || *end != ' ') return;
+    char *data = end + 1;
+    pane_output(p, data, unescape(data));
+  } else if (strncmp(line, "%begin ", 7) == 0) {
+    tmux.in_block = true;
+  } else if (strncmp(line, "%window-close @", 15) == 0 || strncmp(line, "%unlinked-window-close @", 24) == 0) {
+    tmux_pane_t *p = pane_by_window(atoi(strchr(line, '@') + 1));
+    if (p != NULL) pane_finish(p, 0);
+  } else if (strncmp(line, "%exit", 5) == 0) {
+    fprintf(stderr, "tmux: control client exited\n");
+    tmux_reset();
+  }
+}
+
+static void alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+  buf->base = xmalloc(suggested_size);
+  buf->len = suggested_size;
+}
+
+static void read_cb(uv_stream_t *stream, ssize_t n, const uv_buf_t *buf) {
+  if (n < 0) {
+    uv_read_stop(stream);
+    tmux_reset();
+  }
+  for (ssize_t i = 0; i < n; i++) {
+    char ch = buf->base[i];
+    if (ch == '\n') {
+      if (tmux.line_len > 0 && tmux.line[tmux.line_len - 1] == '\r') tmux.line_len--;
+      tmux.line[tmux.line_len] = '\0';
+      on_line(tmux.line);
+      tmux.line_len = 0;
+      continue;
+    }
+    if (tmux.line_len + 2 > tmux.line_cap) {
+      tmux.line_cap = tmux.line_cap > 0 ? tmux.line_cap * 2 : 4096;
+      tmux.line = xrealloc(tmux.line, tmux.line_cap);
+    }
+    tmux.line[tmux.line_len++] = ch;
+  }
+  if (buf->base != NULL) free(buf->base);
+}
+
+static void exit_cb(uv_process_t *proc, int64_t exit_status, int term_signal) {
+  fprintf(stderr, "tmux: control client exited with code %d\n", (int)exit_status);
+  uv_close((uv_handle_t *)proc, close_cb);
+  uv_close((uv_handle_t *)tmux.in, close_cb);
+  uv_close((uv_handle_t *)tmux.out, close_cb);
+  tmux.proc = NULL;
+  tmux_reset();
+}
+
+static int tmux_start(uv_loop_t *loop) {
+  tmux.loop = loop;
+  tmux.in = xmalloc(sizeof(uv_pipe_t));
+  tmux.out = xmalloc(sizeof(uv_pipe_t));
+  uv_pipe_init(loop, tmux.in, 0);
+  uv_pipe_init(loop, tmux.out, 0);
+
+  uv_stdio_container_t stdio[3];
+  stdio[0].flags = UV_CREATE_PIPE | UV_READABLE_PIPE;
+  stdio[0].data.stream = (uv_stream_t *)tmux.in;
+  stdio[1].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+  stdio[1].data.stream = (uv_stream_t *)tmux.out;
+  stdio[2].flags = UV_INHERIT_FD;
+  stdio[2].data.fd = 2;
+
+  // attach to the session, created with a placeholder window when the server isn't running
+  char *args[] = {"tmux", "-L", TMUX_SOCKET, "-C", "new-session", "-A", "-s", TMUX_SESSION, "cat", NULL};
+  uv_process_options_t options;
+  memset(&options, 0, sizeof(options));
+  options.file = args[0];
+  options.args = args;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+  options.exit_cb = exit_cb;
+
+  tmux.proc = xmalloc(sizeof(uv_process_t));
+  int status = uv_spawn(loop, tmux.proc, &options);
+  if (status != 0) {
+    fprintf(stderr, "tmux: failed to start the control client: %s\n", uv_strerror(status));
+    uv_close((uv_handle_t *)tmux.proc, close_cb);
+    uv_close((uv_handle_t *)tmux.in, close_cb);
+    uv_close((uv_handle_t *)tmux.out, close_cb);
+    tmux.proc = NULL;
+    return status;
+  }
+  fprintf(stderr, "tmux: started the control client, pid: %d\n", tmux.proc->pid);
+  uv_read_start((uv_stream_t *)tmux.out, alloc_cb, read_cb);
+  // the response to new-session, an empty line would detach the client
+  tmux_expect(CMD_IGNORE, 0);
+  return 0;
+}
+
+static int tmux_spawn(pty_process *process) {
+  if (process->argv == NULL || process->argv[0] == NULL) return UV_EINVAL;
+  if (tmux.proc == NULL) {
+    int status = tmux_start(process->loop);
+    if (status != 0) return status;
+  }
+
+  tmux_pane_t *p = xmalloc(sizeof(tmux_pane_t));
+  memset(p, 0, sizeof(tmux_pane_t));
+  p->process = process;
+  p->serial = ++tmux.serial;
+  p->pane = p->window = -1;
+  for (char **e = process->envp; e != NULL && *e != NULL; e++) {
+    if (strncmp(*e, "TTYD_USER=", 10) == 0) snprintf(p->tag, sizeof(p->tag), "ttyd:%s", *e + 10);
+  }
+  // the list output is split at spaces and a command ends at a newline, the rest is quoted
+  for (char *t = p->tag; *t; t++) {
+    if (*t == ' ' || (unsigned char)*t < 0x20 || *t == 0x7f) *t = '_';
+  }
+  uv_timer_init(process->loop, &p->timer);
+  p->next = tmux.panes;
+  tmux.panes = p;
+  process->data = p;
+
+  if (p->tag[0] == '\0')
+    new_window(p);
+  else
+    tmux_send(CMD_LIST, p->serial, "list-windows -t %s: -F \"#{window_id} #{pane_id} #{@ttyd}\"", TMUX_SESSION);
+  return 0;
+}
+
+static void tmux_pause(pty_process *process) {
+  tmux_pane_t *p = (tmux_pane_t *)process->data;
+  uv_timer_stop(&p->timer);
+}
+
+static bool tmux_resume(pty_process *process) {
+  tmux_pane_t *p = (tmux_pane_t *)process->data;
+  if (p->done) return false;
+  if (p->tmux_paused) {
+    tmux_send(CMD_IGNORE, 0, "refresh-client -A \"%%%d:continue\"", p->pane);
+    pane_redraw(p);
+    return true;
+  }
+  if (p->len > 0) uv_timer_start(&p->timer, deliver_cb, 0, 0);
+  return true;
+}
+
+static int tmux_write(pty_process *process, pty_buf_t *buf) {
+  tmux_pane_t *p = (tmux_pane_t *)process->data;
+  if (!p->done) {
+    if (p->pane >= 0) {
+      pane_send_keys(p, buf->base, buf->len);
+    } else {
+      p->pending = xrealloc(p->pending, p->pending_len + buf->len);
+      memcpy(p->pending + p->pending_len, buf->base, buf->len);
+      p->pending_len += buf->len;
+    }
+  }
+  pty_buf_free(buf);
+  return 0;
+}
+
+static bool tmux_resize(pty_process *process) {
+  tmux_pane_t *p = (tmux_pane_t *)process->data;
+  if (p->pane < 0 || p->done) return true;
+  pane_resize(p);
+  return true;
+}
+
+static bool tmux_redraw(pty_process *process) {
+  tmux_pane_t *p = (tmux_pane_t *)process->data;
+  if (p->pane < 0 || p->done) return false;
+  pane_redraw(p);
+  return true;
+}
+
+// the window keeps running, it is resumed by the next session of the user. a window without a user
+// can't be resumed, it goes with the session
+static bool tmux_kill(pty_process *process, int sig) {
+  tmux_pane_t *p = (tmux_pane_t *)process->data;
+  if (p->tag[0] == '\0' && p->window >= 0 && !p->done) tmux_send(CMD_IGNORE, 0, "kill-window -t @%d", p->window);
+  pane_finish(p, 0);
+  return true;
+}
+
+static bool tmux_running(pty_process *process) {
+  tmux_pane_t *p = (tmux_pane_t *)process->data;
+  return p != NULL && !p->done;
+}
+
+static void pane_close_cb(uv_handle_t *handle) {
+  tmux_pane_t *p = (tmux_pane_t *)handle;
+  if (p->buf != NULL) free(p->buf);
+  if (p->pending != NULL) free(p->pending);
+  free(p);
+}
+
+static void tmux_free(pty_process *process) {
+  tmux_pane_t *p = (tmux_pane_t *)process->data;
+  if (p == NULL) return;
+  p->process = NULL;
+  p->done = true;
+  process->data = NULL;
+  pane_unlink(p);
+  uv_close((uv_handle_t *)&p->timer, pane_close_cb);
+}
+
+const pty_backend pty_backend_tmux = {"tmux",      tmux_spawn, tmux_pause,   tmux_resume, tmux_write,
+                                      tmux_resize, tmux_kill,  tmux_running, tmux_free, tmux_redraw};
+#endif
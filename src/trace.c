@@ -0,0 +1,123 @@
+#include "trace.h"
+
+#include <fcntl.h>
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// events are written out in blocks of TRACE_BLOCK bytes, and dropped while TRACE_PENDING_MAX
+// bytes are waiting for the disk
+#define TRACE_BLOCK (64 * 1024)
+#define TRACE_PENDING_MAX (16 * 1024 * 1024)
+
+typedef struct {
+  uv_fs_t req;
+  char *data;
+  size_t len;
+} trace_write_t;
+
+static uv_loop_t *trace_loop = NULL;
+static uv_file trace_fd = -1;
+static int64_t trace_offset = 0;  // where the next block goes, blocks may complete out of order
+static uint64_t trace_start = 0;  // ns, the timestamps are relative to it
+static char *block = NULL;
+static size_t block_len = 0;
+static bool first_event = true;
+static size_t pending = 0;  // bytes handed to the thread pool, not written yet
+static uint64_t dropped = 0;
+
+static void write_cb(uv_fs_t *req) {
+  trace_write_t *w = (trace_write_t *)req;
+  if (req->result < 0) lwsl_warn("failed to write trace: %s\n", uv_strerror((int)req->result));
+  pending -= w->len;
+  uv_fs_req_cleanup(req);
+  free(w->data);
+  free(w);
+}
+
+// write the current block, synchronously if `sync` (when closing)
+static void block_flush(bool sync) {
+  if (block_len == 0) return;
+  trace_write_t *w = xmalloc(sizeof(trace_write_t));
+  w->data = block;
+  w->len = block_len;
+  uv_buf_t buf = uv_buf_init(w->data, (unsigned int)w->len);
+  int64_t offset = trace_offset;
+  trace_offset += (int64_t)block_len;
+  block = NULL;
+  block_len = 0;
+
+  pending += w->len;
+  if (sync) {
+    uv_fs_write(NULL, &w->req, trace_fd, &buf, 1, offset, NULL);
+    write_cb(&w->req);
+  } else if (uv_fs_write(trace_loop, &w->req, trace_fd, &buf, 1, offset, write_cb) != 0) {
+    pending -= w->len;
+    free(w->data);
+    free(w);
+  }
+}
+
+static void block_append(const char *data, size_t len) {
+  if (block == NULL) block = xmalloc(TRACE_BLOCK + 256);
+  memcpy(block + block_len, data, len);
+  block_len += len;
+  if (block_len >= TRACE_BLOCK) block_flush(false);
+}
+
+bool trace_open(uv_loop_t *loop, const char *path) {
+  uv_fs_t req;
+  int fd = uv_fs_open(NULL, &req, path, O_WRONLY | O_CREAT | O_TRUNC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    lwsl_err("can not open trace file %s: %s\n", path, uv_strerror(fd));
+    return false;
+  }
+  trace_loop = loop;
+  trace_fd = fd;
+  trace_start = uv_hrtime();
+  // JSON array format, the closing ] is optional so a trace cut short by a crash still loads
+  block_append("[\n", 2);
+  // ttyd may exit() from a callback (eg: --once)
+  atexit(trace_close);
+  return true;
+}
+
+bool trace_enabled() { return trace_fd >= 0; }
+
+void trace_event(const char *name, unsigned int sid, uint64_t start, uint64_t end, size_t bytes) {
+  if (trace_fd < 0) return;
+  if (pending >= TRACE_PENDING_MAX) {
+    dropped++;
+    return;
+  }
+  char buf[256];
+  uint64_t ts = start > trace_start ? start - trace_start : 0;
+  uint64_t dur = end > start ? end - start : 0;
+  int n = snprintf(buf, sizeof(buf),
+                   "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u,"
+                   "\"args\":{\"bytes\":%zu}}",
+                   first_event ? "" : ",\n", name, sid, (unsigned long long)(ts / 1000), (unsigned int)(ts % 1000),
+                   (unsigned long long)(dur / 1000), (unsigned int)(dur % 1000), bytes);
+  if (n < 0 || (size_t)n >= sizeof(buf)) return;
+  first_event = false;
+  block_append(buf, (size_t)n);
+}
+
+void trace_close() {
+  if (trace_fd < 0) return;
+  block_append("\n]\n", 3);
+  block_flush(true);
+  if (dropped > 0) lwsl_warn("trace: %llu events dropped, the disk couldn't keep up\n", (unsigned long long)dropped);
+
+  // blocks still being written on the thread pool need the fd, we are exiting anyway
+  if (pending == 0) {
+    uv_fs_t req;
+    uv_fs_close(NULL, &req, trace_fd, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  trace_fd = -1;
+}
@@ -0,0 +1,18 @@
+#ifndef TTYD_TRACE_H
+#define TTYD_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// output pipeline tracing in the Chrome trace event format (chrome://tracing, Perfetto), events are
+// buffered and written to the file on the thread pool
+bool trace_open(uv_loop_t *loop, const char *path);
+void trace_close();
+bool trace_enabled();
+
+// a complete event of `name` on the track of session `sid`, times are uv_hrtime() (ns)
+void trace_event(const char *name, unsigned int sid, uint64_t start, uint64_t end, size_t bytes);
+
+#endif  // TTYD_TRACE_H
@@ -13,6 +13,18 @@
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#elif defined(__FreeBSD__)
+#include <sys/filio.h>
+#include <sys/ioctl.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
 #if defined(__linux__) && !defined(__ANDROID__)
 const char *sys_signame[NSIG] = {
     "zero", "HUP",  "INT",  "QUIT", "ILL",    "TRAP",   "ABRT",  "UNUSED", "FPE",  "KILL", "USR1",
@@ -117,6 +129,33 @@ int open_uri(char *uri) {
 #endif
 }
 
+int socket_outq(int fd) {
+  int n = -1;
+  if (fd < 0) return -1;
+#if defined(__linux__)
+  if (ioctl(fd, SIOCOUTQ, &n) != 0) return -1;
+#elif defined(__FreeBSD__)
+  if (ioctl(fd, FIONWRITE, &n) != 0) return -1;
+#elif defined(__APPLE__)
+  socklen_t len = sizeof(n);
+  if (getsockopt(fd, SOL_SOCKET, SO_NWRITE, &n, &len) != 0) return -1;
+#endif
+  return n;
+}
+
+int socket_sndbuf_free(int fd) {
+#ifndef _WIN32
+  int size = 0;
+  socklen_t len = sizeof(size);
+  if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len) != 0) return -1;
+  int queued = socket_outq(fd);
+  if (queued < 0) return -1;
+  return size > queued ? size - queued : 0;
+#else
+  return -1;
+#endif
+}
+
 #ifdef _WIN32
 char *strsep(char **sp, char *sep) {
   char *p, *s;
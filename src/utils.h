@@ -31,6 +31,12 @@ int get_sig(const char *sig_name);
 // Open uri with the default application of system
 int open_uri(char *uri);
 
+// Get bytes in the socket send queue not yet sent (or acked) by the kernel, -1 if unknown
+int socket_outq(int fd);
+
+// Get free space in the socket send buffer, -1 if unknown
+int socket_sndbuf_free(int fd);
+
 #ifdef _WIN32
 char *strsep(char **sp, char *sep);
 const char *quote_arg(const char *arg);
@@ -0,0 +1,79 @@
+import base64
+import gzip
+import http.client
+import unittest
+
+from ttyd_test import Ttyd
+
+
+class KeepAliveTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.ttyd = Ttyd('cat')
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.ttyd.stop()
+
+    def get(self, conn, path, **headers):
+        conn.request('GET', path, headers=headers)
+        resp = conn.getresponse()
+        body = resp.read()
+        self.assertFalse(resp.will_close, 'connection not kept alive after %s %d' % (path, resp.status))
+        return resp, body
+
+    def test_requests_on_one_connection(self):
+        conn = http.client.HTTPConnection('127.0.0.1', self.ttyd.port, timeout=10)
+        try:
+            resp, body = self.get(conn, '/', **{'Accept-Encoding': 'gzip'})
+            sock = conn.sock
+            self.assertEqual(resp.status, 200)
+            self.assertEqual(resp.getheader('Content-Encoding'), 'gzip')
+            self.assertEqual(len(body), int(resp.getheader('Content-Length')))
+            self.assertTrue(gzip.decompress(body).startswith(b'<!DOCTYPE html>'))
+            etag = resp.getheader('ETag')
+
+            resp, body = self.get(conn, '/', **{'Accept-Encoding': 'gzip', 'If-None-Match': etag})
+            self.assertEqual(resp.status, 304)
+            self.assertEqual(body, b'')
+            self.assertIs(conn.sock, sock)
+
+            resp, body = self.get(conn, '/')
+            self.assertEqual(resp.status, 200)
+            self.assertIsNone(resp.getheader('Content-Encoding'))
+            self.assertEqual(len(body), int(resp.getheader('Content-Length')))
+            self.assertTrue(body.startswith(b'<!DOCTYPE html>'))
+            self.assertIs(conn.sock, sock)
+
+            resp, body = self.get(conn, '/token')
+            self.assertEqual(resp.status, 200)
+            self.assertIs(conn.sock, sock)
+        finally:
+            conn.close()
+
+
+class CredentialCacheTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.ttyd = Ttyd('-c', 'user:secret', '--cache-control', 'public, max-age=600', 'cat')
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.ttyd.stop()
+
+    def test_index_with_the_credential_is_not_cached(self):
+        conn = http.client.HTTPConnection('127.0.0.1', self.ttyd.port, timeout=10)
+        try:
+            auth = 'Basic ' + base64.b64encode(b'user:secret').decode()
+            conn.request('GET', '/', headers={'Authorization': auth, 'Accept-Encoding': 'gzip'})
+            resp = conn.getresponse()
+            body = resp.read()
+            self.assertEqual(resp.status, 200)
+            self.assertIn(base64.b64encode(b'user:secret'), gzip.decompress(body))
+            self.assertEqual(resp.getheader('Cache-Control'), 'no-store, private')
+        finally:
+            conn.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
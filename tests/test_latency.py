@@ -0,0 +1,50 @@
+import json
+import time
+import unittest
+
+from ttyd_test import Ttyd, WebSocket
+
+
+class LatencyProbeTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.ttyd = Ttyd('-W', 'cat')
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.ttyd.stop()
+
+    def messages(self, ws, seconds):
+        deadline = time.time() + seconds
+        messages = []
+        while True:
+            left = deadline - time.time()
+            message = ws.recv(left) if left > 0 else None
+            if message is None:
+                return messages
+            messages.append(message)
+
+    def test_one_answer_per_probe(self):
+        ws = WebSocket(self.ttyd.port)
+        try:
+            ws.auth()
+            self.messages(ws, 0.5)
+
+            # the probe measures the input right after it, the echo of the later input must not answer it again
+            ws.send(b'4{"id":1}')
+            ws.send(b'0a')
+            messages = self.messages(ws, 0.5)
+            for data in (b'0b', b'0c', b'0d\r'):
+                ws.send(data)
+                messages += self.messages(ws, 0.3)
+
+            answers = [m for m in messages if m.startswith(b'3')]
+            self.assertEqual(len(answers), 1, answers)
+            self.assertEqual(json.loads(answers[0][1:])['id'], 1)
+            self.assertTrue(any(m.startswith(b'0') and b'd' in m for m in messages), messages)
+        finally:
+            ws.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
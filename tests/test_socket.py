@@ -0,0 +1,91 @@
+import os
+import shutil
+import socket
+import tempfile
+import threading
+import time
+import unittest
+
+from ttyd_test import Ttyd, WebSocket
+
+
+class EchoServer:
+    """stand-in for the socket a session attaches to: echoes the input, closes its end on 'bye'"""
+
+    def __init__(self, path):
+        self.received = b''
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(path)
+        self.sock.listen(4)
+        threading.Thread(target=self.serve, daemon=True).start()
+
+    def serve(self):
+        while True:
+            try:
+                conn, _ = self.sock.accept()
+            except OSError:
+                return
+            threading.Thread(target=self.echo, args=(conn,), daemon=True).start()
+
+    def echo(self, conn):
+        with conn:
+            while True:
+                data = conn.recv(4096)
+                if not data:
+                    return
+                self.received += data
+                conn.sendall(data)
+                if b'bye' in self.received:
+                    return
+
+    def close(self):
+        self.sock.close()
+
+
+class SocketBackendTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.dir = tempfile.mkdtemp()
+        path = os.path.join(cls.dir, 'echo.sock')
+        cls.server = EchoServer(path)
+        cls.ttyd = Ttyd('-W', '--backend', 'socket', 'unix:' + path)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.ttyd.stop()
+        cls.server.close()
+        shutil.rmtree(cls.dir, ignore_errors=True)
+
+    def output_until(self, ws, needle, seconds):
+        output = b''
+        deadline = time.time() + seconds
+        while needle not in output and time.time() < deadline:
+            message = ws.recv(deadline - time.time())
+            if message is None:
+                break
+            if message.startswith(b'0'):
+                output += message[1:]
+        return output
+
+    def test_input_round_trip_and_close_at_eof(self):
+        ws = WebSocket(self.ttyd.port)
+        try:
+            ws.auth()
+            ws.send(b'0hello')
+            self.assertIn(b'hello', self.output_until(ws, b'hello', 5))
+
+            # the stand-in closes its end, the session ends with it
+            ws.send(b'0bye')
+            self.output_until(ws, b'bye', 5)
+            start = time.time()
+            while ws.recv(5) is not None:
+                pass
+            self.assertLess(time.time() - start, 5, 'the connection was not closed')
+            self.assertEqual(ws.close_code, 1000)
+            self.assertEqual(self.server.received, b'hellobye')
+        finally:
+            ws.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,59 @@
+import http.client
+import re
+import shutil
+import tempfile
+import time
+import unittest
+
+from ttyd_test import Ttyd, WebSocket
+
+LIMIT = 256 * 1024
+# one pty read may be held behind a full spill, the command is paused after it
+HELD_MAX = 128 * 1024
+
+
+class SpillLimitTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.dir = tempfile.mkdtemp()
+        cls.ttyd = Ttyd('--metrics', '--sync-timeout', '0', '--send-queue-size', '64k', '--spill-dir', cls.dir,
+                        '--spill-limit', str(LIMIT), 'yes')
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.ttyd.stop()
+        shutil.rmtree(cls.dir, ignore_errors=True)
+
+    def spilled(self):
+        conn = http.client.HTTPConnection('127.0.0.1', self.ttyd.port, timeout=10)
+        try:
+            conn.request('GET', '/metrics')
+            body = conn.getresponse().read().decode()
+        finally:
+            conn.close()
+        return float(re.search(r'^ttyd_send_queue_spill_bytes (\S+)$', body, re.M).group(1))
+
+    def test_spill_stays_within_the_limit(self):
+        ws = WebSocket(self.ttyd.port)
+        try:
+            ws.auth()
+            # a slow reader: the queue drains while the spill is full, that must not read more from the pty
+            samples = []
+            received = 0
+            deadline = time.time() + 3
+            while time.time() < deadline:
+                for _ in range(10):
+                    message = ws.recv(1)
+                    self.assertIsNotNone(message)
+                    received += len(message)
+                    time.sleep(0.005)
+                samples.append(self.spilled())
+            self.assertGreater(received, 0)
+            self.assertGreater(max(samples), 0, 'nothing was spilled')
+            self.assertLessEqual(max(samples), LIMIT + HELD_MAX, samples)
+        finally:
+            ws.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,39 @@
+import time
+import unittest
+
+from ttyd_test import Ttyd, WebSocket
+
+# a BSU split across reads behind a lone ESC, then the block in two reads: it must still be held back and
+# sent as one message
+SCRIPT = r"printf 'a\033\033[?20'; sleep 0.2; printf '26hX'; sleep 0.2; printf 'Y\033[?2026l'; sleep 0.5"
+
+
+class SyncSplitTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.ttyd = Ttyd('--sync-timeout', '2000', 'sh', '-c', SCRIPT)
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.ttyd.stop()
+
+    def test_sequence_after_a_lone_esc(self):
+        ws = WebSocket(self.ttyd.port)
+        try:
+            ws.auth()
+            output = []
+            deadline = time.time() + 5
+            while time.time() < deadline:
+                message = ws.recv(deadline - time.time())
+                if message is None:
+                    break
+                if message.startswith(b'0'):
+                    output.append(message[1:])
+            self.assertIn(b'Y\x1b[?2026l', b''.join(output), output)
+            self.assertTrue(any(b'XY\x1b[?2026l' in m for m in output), output)
+        finally:
+            ws.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
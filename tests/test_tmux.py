@@ -0,0 +1,111 @@
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+import unittest
+
+from ttyd_test import Ttyd, WebSocket
+
+USER_HEADER = 'X-Ttyd-User'
+
+
+def tmux(*args):
+    return subprocess.run(['tmux', '-L', 'ttyd'] + list(args), capture_output=True, text=True).stdout
+
+
+@unittest.skipIf(shutil.which('tmux') is None, 'tmux is not installed')
+class TmuxBackendTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        # a tmux server of our own, not the ttyd one of the user running the tests
+        cls.dir = tempfile.mkdtemp()
+        cls.tmpdir = os.environ.get('TMUX_TMPDIR')
+        os.environ['TMUX_TMPDIR'] = cls.dir
+        cls.anonymous = Ttyd('-W', '--backend', 'tmux', 'sh')
+        cls.users = Ttyd('-W', '-H', USER_HEADER.lower() + ':', '--backend', 'tmux', 'sh')
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.anonymous.stop()
+        cls.users.stop()
+        tmux('kill-server')
+        if cls.tmpdir is None:
+            del os.environ['TMUX_TMPDIR']
+        else:
+            os.environ['TMUX_TMPDIR'] = cls.tmpdir
+        shutil.rmtree(cls.dir, ignore_errors=True)
+
+    def windows(self):
+        """window id -> @ttyd tag"""
+        lines = tmux('list-windows', '-t', 'ttyd:', '-F', '#{window_id} #{@ttyd}').splitlines()
+        return dict((line.split(' ', 1) + [''])[:2] for line in lines)
+
+    def wait(self, condition, seconds=5):
+        deadline = time.time() + seconds
+        while not condition() and time.time() < deadline:
+            time.sleep(0.05)
+        return condition()
+
+    def session(self, ttyd, user=None):
+        ws = WebSocket(ttyd.port, headers={USER_HEADER: user} if user is not None else None)
+        ws.auth()
+        return ws
+
+    def output_until(self, ws, needle, seconds=5):
+        output = b''
+        deadline = time.time() + seconds
+        while needle not in output and time.time() < deadline:
+            message = ws.recv(deadline - time.time())
+            if message is None:
+                break
+            if message.startswith(b'0'):
+                output += message[1:]
+        return output
+
+    def test_anonymous_window_is_killed_on_close(self):
+        before = self.windows()
+        ws = self.session(self.anonymous)
+        try:
+            ws.send(b'0echo anon-$((6*7))\r')
+            self.assertIn(b'anon-42', self.output_until(ws, b'anon-42'))
+            new = set(self.windows()) - set(before)
+            self.assertEqual(len(new), 1, self.windows())
+            window = new.pop()
+            self.assertEqual(self.windows()[window].strip(), '')
+        finally:
+            ws.close()
+        self.assertTrue(self.wait(lambda: window not in self.windows()), self.windows())
+
+        # the next anonymous session doesn't get that window back
+        ws = self.session(self.anonymous)
+        try:
+            ws.send(b'0echo again-$((6*7))\r')
+            output = self.output_until(ws, b'again-42')
+            self.assertIn(b'again-42', output)
+            self.assertNotIn(b'anon-42', output)
+        finally:
+            ws.close()
+
+    def test_user_window_is_resumed(self):
+        ws = self.session(self.users, 'alice')
+        try:
+            ws.send(b'0echo alice-$((6*7))\r')
+            self.assertIn(b'alice-42', self.output_until(ws, b'alice-42'))
+        finally:
+            ws.close()
+        windows = [w for w, tag in self.windows().items() if tag == 'ttyd:alice']
+        self.assertEqual(len(windows), 1, self.windows())
+
+        # the window outlives the session, the next one of the same user is a repaint of it
+        time.sleep(0.5)
+        ws = self.session(self.users, 'alice')
+        try:
+            self.assertIn(b'alice-42', self.output_until(ws, b'alice-42'))
+            self.assertEqual([w for w, tag in self.windows().items() if tag == 'ttyd:alice'], windows)
+        finally:
+            ws.close()
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,111 @@
+# helpers for the end to end tests: run the ttyd binary from $TTYD on a free port and talk to it
+import base64
+import json
+import os
+import socket
+import struct
+import subprocess
+import time
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+class Ttyd:
+    def __init__(self, *args):
+        self.port = free_port()
+        cmd = [os.environ['TTYD'], '-p', str(self.port)] + list(args)
+        self.proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        deadline = time.time() + 10
+        while True:
+            try:
+                socket.create_connection(('127.0.0.1', self.port), timeout=1).close()
+                return
+            except OSError:
+                if self.proc.poll() is not None or time.time() > deadline:
+                    self.stop()
+                    raise RuntimeError('ttyd did not start: %s' % ' '.join(cmd))
+                time.sleep(0.05)
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.terminate()
+            try:
+                self.proc.wait(5)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+
+
+class WebSocket:
+    """minimal client of the tty protocol, messages are the command byte followed by the payload"""
+
+    def __init__(self, port, path='/ws', headers=None):
+        self.close_code = None
+        self.sock = socket.create_connection(('127.0.0.1', port), timeout=10)
+        key = base64.b64encode(os.urandom(16)).decode()
+        request = (
+            'GET %s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n'
+            'Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Protocol: tty\r\n%s\r\n'
+        ) % (path, port, key, ''.join('%s: %s\r\n' % h for h in (headers or {}).items()))
+        self.sock.sendall(request.encode())
+        head = b''
+        while b'\r\n\r\n' not in head:
+            data = self.sock.recv(1)
+            if not data:
+                raise RuntimeError('connection closed during the websocket handshake')
+            head += data
+        if not head.startswith(b'HTTP/1.1 101'):
+            raise RuntimeError('websocket handshake failed: %r' % head.split(b'\r\n')[0])
+
+    def send(self, data, opcode=2):
+        mask = os.urandom(4)
+        n = len(data)
+        if n < 126:
+            header = struct.pack('!BB', 0x80 | opcode, 0x80 | n)
+        elif n < 65536:
+            header = struct.pack('!BBH', 0x80 | opcode, 0x80 | 126, n)
+        else:
+            header = struct.pack('!BBQ', 0x80 | opcode, 0x80 | 127, n)
+        self.sock.sendall(header + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(data)))
+
+    def auth(self, token='', columns=80, rows=24):
+        self.send(json.dumps({'AuthToken': token, 'columns': columns, 'rows': rows}).encode())
+
+    def _recv_exact(self, n):
+        data = b''
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            if not chunk:
+                raise EOFError
+            data += chunk
+        return data
+
+    def recv(self, timeout):
+        """the next message with fragments joined, None on timeout or close (close_code is set then)"""
+        self.sock.settimeout(timeout)
+        message = b''
+        try:
+            while True:
+                b0, b1 = self._recv_exact(2)
+                n = b1 & 0x7F
+                if n == 126:
+                    n = struct.unpack('!H', self._recv_exact(2))[0]
+                elif n == 127:
+                    n = struct.unpack('!Q', self._recv_exact(8))[0]
+                payload = self._recv_exact(n)
+                if b0 & 0x0F == 8:
+                    if len(payload) >= 2:
+                        self.close_code = struct.unpack('!H', payload[:2])[0]
+                    return None
+                message += payload
+                if b0 & 0x80:
+                    return message
+        except (socket.timeout, EOFError):
+            return None
+
+    def close(self):
+        self.sock.close()